@@ -0,0 +1,66 @@
+// Times the sphere grid against the plain loop in testbatches over a
+// cloud of small spheres, and checks both find the same hits.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <raytracer/math.h>
+#include <raytracer/obj.h>
+#include <raytracer/raytracer.h>
+
+#define NSPHERES 200000
+#define NRAYS 2000
+
+static float frand(float lo, float hi) {
+    return lo + (hi - lo) * rand() / RAND_MAX;
+}
+
+// wall clock, the grid builds on several threads
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main() {
+    srand(1);
+    Shape **shapes = malloc(NSPHERES * sizeof(Shape *));
+    for (int i = 0; i < NSPHERES; i++) {
+        Vec3 c = vec3(frand(-50, 50), frand(-50, 50), frand(-150, -5));
+        shapes[i] = AS_SHAPE(newsphere(c, frand(0.05, 0.2)));
+    }
+    static Ray rays[NRAYS];
+    for (int i = 0; i < NRAYS; i++)
+        rays[i] = (Ray){vec3(0, 0, 0), vnorm(vec3(frand(-0.8, 0.8), frand(-0.6, 0.6), -1))};
+
+    double t0 = now();
+    Batches b = {0};
+    buildbatches(&b, shapes, NSPHERES);
+    double tbatch = now() - t0;
+    t0 = now();
+    Grid *g = newgrid(&b);
+    double tgrid = now() - t0;
+    printf("%-10s batches %7.3fs  grid %7.3fs  (%ix%ix%i cells)\n",
+            "build", tbatch, tgrid, g->nx, g->ny, g->nz);
+
+    static Hit linear[NRAYS], grid[NRAYS];
+    int hlin = 0, hgrid = 0, same = 0;
+    t0 = now();
+    for (int i = 0; i < NRAYS; i++)
+        hlin += testbatches(&b, &rays[i], &linear[i]);
+    double tlin = now() - t0;
+    b.grid = g;
+    t0 = now();
+    for (int i = 0; i < NRAYS; i++)
+        hgrid += testbatches(&b, &rays[i], &grid[i]);
+    double tg = now() - t0;
+    for (int i = 0; i < NRAYS; i++)
+        same += linear[i].shape == grid[i].shape && linear[i].dist == grid[i].dist;
+    printf("%-10s linear %7.3fs  grid %7.3fs  %7.1fx  (%i/%i hits, %i/%i same)\n",
+            "trace", tlin, tg, tlin / tg, hlin, hgrid, same, NRAYS);
+
+    freebatches(&b);
+    for (int i = 0; i < NSPHERES; i++)
+        freeshape(shapes[i]);
+    free(shapes);
+    return 0;
+}
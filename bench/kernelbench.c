@@ -0,0 +1,116 @@
+// Compares the closed-form sphere and plane kernels against copies of
+// the old projection based ones, both run over the same random scene.
+#include <stdio.h>
+#include <stdlib.h>
+#include <float.h>
+#include <time.h>
+#include <raytracer/math.h>
+#include <raytracer/obj.h>
+#include <raytracer/raytracer.h>
+
+#define NSPHERES 400
+#define NRAYS 4096
+#define ROUNDS 40
+
+#define NOINLINE __attribute__((noinline))
+
+static NOINLINE int old_spheredist(Vec3 center, float radius, Ray *r, float *dist) {
+    Vec3 toc = vsub(center, r->orig);
+    float dot = vdot(toc, r->dir);
+    int inside = vmag(toc) < radius;
+    if (!inside && dot < 0) return 0;
+    Vec3 proj = vproj(toc, r->dir);
+    Vec3 toray = vsub(proj, toc);
+    float raydist = vmag(toray);
+    if (raydist > radius) return 0;
+    float offset = sqrt(radius * radius - raydist * raydist);
+    if (inside) {
+        if (dot > 0) *dist = vmag(proj) + offset;
+        else *dist = offset - vmag(proj);
+    }
+    else
+        *dist = vmag(proj) - offset;
+    return 1;
+}
+
+static NOINLINE int old_testplane(ShapePlane *p, Ray *r, Hit *h) {
+    if (vdot(r->dir, p->normal) > 0) return 0;
+    Vec3 vp = vproj(r->dir, p->normal);
+    Vec3 vpp = vproj(vsub(p->point, r->orig), p->normal);
+    h->shape = AS_SHAPE(p);
+    h->point = vadd(r->orig, vmul(r->dir, vmag(vpp) / vmag(vp)));
+    h->dist = vmag(vpp) / vmag(vp);
+    h->norm = p->normal;
+    return 1;
+}
+
+// the old testbatches loop over the same shapes
+static int old_test(ShapeSphere **spheres, ShapePlane *plane, Ray *r, Hit *h) {
+    float last_dist = FLT_MAX;
+    int best = -1;
+    for (int i = 0; i < NSPHERES; i++) {
+        float dist;
+        if (!old_spheredist(spheres[i]->center, spheres[i]->radius, r, &dist)) continue;
+        if (dist > last_dist) continue;
+        last_dist = dist;
+        best = i;
+    }
+    if (best >= 0) {
+        h->shape = AS_SHAPE(spheres[best]);
+        h->dist = last_dist;
+        h->point = vadd(r->orig, vmul(r->dir, last_dist));
+        h->norm = vnorm(vsub(h->point, spheres[best]->center));
+    }
+    Hit tmp;
+    if (old_testplane(plane, r, &tmp) && tmp.dist <= last_dist) {
+        *h = tmp;
+        return 1;
+    }
+    return best >= 0;
+}
+
+static float frand(float lo, float hi) {
+    return lo + (hi - lo) * rand() / RAND_MAX;
+}
+
+static double now() {
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+int main() {
+    srand(1);
+    Shape *shapes[NSPHERES + 1];
+    ShapeSphere *spheres[NSPHERES];
+    for (int i = 0; i < NSPHERES; i++) {
+        Vec3 c = vec3(frand(-8, 8), frand(-6, 6), frand(-20, -6));
+        spheres[i] = newsphere(c, frand(0.2, 0.6));
+        shapes[i] = AS_SHAPE(spheres[i]);
+    }
+    ShapePlane *plane = newplane(vec3(0, -7, 0), vec3(0, 1, 0));
+    shapes[NSPHERES] = AS_SHAPE(plane);
+    Batches b = {0};
+    buildbatches(&b, shapes, NSPHERES + 1);
+    static Ray rays[NRAYS];
+    for (int i = 0; i < NRAYS; i++)
+        rays[i] = (Ray){vec3(0, 0, 0), vnorm(vec3(frand(-0.8, 0.8), frand(-0.6, 0.6), -1))};
+
+    int hold = 0, hnew = 0;
+    Hit h;
+    double t0 = now();
+    for (int r = 0; r < ROUNDS; r++)
+        for (int i = 0; i < NRAYS; i++)
+            hold += old_test(spheres, plane, &rays[i], &h);
+    double told = now() - t0;
+    t0 = now();
+    for (int r = 0; r < ROUNDS; r++)
+        for (int i = 0; i < NRAYS; i++)
+            hnew += testbatches(&b, &rays[i], &h);
+    double tnew = now() - t0;
+    printf("%-10s old %7.3fs  new %7.3fs  %5.2fx  (%i/%i hits)\n",
+            "kernels", told, tnew, told / tnew, hold / ROUNDS, hnew / ROUNDS);
+
+    freebatches(&b);
+    for (int i = 0; i <= NSPHERES; i++)
+        freeshape(shapes[i]);
+    return 0;
+}
@@ -0,0 +1,110 @@
+// Compares the header-inline math layer against the old out-of-line
+// versions, which are kept here as noinline copies.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <raytracer/math.h>
+
+#define N 4096
+#define ROUNDS 20000
+
+#define NOINLINE __attribute__((noinline))
+
+static NOINLINE float old_vmag(Vec3 v) {
+    return sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+}
+
+static NOINLINE Vec3 old_vmul(Vec3 v, float f) {
+    return (Vec3){v.x * f, v.y * f, v.z * f};
+}
+
+static NOINLINE float old_vdot(Vec3 a, Vec3 b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static NOINLINE Vec3 old_vnorm(Vec3 v) {
+    return old_vmul(v, 1 / old_vmag(v));
+}
+
+static NOINLINE Vec3 old_vproj(Vec3 a, Vec3 b) {
+    return old_vmul(b, old_vdot(a, b) / (old_vmag(b) * old_vmag(b)));
+}
+
+static NOINLINE float old_v4dot(Vec4 a, Vec4 b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w;
+}
+
+static NOINLINE Vec3 old_matrixmul(Matrix *m, Vec3 v) {
+    Vec4 v4 = vec4(v.x, v.y, v.z, 1);
+    float x = old_v4dot(m->rows[0], v4);
+    float y = old_v4dot(m->rows[1], v4);
+    float z = old_v4dot(m->rows[2], v4);
+    return vec3(x, y, z);
+}
+
+static float pts[N * 3];
+static Vec3 in[N], out[N];
+static volatile float sink;
+
+static double now() {
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+static void report(const char *name, double told, double tnew) {
+    printf("%-10s old %7.3fs  new %7.3fs  %5.2fx\n", name, told, tnew, told / tnew);
+}
+
+static float checksum() {
+    float f = 0;
+    for (int i = 0; i < N; i++)
+        f += out[i].x + out[i].y + out[i].z;
+    return f;
+}
+
+int main() {
+    srand(1);
+    for (int i = 0; i < N * 3; i++)
+        pts[i] = rand() / (float)RAND_MAX * 2 - 1;
+    for (int i = 0; i < N; i++)
+        in[i] = vec3(pts[i * 3], pts[i * 3 + 1], pts[i * 3 + 2] + 2);
+    Matrix m;
+    matrixinit(&m);
+    matrixrotate(&m, vec3(1, 1, 0), 30);
+    matrixtranslate(&m, vec3(1, 2, 3));
+
+    double t0, told, tnew;
+
+#define BENCH(name, oldexpr, newexpr) \
+    t0 = now(); \
+    for (int r = 0; r < ROUNDS; r++) \
+        for (int i = 0; i < N; i++) \
+            out[i] = oldexpr; \
+    told = now() - t0; \
+    sink = checksum(); \
+    t0 = now(); \
+    for (int r = 0; r < ROUNDS; r++) \
+        for (int i = 0; i < N; i++) \
+            out[i] = newexpr; \
+    tnew = now() - t0; \
+    sink = checksum(); \
+    report(name, told, tnew);
+
+    BENCH("vnorm", old_vnorm(in[i]), vnorm(in[i]));
+    BENCH("vproj", old_vproj(in[i], in[N - 1 - i]), vproj(in[i], in[N - 1 - i]));
+    BENCH("matrixmul", old_matrixmul(&m, in[i]), matrixmul(&m, in[i]));
+
+    t0 = now();
+    for (int r = 0; r < ROUNDS; r++)
+        for (int i = 0; i < N; i++)
+            out[i] = old_matrixmul(&m, vec3(pts[i * 3], pts[i * 3 + 1], pts[i * 3 + 2]));
+    told = now() - t0;
+    sink = checksum();
+    t0 = now();
+    for (int r = 0; r < ROUNDS; r++)
+        matrixmulv(&m, pts, out, N);
+    tnew = now() - t0;
+    sink = checksum();
+    report("matrixmulv", told, tnew);
+
+    return 0;
+}
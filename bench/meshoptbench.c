@@ -0,0 +1,114 @@
+// Traces a heightfield exported the way a careless OBJ writer would,
+// three verts per triangle, shuffled faces and some slivers, then the
+// same mesh after optimizeobj, and checks both find the same hits.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <raytracer/math.h>
+#include <raytracer/obj.h>
+#include <raytracer/raytracer.h>
+#include <raytracer/util.h>
+
+#define GRID 400
+#define NDEGEN 5000
+#define NRAYS 200000
+
+static Allocator _alloc = {"bench"};
+
+static float frand(float lo, float hi) {
+    return lo + (hi - lo) * rand() / RAND_MAX;
+}
+
+static float height(int x, int z) {
+    return sinf(x * 0.11f) * cosf(z * 0.07f) * 4;
+}
+
+static Obj *messyobj() {
+    srand(1);
+    Obj *o = xcalloc(&_alloc, 1, sizeof(Obj));
+    int nquads = GRID * GRID;
+    o->ntris = nquads * 2 + NDEGEN;
+    o->nverts = o->ntris * 3;
+    o->verts = xmalloc(&_alloc, o->nverts * 3 * sizeof(float));
+    o->tris = xmalloc(&_alloc, o->ntris * 3 * sizeof(int));
+    o->normidx = xmalloc(&_alloc, o->ntris * 3 * sizeof(int));
+    int nt = 0;
+    for (int z = 0; z < GRID; z++) {
+        for (int x = 0; x < GRID; x++) {
+            int corners[2][3][2] = {
+                {{x, z}, {x, z + 1}, {x + 1, z}},
+                {{x + 1, z}, {x, z + 1}, {x + 1, z + 1}},
+            };
+            for (int t = 0; t < 2; t++, nt++) {
+                for (int k = 0; k < 3; k++) {
+                    int cx = corners[t][k][0], cz = corners[t][k][1];
+                    float *v = &o->verts[(nt * 3 + k) * 3];
+                    v[0] = cx - GRID / 2, v[1] = height(cx, cz), v[2] = cz - GRID / 2;
+                }
+            }
+        }
+    }
+    // a vertex repeated makes a triangle with no area
+    for (; nt < o->ntris; nt++) {
+        float *src = &o->verts[(rand() % (nquads * 2)) * 9];
+        for (int k = 0; k < 3; k++)
+            memcpy(&o->verts[(nt * 3 + k) * 3], src + (k == 2 ? 3 : 0), 3 * sizeof(float));
+    }
+    for (int i = 0; i < o->ntris * 3; i++) {
+        o->tris[i] = i;
+        o->normidx[i] = -1;
+    }
+    for (int i = o->ntris - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        for (int k = 0; k < 3; k++) {
+            int tmp = o->tris[i * 3 + k];
+            o->tris[i * 3 + k] = o->tris[j * 3 + k];
+            o->tris[j * 3 + k] = tmp;
+        }
+    }
+    return o;
+}
+
+static double trace(Shape *s, Ray *rays, float *dists, int *hits) {
+    double t0 = now();
+    *hits = 0;
+    for (int i = 0; i < NRAYS; i++) {
+        Hit h;
+        dists[i] = s->test(s, &rays[i], &h) ? h.dist : INFINITY;
+        *hits += dists[i] != INFINITY;
+    }
+    return now() - t0;
+}
+
+int main() {
+    static Ray rays[NRAYS];
+    srand(2);
+    for (int i = 0; i < NRAYS; i++) {
+        Vec3 orig = vec3(frand(-GRID / 2, GRID / 2), 20, frand(-GRID / 2, GRID / 2));
+        rays[i] = (Ray){orig, vnorm(vec3(frand(-0.3, 0.3), -1, frand(-0.3, 0.3)))};
+    }
+    static float before[NRAYS], after[NRAYS];
+
+    Obj *messy = messyobj();
+    int ntris = messy->ntris, nverts = messy->nverts;
+    Shape *a = AS_SHAPE(newmesh(messy));
+    Obj *o = messyobj();
+    double t0 = now();
+    optimizeobj(o);
+    double topt = now() - t0;
+    printf("%-10s %i -> %i tris, %i -> %i verts in %.3fs\n",
+            "optimize", ntris, o->ntris, nverts, o->nverts, topt);
+    Shape *b = AS_SHAPE(newmesh(o));
+
+    int ha, hb, same = 0;
+    double ta = trace(a, rays, before, &ha);
+    double tb = trace(b, rays, after, &hb);
+    for (int i = 0; i < NRAYS; i++)
+        same += before[i] == after[i];
+    printf("%-10s raw %7.3fs  optimized %7.3fs  %5.2fx  (%i/%i hits, %i/%i same)\n",
+            "trace", ta, tb, ta / tb, ha, hb, same, NRAYS);
+    freeshape(a);
+    freeshape(b);
+    return 0;
+}
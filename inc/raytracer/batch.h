@@ -0,0 +1,19 @@
+#pragma once
+
+typedef struct {
+    // scenes loaded or rendering at once, 0 for twice the threads
+    int maxscenes;
+    // bytes, 0 for no cap
+    unsigned long memcap;
+    int stats;
+} BatchOpts;
+
+// Renders every scene in files on one set of threads, several scenes at
+// a time. Tiles are handed out round-robin over the scenes in flight so
+// each gets the same share of the threads, and every image comes out as
+// it would alone. A scene is loaded while fewer than maxscenes are in
+// flight and memory looks to stay under memcap; with nothing in flight
+// the next one always loads. Meshes of the same OBJ share their
+// vertices across scenes. Scenes that fail to load are reported and
+// skipped, the count of them is returned.
+int renderbatch(char **files, int nfiles, RenderOpts *opts, BatchOpts *bo);
@@ -0,0 +1,9 @@
+#pragma once
+
+// A checkpoint holds the partially rendered image plus one done flag per
+// tile, keyed so that it is only ever resumed against the same scene.
+int loadcheckpoint(const char *file, unsigned key, Bitmap *bmp,
+        int tilesize, unsigned char *done, int ntiles);
+void savecheckpoint(const char *file, unsigned key, Bitmap *bmp,
+        int tilesize, unsigned char *done, int ntiles);
+void removecheckpoint(const char *file);
@@ -35,10 +35,12 @@ typedef struct {
     ConfVal *root;
 } Conf;
 
+// 0 if file can't be read or parsed, the error is printed
 Conf *parseconf(const char *file);
 void freeconf(Conf *conf);
 void dumpconf(Conf *conf);
 void dumpconfmem();
+unsigned confhash(ConfVal *v);
 
 ConfVal *confobjget(ConfVal *obj, const char *name);
 float confobjgetnum(ConfVal *obj, const char *name, float def);
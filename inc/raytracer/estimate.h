@@ -0,0 +1,31 @@
+#pragma once
+
+// Render cost predicted from one traced pixel per small region, and
+// the settings picked from it.
+typedef struct {
+    // seconds the image would take on one thread, and spent probing
+    double time;
+    double probetime;
+    int probed;
+    // predicted seconds per region of ESTIMATE_REGION pixels
+    int cols, rows;
+    double *cost;
+    // picked by tunerender, and the time predicted with them
+    int tilesize;
+    int nthreads;
+    float lightcutoff;
+    int lightsamples;
+    double wall;
+    // given on the command line, tunerender keeps them
+    int fixedtile, fixedthreads;
+} RenderEstimate;
+
+#define ESTIMATE_REGION 8
+
+void estimaterender(Bitmap *bmp, Scene *scene, RenderOpts *opts, RenderEstimate *est);
+// Picks thread count and tile size for est. Past a budget in seconds
+// (0 for none) light sampling is cut back on the scene until the probe
+// fits or can't be cut further.
+void tunerender(Bitmap *bmp, Scene *scene, RenderOpts *opts, double budget, RenderEstimate *est);
+void printestimate(RenderEstimate *est, FILE *f);
+void freeestimate(RenderEstimate *est);
@@ -0,0 +1,47 @@
+#pragma once
+
+// Per pixel, per bounce hit records and per light shadow results that
+// survive between runs. As long as geometry and camera are unchanged a
+// re-render only has to shade, and only re-traces shadow rays for
+// lights that moved.
+
+#define GBUF_MAX_LIGHTS 64
+
+enum {
+    GHIT_UNKNOWN = -2,
+    GHIT_MISS = -1,
+};
+
+enum {
+    GVIS_UNKNOWN,
+    GVIS_LIT,
+    GVIS_BLOCKED,
+};
+
+typedef struct {
+    int shape; // index into Scene.shapes or GHIT_*
+    float dist;
+    Vec3 point;
+    Vec3 norm;
+} GHit;
+
+struct GBuffer {
+    const char *file;
+    unsigned key;
+    int width, height;
+    int nlights;
+    Vec3 *lightpos;
+    GHit *hits; // MAX_RECUR + 1 per pixel
+    unsigned char *vis; // (MAX_RECUR + 1) * nlights per pixel, if kept
+    int reused;
+};
+
+GBuffer *opengbuffer(const char *file, Scene *s, int w, int h);
+void savegbuffer(GBuffer *gb, Scene *s);
+void freegbuffer(GBuffer *gb);
+// forgets shadow results for lights that moved since they were traced
+void syncgbufferlights(GBuffer *gb, Scene *s);
+// forgets everything traced for the pixels in [x0, x1) x [y0, y1)
+void cleargbuffer(GBuffer *gb, int x0, int y0, int x1, int y1);
+// xcast for a primary ray through pixel, reading and filling gb
+Vec3 gcast(Scene *s, GBuffer *gb, int pixel, Ray *r, Worker *w);
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <pthread.h>
+
+// Meshes whose OBJ is only parsed once a ray reaches their bounds. The
+// bounds come from the conf or from <objfile>.rtbounds, which is
+// written the first time the OBJ is parsed.
+
+struct MeshLazy {
+    pthread_mutex_t lock;
+    // set once obj, xverts and nodes are in place, read with acquire
+    int loaded;
+    int compact;
+    // object space
+    Aabb box;
+    // of the OBJ file's size and mtime
+    unsigned key;
+};
+
+unsigned lazykey(const char *objfile);
+// reads bounds from <objfile>.rtbounds if it is still current
+int loadbounds(const char *objfile, Aabb *box);
+void savebounds(const char *objfile, Obj *o, Aabb *box);
+MeshLazy *newlazy(Aabb box, unsigned key);
+void freelazy(MeshLazy *l);
+// parses the OBJ of m unless some thread already did, in mesh.c
+void loadlazymesh(ShapeMesh *m);
+
+static inline int lazyloaded(MeshLazy *l) {
+    return __atomic_load_n(&l->loaded, __ATOMIC_ACQUIRE);
+}
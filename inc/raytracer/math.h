@@ -1,5 +1,7 @@
 #pragma once
 
+#include <math.h>
+
 #define PI 3.14159265358979323846
 
 typedef struct {
@@ -8,15 +10,89 @@ typedef struct {
 
 #define vec3(x, y, z) ((Vec3){(x), (y), (z)})
 
-float vmag(Vec3 v);
-Vec3 vsub(Vec3 a, Vec3 b);
-Vec3 vadd(Vec3 a, Vec3 b);
-Vec3 vmul(Vec3 v, float f);
-Vec3 vnorm(Vec3 v);
-float vdot(Vec3 a, Vec3 b);
-Vec3 vproj(Vec3 a, Vec3 b);
-Vec3 vrefl(Vec3 v, Vec3 n);
-Vec3 vcross(Vec3 a, Vec3 b);
+// 4-wide float vector, used where the compiler can keep a whole row or
+// column of a matrix in one SIMD register
+typedef float V4 __attribute__((vector_size(16)));
+
+static inline float vdot(Vec3 a, Vec3 b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static inline float vmag(Vec3 v) {
+    return sqrtf(vdot(v, v));
+}
+
+static inline Vec3 vsub(Vec3 a, Vec3 b) {
+    return (Vec3){a.x - b.x, a.y - b.y, a.z - b.z};
+}
+
+static inline Vec3 vadd(Vec3 a, Vec3 b) {
+    return (Vec3){a.x + b.x, a.y + b.y, a.z + b.z};
+}
+
+static inline Vec3 vmul(Vec3 v, float f) {
+    return (Vec3){v.x * f, v.y * f, v.z * f};
+}
+
+static inline Vec3 vnorm(Vec3 v) {
+    return vmul(v, 1 / vmag(v));
+}
+
+static inline Vec3 vproj(Vec3 a, Vec3 b) {
+    return vmul(b, vdot(a, b) / vdot(b, b));
+}
+
+// V has to point towards the intersection point
+static inline Vec3 vrefl(Vec3 v, Vec3 n) {
+    return vsub(v, vmul(n, 2 * vdot(v, n)));
+}
+
+static inline Vec3 vcross(Vec3 a, Vec3 b) {
+    return (Vec3){
+        a.y * b.z - a.z * b.y,
+        a.z * b.x - a.x * b.z,
+        a.x * b.y - a.y * b.x};
+}
+
+static inline Vec3 vmin(Vec3 a, Vec3 b) {
+    return vec3(fminf(a.x, b.x), fminf(a.y, b.y), fminf(a.z, b.z));
+}
+
+static inline Vec3 vmax(Vec3 a, Vec3 b) {
+    return vec3(fmaxf(a.x, b.x), fmaxf(a.y, b.y), fmaxf(a.z, b.z));
+}
+
+// x, y or z for axis 0, 1 or 2
+static inline float axisof(Vec3 v, int axis) {
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+static inline int clampi(int i, int max) {
+    return i < 0 ? 0 : (i > max ? max : i);
+}
+
+// spreads the low 10 bits of v two apart
+static inline unsigned spread10(unsigned v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// 30 bit Morton code of p in the box lo to hi, 10 bits per axis with x
+// lowest; outside the box clamps to its faces
+static inline unsigned morton(Vec3 p, Vec3 lo, Vec3 hi) {
+    float f[3] = {p.x, p.y, p.z}, l[3] = {lo.x, lo.y, lo.z}, h[3] = {hi.x, hi.y, hi.z};
+    unsigned code = 0;
+    for (int a = 0; a < 3; a++) {
+        float t = h[a] > l[a] ? (f[a] - l[a]) / (h[a] - l[a]) : 0;
+        unsigned q = t <= 0 ? 0 : (t >= 1 ? 1023 : (unsigned)(t * 1023));
+        code |= spread10(q) << a;
+    }
+    return code;
+}
 
 typedef struct {
     float x, y, z, w;
@@ -29,7 +105,15 @@ typedef struct {
 } Matrix;
 
 void matrixinit(Matrix *m);
-Vec3 matrixmul(Matrix *m, Vec3 v);
 void matrixtranslate(Matrix *m, Vec3 trans);
 void matrixscale(Matrix *m, Vec3 scale);
 void matrixrotate(Matrix *m, Vec3 axis, float degrees);
+void matrixmulv(Matrix *m, const float *in, Vec3 *out, int n);
+
+static inline Vec3 matrixmul(Matrix *m, Vec3 v) {
+    Vec4 *r = m->rows;
+    return vec3(
+        r[0].x * v.x + r[0].y * v.y + r[0].z * v.z + r[0].w,
+        r[1].x * v.x + r[1].y * v.y + r[1].z * v.z + r[1].w,
+        r[2].x * v.x + r[2].y * v.y + r[2].z * v.z + r[2].w);
+}
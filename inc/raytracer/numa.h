@@ -0,0 +1,15 @@
+#pragma once
+
+// CPUs by NUMA node as listed under /sys/devices/system/node, nodes
+// without CPUs left out. Without sysfs it's one node with every CPU.
+typedef struct {
+    int nnodes;
+    int *ncpus;
+    int **cpus;
+} Topology;
+
+void readtopology(Topology *t);
+void freetopology(Topology *t);
+int topologycpus(Topology *t);
+// pins the calling thread to the CPUs of node, 0 if that failed
+int pinnode(Topology *t, int node);
@@ -1,11 +1,47 @@
 #pragma once
 
-typedef struct {
+typedef struct Obj {
     float *verts;
     int nverts;
     int *tris;
     int ntris;
+    // vn entries, and per triangle corner an index into them or -1
+    float *norms;
+    int nnorms;
+    int *normidx;
+    // verts and norms borrowed from a shared obj, released when this
+    // one is freed
+    struct Obj *base;
 } Obj;
 
+// 0 if file can't be read, parsed or has faces out of range
 Obj *newobj(const char *file);
+// Parses file a few MB of lines at a time without holding all of it.
+// Every chunk's vertices, normals and faces go to chunk before the next
+// is read. Face indices stay global, counting from the first vertex of
+// the file. 0 on the same errors as newobj.
+int scanobj(const char *file, void (*chunk)(void *ctx, Obj *o), void *ctx);
 void freeobj(Obj *o);
+// Welds equal positions, drops zero-area tris and sorts tris and verts
+// along a Morton curve so neighbours in space are neighbours in memory.
+void optimizeobj(Obj *o);
+typedef struct {
+    unsigned long objs, welded, dropped;
+    // tris of the simplified levels before and after
+    unsigned long lodbefore, lodafter;
+} OptStats;
+// totals over every OBJ optimized since start, cache hits aside
+void optstats(OptStats *st);
+// Vertex clustering: every vertex moves to the mean of its cell in a
+// grid cells wide along the longest axis, optimizeobj then welds them
+// and drops the tris that collapsed.
+void simplifyobj(Obj *o, int cells);
+// newobj then optimizeobj, through a <file>.rtobj cache
+Obj *loadobj(const char *file);
+// loadobj of the level simplified to cells, cached as <file>.lod<cells>.rtobj
+Obj *loadlod(const char *file, int cells);
+// loadlod loaded once per process for everyone holding it: verts and
+// norms are shared, tris and normidx are each caller's own to reorder
+Obj *shareobj(const char *file, int cells);
+// drops a reference taken by shareobj, freeobj does it for borrowers
+void releaseobj(Obj *base);
@@ -0,0 +1,17 @@
+#pragma once
+
+// Fixed set of threads running queued jobs in submission order.
+
+typedef struct Pool Pool;
+
+// nthreads <= 0 means poolcpus()
+Pool *newpool(int nthreads);
+void poolsubmit(Pool *p, void (*fn)(void *arg), void *arg);
+// blocks until every submitted job has finished
+void poolwait(Pool *p);
+void freepool(Pool *p);
+int poolthreads(Pool *p);
+int ncpus();
+// threads a pool started here should use: one per CPU, or 1 inside a
+// pool job, which would otherwise multiply the threads of a batch
+int poolcpus();
@@ -4,6 +4,8 @@
 
 typedef struct Shape Shape;
 typedef struct Scene Scene;
+typedef struct MeshStream MeshStream;
+typedef struct MeshLazy MeshLazy;
 
 typedef struct {
     Vec3 a, b, c;
@@ -14,11 +16,16 @@ typedef struct {
     Vec3 dir;
 } Ray;
 
+// Tests only fill in shape, dist and where on the shape the hit is,
+// point and norm are left to finalizehit for the hit that is kept.
 typedef struct {
     Shape *shape;
     float dist;
     Vec3 point;
     Vec3 norm;
+    // primitive within the shape and barycentrics on it
+    int prim;
+    float u, v;
 } Hit;
 
 typedef struct {
@@ -26,6 +33,25 @@ typedef struct {
     float reflectiveness;
 } Material;
 
+// Ray directions are unit length, so with oc = orig - center the hit
+// distances solve t^2 + 2bt + c = 0 with b = dot(oc, dir) and
+// c = |oc|^2 - r^2. From inside (c < 0) it's the far root, from
+// outside the near one, and only if the sphere is ahead. The
+// discriminant b^2 - c is taken as r^2 minus the squared distance of
+// the center from the ray, which doesn't cancel for far spheres.
+static inline int spheredist(Vec3 center, float r2, Ray *r, float *dist) {
+    Vec3 oc = vsub(r->orig, center);
+    float b = vdot(oc, r->dir);
+    float c = vdot(oc, oc) - r2;
+    if (c > 0 && b > 0) return 0;
+    Vec3 perp = vsub(oc, vmul(r->dir, b));
+    float disc = r2 - vdot(perp, perp);
+    if (disc < 0) return 0;
+    float root = sqrtf(disc);
+    *dist = c < 0 ? root - b : -b - root;
+    return 1;
+}
+
 struct Shape {
     enum {
         SHAPE_NONE,
@@ -35,37 +61,168 @@ struct Shape {
     } type;
     Material mat;
     Matrix transform;
+    int id; // index into Scene.shapes
+    unsigned key; // hash of the conf entry
     int (*test)(Shape *s, Ray *r, Hit *h);
+    // fills in norm, point is set already
+    void (*finalize)(Shape *s, Ray *r, Hit *h);
 };
 
 typedef struct {
     Shape shape;
     Vec3 center;
     float radius;
+    // radius squared, kept in sync by setsphere
+    float r2;
 } ShapeSphere;
 
 typedef struct {
     Shape shape;
     Vec3 point;
     Vec3 normal;
+    // dot(normal, point)
+    float d;
 } ShapePlane;
 
+typedef struct {
+    Vec3 min, max;
+} Aabb;
+
+// Preorder BVH node. Inner nodes have count 0, their left child is the
+// next node and index is the right child. Leaves cover count triangles
+// from index on.
+typedef struct {
+    Vec3 min, max;
+    int index;
+    int count;
+} BvhNode;
+
+// BvhNode with its box stored as 8 bit offsets into the parent's box.
+typedef struct {
+    unsigned char qmin[3], qmax[3];
+    unsigned short count;
+    int index;
+} QNode;
+
+// Quantized mesh, replaces the Obj, xverts and nodes of a ShapeMesh.
+typedef struct {
+    int nverts;
+    int ntris;
+    // vertex i is min + verts[i] * step
+    Vec3 min, step;
+    unsigned short *verts;
+    // one of these, 16 bit if every vertex index fits
+    unsigned short *tris16;
+    int *tris32;
+    QNode *nodes;
+    int nnodes;
+    Aabb root;
+} MeshQ;
+
 typedef struct {
     Shape shape;
     Obj *obj;
+    char *objfile;
+    // world space vertices
+    Vec3 *xverts;
+    BvhNode *nodes;
+    int nnodes;
+    MeshQ *q;
+    // set instead of obj when the triangles stay on disk
+    MeshStream *stream;
+    // set while obj may still have to be parsed
+    MeshLazy *lazy;
+    // world space vn normals, if the OBJ has them and smooth is set
+    Vec3 *xnorms;
+    int smooth;
     ShapeSphere *bounds;
 } ShapeMesh;
 
 ShapeSphere *newsphere(Vec3 center, float radius);
+void setsphere(ShapeSphere *s, Vec3 center, float radius);
 ShapePlane *newplane(Vec3 point, Vec3 normal);
 ShapeMesh *newmesh(Obj *obj);
+ShapeMesh *newmeshstream(MeshStream *ms);
+// obj may be null, to be parsed when first needed
+ShapeMesh *newlazymesh(MeshLazy *l, Obj *obj);
 void freeshape(Shape *shape);
+// sets the methods of a sphere or plane read back from a file
+void bindshape(Shape *shape);
+// BVH over tris with at most leafsize per leaf, reorders tris to match
+// attrs, if set, holds 3 ints per triangle that move along with tris
+BvhNode *buildbvh(Vec3 *verts, int *tris, int *attrs, int ntris, int leafsize, int *nnodes);
+Aabb transformbox(Matrix *m, Aabb box);
+void updatemesh(ShapeMesh *m);
+int testmesh(Shape *s, Ray *r, Hit *h);
+// switches m to the quantized representation for good, m can't be
+// transformed afterwards
+void compactmesh(ShapeMesh *m);
+typedef struct {
+    unsigned long meshes;
+    // bytes the compacted meshes took before and after
+    unsigned long before, after;
+} CompactStats;
+// totals over every compactmesh so far
+void compactstats(CompactStats *st);
+void freemesh(ShapeMesh *m);
+// Copy of what tracing m reads, made by the calling thread so it lands
+// in that thread's memory. Vertices and normals of the OBJ itself stay
+// borrowed from m. Lazy, streamed and compacted meshes give 0.
+ShapeMesh *replicatemesh(ShapeMesh *m);
+void freereplica(ShapeMesh *r);
 int testshape(Shape *s, Ray *r, Hit *h);
+void finalizehit(Ray *r, Hit *h);
+void finalizemesh(Shape *s, Ray *r, Hit *h);
 
 void shapetranslate(Shape *s, Vec3 trans);
 void shaperotate(Shape *s, Vec3 axis, float degrees);
 void shapescale(Shape *s, Vec3 scale);
 
+// Uniform grid over the spheres of a Batches. Each cell lists, by batch
+// index, the spheres whose box overlaps it.
+typedef struct {
+    Vec3 min, max;
+    Vec3 cellsize;
+    int nx, ny, nz;
+    // cell i holds items[starts[i]] up to items[starts[i + 1]]
+    int *starts;
+    int *items;
+} Grid;
+
+// Shapes sorted into per-type contiguous arrays so that scene queries run
+// one specialized loop per type instead of calling through Shape.test.
+typedef struct {
+    // spheres, SoA, with squared radii
+    int nspheres;
+    float *sx, *sy, *sz, *sr2;
+    Shape **sshapes;
+    // planes as normal and d
+    int nplanes;
+    Vec3 *pnorms;
+    float *pd;
+    Shape **pshapes;
+    // mesh instances
+    int nmeshes;
+    ShapeMesh **meshes;
+    // anything with a custom test
+    int nothers;
+    Shape **others;
+    // over the spheres, walked instead of looping over them if set
+    Grid *grid;
+} Batches;
+
+void buildbatches(Batches *b, Shape **shapes, int nshapes);
+// copy of src made by the calling thread, meshes swapped for their
+// entry in byid (by shape id) where byid has one
+void copybatches(Batches *dst, Batches *src, Shape **byid);
+void freebatches(Batches *b);
+int testbatches(Batches *b, Ray *r, Hit *h);
+Grid *newgrid(Batches *b);
+Grid *copygrid(Grid *g);
+void freegrid(Grid *g);
+// closest sphere of b along r as a batch index, -1 if none is hit
+int gridtest(Grid *g, Batches *b, Ray *r, float *dist);
+
 typedef struct {
     unsigned char r, g, b;
 } Color;
@@ -73,8 +230,41 @@ typedef struct {
 typedef struct {
     Vec3 pos;
     float intensity;
+    int id; // index into Scene.lights
 } Light;
 
+// BVH over point lights. Nodes are in preorder, so the left child of an
+// inner node is the next node. Every node carries the summed intensity
+// of its subtree, which bounds how much it can contribute at a point.
+typedef struct {
+    Vec3 min, max;
+    float intensity;
+    Light *light; // leaf
+    int right;
+} LightNode;
+
+typedef struct {
+    LightNode *nodes;
+    int nnodes;
+} LightTree;
+
+typedef struct {
+    LightTree *tree;
+    Vec3 p;
+    float cutoff;
+    int stack[64];
+    int sp;
+} LightIter;
+
+void buildlighttree(LightTree *t, Light **lights, int nlights);
+void freelighttree(LightTree *t);
+// visits every light whose bounded contribution at p is >= cutoff
+void lightiterinit(LightIter *it, LightTree *t, Vec3 p, float cutoff);
+Light *lightiternext(LightIter *it);
+// picks one light with probability proportional to its estimated
+// contribution at p, u is uniform in [0, 1)
+Light *samplelight(LightTree *t, Vec3 p, float u, float *pdf);
+
 struct Scene {
     const char *output;
     int width;
@@ -83,12 +273,52 @@ struct Scene {
     float aspect;
     Light **lights;
     int nlights;
+    LightTree lighttree;
+    float lightcutoff;
+    int lightsamples;
+    // mixed into every random draw
+    unsigned seed;
     Vec3 background;
     float ambiance;
+    // MB shared by every streamed mesh, 0 for the default
+    float meshcache;
+    enum {
+        ACCEL_NONE,
+        ACCEL_GRID,
+    } accel;
     Shape **shapes;
     int nshapes;
+    Batches batches;
+    int dirty;
+    // conf hashes, to tell what a reload changed
+    unsigned viewkey;
+    unsigned lightkey;
+    // a mapped .rtscene, spheres, planes and lights within it are used
+    // in place
+    void *map;
+    unsigned long mapsize;
 };
 
+// 0 if the conf or .rtscene, or a mesh in it, fails to load; file 0
+// gives an empty scene
 Scene *newscene(const char *file);
 void freescene(Scene *s);
 void addshape(Scene *s, Shape *shape);
+void addlight(Scene *s, Light *light);
+void compilescene(Scene *s);
+
+enum {
+    RELOAD_VIEW = 1,
+    RELOAD_LIGHTS = 2,
+    RELOAD_SHAPES = 4,
+    RELOAD_FAILED = 8,
+};
+
+// Re-reads the conf into s, only rebuilding shapes whose entry changed
+// or whose objfile is one of the given ones. changed gets a flag for
+// every shape id whose shape was replaced, added or removed.
+// RELOAD_VIEW means nothing was applied and the scene has to be loaded
+// anew. RELOAD_FAILED means the conf or a mesh failed to load, the
+// error is printed and s is as it was.
+int reloadscene(Scene *s, const char *file, const char **objfiles, int nobjfiles,
+        unsigned char **changed, int *nchanged);
@@ -0,0 +1,80 @@
+#pragma once
+
+typedef struct {
+    int width;
+    int height;
+    Color *pixels;
+} Bitmap;
+
+typedef struct {
+    int tilesize;
+    int wavefront;
+    // threads rendering tiles, 0 for one per CPU
+    int nthreads;
+    // pin threads by NUMA node, each node rendering its own rows into
+    // memory it touched first, and with replicate on its own copy of
+    // the scene's acceleration structures
+    int numa;
+    int replicate;
+    const char *gbuffer;
+    // checkpointing
+    const char *ckptfile;
+    unsigned ckptkey;
+    float ckptinterval;
+    int resume;
+} RenderOpts;
+
+typedef struct {
+    double time;
+    unsigned long primaryrays;
+    unsigned long shadowrays;
+    unsigned long reflectionrays;
+    // shadow rays answered by the per-light last occluder
+    unsigned long occludertests;
+    unsigned long occluderhits;
+    // tiles rendered against a culled list, and the shapes on them
+    unsigned long culltiles;
+    unsigned long cullshapes;
+} RenderStats;
+
+// Per tile, the shapes that primary rays in the tile can hit. Spheres
+// and meshes go to the tiles their projected bounds overlap, planes and
+// custom shapes to every tile.
+typedef struct {
+    int ntiles;
+    Batches *tiles;
+} TileCull;
+
+typedef struct GBuffer GBuffer;
+typedef struct Worker Worker;
+
+// State kept across renders of the same image so that later renders
+// can redo only some tiles. touch holds, per tile, a bitset of the ids
+// of every shape that any ray of the tile hit.
+typedef struct {
+    GBuffer *gb;
+    int touchbytes;
+    unsigned char *touch;
+} Frame;
+
+void initbitmap(Bitmap *bmp, int w, int h);
+void freebitmap(Bitmap *bmp);
+void clear(Bitmap *bmp, Color c);
+void output(Bitmap *bmp, const char *file);
+
+void initrenderopts(RenderOpts *opts);
+void renderscene(Bitmap *bmp, Scene *scene, RenderOpts *opts, RenderStats *stats);
+// renders only the tiles with todo set, using and updating f
+void rendertiles(Bitmap *bmp, Scene *scene, RenderOpts *opts, Frame *f,
+        unsigned char *todo, RenderStats *stats);
+// tile i with w, culled by tc and through f's gbuffer and touch sets
+// when given, either may be 0
+void rendertileat(Bitmap *bmp, Scene *scene, RenderOpts *opts, Frame *f, TileCull *tc,
+        Worker *w, int i);
+int tilecount(Bitmap *bmp, int tilesize);
+void tilerect(Bitmap *bmp, int tilesize, int i, int *x0, int *y0, int *x1, int *y1);
+void printstats(RenderStats *st, FILE *f);
+// sums the counters, time is left alone
+void addstats(RenderStats *to, RenderStats *from);
+void buildtilecull(TileCull *tc, Scene *s, Bitmap *bmp, int tilesize);
+void freetilecull(TileCull *tc);
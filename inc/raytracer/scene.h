@@ -0,0 +1,67 @@
+#pragma once
+
+// Scene construction shared by the conf loader in scene.c and the
+// binary .rtscene format in rtscene.c.
+
+typedef struct Pool Pool;
+
+// What a mesh entry asks for, the conf and .rtscene both reduce to it.
+typedef struct {
+    const char *objfile;
+    int stream;
+    int lazy;
+    int compact;
+    int smooth;
+    // a level simplified to this many cells, 0 for the OBJ as is
+    int lodcells;
+    // object space bounds for a lazy mesh
+    int hasbox;
+    Aabb box;
+    Vec3 position;
+    int hasmat;
+    Material mat;
+    unsigned key;
+    // "lods" and the view they're picked for, resolved by picklod
+    ConfVal *lods;
+    float vfov;
+    int height;
+} MeshDesc;
+
+// Shapes being built for a scene. Meshes are built on a pool, one job
+// per OBJ file so that a file is never read or packed by two threads
+// at once.
+typedef struct {
+    int n;
+    // objfile is null for entries that aren't meshes
+    MeshDesc *descs;
+    Shape **shapes;
+    // next entry with the same OBJ file, or -1
+    int *next;
+    Pool *pool;
+} ShapeLoad;
+
+// s supplies the view meshes pick their level of detail for
+Shape *mkshape(Scene *s, ConfVal *entry);
+// 0 if entry isn't a mesh with an objfile
+int meshdesc(Scene *s, ConfVal *entry, MeshDesc *d);
+// settles lods into objfile and lodcells, may parse the base OBJ
+void picklod(MeshDesc *d);
+ShapeMesh *mkmesh(MeshDesc *d);
+void initshapeload(ShapeLoad *ld, int n);
+// submits every entry with an objfile, and returns right away
+void startmeshes(ShapeLoad *ld);
+// waits for the meshes, shapes[i] is null for entries that failed
+void finishshapes(ShapeLoad *ld);
+// whether every entry with an objfile got its mesh
+int meshesloaded(ShapeLoad *ld);
+void freeshapeload(ShapeLoad *ld);
+// top level settings, 0 if they're off
+int loadview(Scene *s, Conf *conf);
+void loadlights(Scene *s, Conf *conf);
+
+// Writes conf as a .rtscene. Streamed meshes are packed and lazy
+// meshes get their bounds on the way.
+void writertscene(const char *conf, const char *file);
+Scene *loadrtscene(const char *file);
+void unmaprtscene(Scene *s);
+int isrtscene(const char *file);
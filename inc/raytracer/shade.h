@@ -0,0 +1,68 @@
+#pragma once
+
+#define MAX_RECUR 1
+
+// Counter based, a draw is a hash of the scene seed, the pixel and
+// where in the pixel's path it's made. Nothing carries over between
+// draws, so results don't depend on thread count or tile order.
+typedef struct {
+    unsigned seed;
+    unsigned pixel;
+} Rng;
+
+void rngseed(Rng *rng, unsigned seed, unsigned pixel);
+// uniform in [0, 1), the sample-th draw at bounce
+float rngfloat(Rng *rng, unsigned sample, unsigned bounce);
+
+typedef struct {
+    Light *light;
+    float weight;
+} LightPick;
+
+// State private to one rendering thread.
+struct Worker {
+    Rng rng;
+    // last shape that blocked a shadow ray, per light
+    Shape **occluders;
+    // scratch for picklights
+    LightPick *picks;
+    // touch set of the tile being rendered, if tracked
+    unsigned char *touch;
+    // candidates for primary rays in the tile being rendered, if culled
+    Batches *tile;
+    // what every other ray tests, a copy local to the thread's NUMA
+    // node or 0 for the scene's own
+    Batches *batches;
+    RenderStats stats;
+};
+
+static inline void touchshape(Worker *w, Shape *s) {
+    if (w->touch)
+        w->touch[s->id >> 3] |= 1 << (s->id & 7);
+}
+
+void initworker(Worker *w, Scene *s);
+void freeworker(Worker *w);
+
+typedef struct {
+    int w, h;
+    float width, height;
+} Camera;
+
+void initcamera(Camera *c, Scene *s, int w, int h);
+Ray primaryray(Camera *c, int x, int y);
+
+// closest hit with point and norm filled in
+int testscene(Scene *s, Worker *w, Ray *r, Hit *h);
+// same for a camera ray in the worker's tile
+int testprimary(Scene *s, Worker *w, Ray *r, Hit *h);
+int occluded(Scene *s, Worker *w, Light *light, Ray *ray, float dist);
+// fills w->picks with the lights to shade hit point p at bounce with
+int picklights(Scene *s, Worker *w, Vec3 p, int bounce);
+// returns the distance to the light
+float shadowray(Hit *hit, Light *light, Ray *ray);
+// unoccluded contribution of a light, v points from the hit to the eye
+Vec3 lightcolor(Hit *hit, Vec3 v, Light *light);
+Ray reflray(Ray *r, Hit *hit);
+Vec3 xcast(Scene *s, Ray *r, int recur, Hit *xhit, Worker *w);
+Color tocolor(Vec3 c);
@@ -0,0 +1,69 @@
+#pragma once
+
+// Meshes whose triangles stay on disk. A .rtmesh file holds a BVH whose
+// leaves are clusters of triangles, the clusters are read in when a ray
+// reaches them and kept in one LRU cache of fixed size shared by every
+// streamed mesh.
+
+// at most this many triangles per cluster, a streamed hit's prim is
+// cluster * CLUSTER_TRIS + its index within the cluster
+#define CLUSTER_TRIS 256
+
+typedef struct Cluster Cluster;
+
+struct Cluster {
+    MeshStream *ms;
+    int index;
+    int ntris;
+    // world space, with their own BVH
+    Vec3 *verts;
+    int *tris;
+    BvhNode *nodes;
+    int nnodes;
+    unsigned bytes;
+    int pins;
+    Cluster *prev, *next;
+};
+
+struct MeshStream {
+    char *file;
+    int fd;
+    unsigned key;
+    int ntris;
+    int nclusters;
+    // leaves have index set to their cluster, objnodes are in object
+    // space and nodes the same boxes in world space
+    BvhNode *objnodes;
+    BvhNode *nodes;
+    int nnodes;
+    long long *offsets;
+    int *counts;
+    Cluster **resident;
+    Matrix transform;
+    // set once a cluster failed to read
+    int failed;
+};
+
+typedef struct {
+    unsigned long budget;
+    unsigned long used;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+} MeshCacheStats;
+
+// Opens file if it is a .rtmesh, otherwise packs the OBJ into
+// <file>.rtmesh first unless that is already newer and reads back
+// whole. Packing reads the OBJ in chunks and works on scratch files, it
+// never holds the mesh. 0 if the OBJ or mesh file can't be read.
+MeshStream *openmeshstream(const char *file);
+void freemeshstream(MeshStream *ms);
+void transformmeshstream(MeshStream *ms, Matrix *m);
+// pinned until released, reads the cluster in if needed; 0 if it
+// can't be read
+Cluster *acquirecluster(MeshStream *ms, int i);
+void releasecluster(Cluster *c);
+// The budget is the process's, not a scene's: in a batch the scene
+// loaded last sets it for all of them.
+void setmeshcache(unsigned long bytes);
+void meshcachestats(MeshCacheStats *st);
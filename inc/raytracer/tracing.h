@@ -0,0 +1,13 @@
+#pragma once
+
+// Begin/end events per thread, written as Chrome trace-event JSON (for
+// chrome://tracing or Perfetto) when the process exits. Until
+// starttracing is called every call is a flag check.
+
+void starttracing(const char *file);
+// name must outlive the process, arg is copied and may be 0
+void tracebegin(const char *name, const char *arg);
+// same with a number for the argument, such as a tile index
+void tracebegini(const char *name, int arg);
+// ends the innermost event begun on this thread
+void traceend();
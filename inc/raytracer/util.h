@@ -2,12 +2,45 @@
 
 void err(const char *fmt, ...);
 char *readfile(const char *file);
+// readfile, but 0 instead of exiting if file can't be read
+char *tryreadfile(const char *file);
+unsigned hashbytes(const void *data, unsigned size);
+// monotonic seconds
+double now();
 
-typedef struct {
+#include <stdio.h>
+#include <stddef.h>
+
+// Files written aside and renamed over their path, so a reader or a
+// second writer never sees half of one. opentemp creates a unique file
+// next to path and puts its name in tmp, 0 if it can't. closetemp
+// closes it and renames it over path if ok and the writes held up,
+// otherwise removes it; 1 if path was replaced.
+FILE *opentemp(const char *path, char *tmp, int size);
+int closetemp(FILE *f, const char *tmp, const char *path, int ok);
+
+// Tracks what one subsystem has allocated. Allocators are static per
+// file, {"name"} is enough to set one up, and link themselves into the
+// report on first use.
+typedef struct Allocator {
     const char *name;
-    unsigned size;
+    unsigned long size;
+    unsigned long peak;
+    // number of allocations made and still live
+    unsigned long count;
+    unsigned long live;
+    struct Allocator *next;
+    int listed;
 } Allocator;
 
 void *xmalloc(Allocator *a, unsigned size);
+// exits if n * size doesn't fit
+void *xcalloc(Allocator *a, size_t n, size_t size);
 void xfree(void *ptr);
 void *xrealloc(Allocator *a, void *ptr, unsigned size);
+char *xstrdup(Allocator *a, const char *str);
+// bytes currently allocated over every allocator
+unsigned long memcurrent();
+void memreport(FILE *f);
+// the report as a JSON object, every line after the first indented
+void memjson(FILE *f, const char *indent);
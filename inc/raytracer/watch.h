@@ -0,0 +1,6 @@
+#pragma once
+
+// Renders file, then keeps watching it and the OBJ files it references.
+// Every change is applied to the loaded scene and only the tiles it
+// could have affected are rendered again. Never returns.
+void watchscene(const char *file, RenderOpts *opts);
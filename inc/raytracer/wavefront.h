@@ -0,0 +1,7 @@
+#pragma once
+
+// Renders the tile [x0, x1) x [y0, y1) breadth first: all rays of one
+// bounce are generated, sorted for coherence, intersected and shaded as
+// a batch before the next bounce starts. Output matches rendertile.
+void renderwavefront(Bitmap *bmp, Scene *s, Worker *w,
+        int x0, int y0, int x1, int y1);
@@ -0,0 +1,221 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <raytracer/math.h>
+#include <raytracer/obj.h>
+#include <raytracer/raytracer.h>
+#include <raytracer/render.h>
+#include <raytracer/shade.h>
+#include <raytracer/batch.h>
+#include <raytracer/pool.h>
+#include <raytracer/tracing.h>
+#include <raytracer/util.h>
+
+static Allocator _alloc = {"batch"};
+
+typedef struct {
+    const char *file;
+    Scene *scene;
+    Bitmap bmp;
+    TileCull tc;
+    int ntiles;
+    // handed out, and finished
+    int next, ndone;
+    // one per batch thread, set up by that thread on its first tile
+    Worker *workers;
+    unsigned char *ready;
+    double start;
+} BatchScene;
+
+typedef struct {
+    RenderOpts *opts;
+    BatchOpts *bo;
+    char **files;
+    int nfiles, nextfile;
+    int nthreads, maxscenes;
+    pthread_mutex_t lock;
+    // signalled when a scene is loaded or finished
+    pthread_cond_t wake;
+    // in flight, in load order
+    BatchScene **live;
+    int nlive, loading;
+    // where the next tile is taken from
+    int rr;
+    // the most a load has been seen to add, concurrent loads and
+    // renders blur it but only ever upwards
+    unsigned long biggest;
+    int finished, failed;
+} Batch;
+
+typedef struct {
+    Batch *b;
+    int t;
+} BatchThread;
+
+static BatchScene *loadscene(Batch *b, const char *file) {
+    tracebegin("load scene", file);
+    BatchScene *bs = xcalloc(&_alloc, 1, sizeof(BatchScene));
+    bs->file = file;
+    bs->start = now();
+    bs->scene = newscene(file);
+    if (!bs->scene) {
+        printf("batch: can't load %s, skipping it\n", file);
+        xfree(bs);
+        traceend();
+        return 0;
+    }
+    compilescene(bs->scene);
+    initbitmap(&bs->bmp, bs->scene->width, bs->scene->height);
+    clear(&bs->bmp, (Color){0});
+    int ts = b->opts->tilesize;
+    bs->ntiles = tilecount(&bs->bmp, ts);
+    // a grid culls by itself, and beats long tile lists
+    if (bs->scene->accel == ACCEL_NONE)
+        buildtilecull(&bs->tc, bs->scene, &bs->bmp, ts);
+    bs->workers = xcalloc(&_alloc, b->nthreads, sizeof(Worker));
+    bs->ready = xcalloc(&_alloc, b->nthreads, 1);
+    traceend();
+    return bs;
+}
+
+static void finishscene(Batch *b, BatchScene *bs) {
+    output(&bs->bmp, bs->scene->output);
+    RenderStats st = {0};
+    for (int t = 0; t < b->nthreads; t++) {
+        if (!bs->ready[t]) continue;
+        addstats(&st, &bs->workers[t].stats);
+        freeworker(&bs->workers[t]);
+    }
+    st.time = now() - bs->start;
+    // lines from scenes finishing together stay whole
+    flockfile(stdout);
+    printf("batch: %s -> %s in %.3fs\n", bs->file, bs->scene->output, st.time);
+    if (b->bo->stats)
+        printstats(&st, stdout);
+    funlockfile(stdout);
+    freetilecull(&bs->tc);
+    freebitmap(&bs->bmp);
+    freescene(bs->scene);
+    xfree(bs->workers);
+    xfree(bs->ready);
+    xfree(bs);
+}
+
+// next tile of the next scene after the last one served that has any
+static BatchScene *picktile(Batch *b, int *tile) {
+    for (int k = 0; k < b->nlive; k++) {
+        int j = (b->rr + k) % b->nlive;
+        BatchScene *bs = b->live[j];
+        if (bs->next < bs->ntiles) {
+            *tile = bs->next++;
+            b->rr = j + 1;
+            return bs;
+        }
+    }
+    return 0;
+}
+
+static int canload(Batch *b) {
+    if (b->nextfile == b->nfiles) return 0;
+    int inflight = b->nlive + b->loading;
+    if (!inflight) return 1;
+    if (inflight >= b->maxscenes) return 0;
+    unsigned long cap = b->bo->memcap;
+    return !cap || memcurrent() + (b->loading + 1) * b->biggest <= cap;
+}
+
+static void drop(Batch *b, BatchScene *bs) {
+    int j = 0;
+    while (b->live[j] != bs)
+        j++;
+    memmove(&b->live[j], &b->live[j + 1], (b->nlive - j - 1) * sizeof(BatchScene *));
+    b->nlive--;
+    if (b->rr > j) b->rr--;
+}
+
+// Loading comes first while there's room, so the next scenes are ready
+// before the ones rendering run out of tiles.
+static void batchthread(void *arg) {
+    BatchThread *bt = arg;
+    Batch *b = bt->b;
+    pthread_mutex_lock(&b->lock);
+    for (;;) {
+        if (canload(b)) {
+            const char *file = b->files[b->nextfile++];
+            b->loading++;
+            pthread_mutex_unlock(&b->lock);
+            unsigned long before = memcurrent();
+            BatchScene *bs = loadscene(b, file);
+            unsigned long after = memcurrent();
+            pthread_mutex_lock(&b->lock);
+            b->loading--;
+            if (after > before && after - before > b->biggest)
+                b->biggest = after - before;
+            if (!bs)
+                b->failed++;
+            else if (bs->ntiles)
+                b->live[b->nlive++] = bs;
+            else {
+                pthread_mutex_unlock(&b->lock);
+                finishscene(b, bs);
+                pthread_mutex_lock(&b->lock);
+                b->finished++;
+            }
+            pthread_cond_broadcast(&b->wake);
+            continue;
+        }
+        int i;
+        BatchScene *bs = picktile(b, &i);
+        if (bs) {
+            pthread_mutex_unlock(&b->lock);
+            Worker *w = &bs->workers[bt->t];
+            if (!bs->ready[bt->t]) {
+                initworker(w, bs->scene);
+                bs->ready[bt->t] = 1;
+            }
+            rendertileat(&bs->bmp, bs->scene, b->opts, 0, &bs->tc, w, i);
+            pthread_mutex_lock(&b->lock);
+            if (++bs->ndone < bs->ntiles) continue;
+            drop(b, bs);
+            pthread_mutex_unlock(&b->lock);
+            finishscene(b, bs);
+            pthread_mutex_lock(&b->lock);
+            b->finished++;
+            pthread_cond_broadcast(&b->wake);
+            continue;
+        }
+        if (b->nextfile == b->nfiles && !b->nlive && !b->loading) break;
+        pthread_cond_wait(&b->wake, &b->lock);
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+int renderbatch(char **files, int nfiles, RenderOpts *opts, BatchOpts *bo) {
+    double start = now();
+    Batch b = {opts, bo, files, nfiles};
+    b.nthreads = opts->nthreads > 0 ? opts->nthreads : ncpus();
+    b.maxscenes = bo->maxscenes > 0 ? bo->maxscenes : 2 * b.nthreads;
+    pthread_mutex_init(&b.lock, 0);
+    pthread_cond_init(&b.wake, 0);
+    b.live = xmalloc(&_alloc, b.maxscenes * sizeof(BatchScene *));
+    BatchThread *threads = xmalloc(&_alloc, b.nthreads * sizeof(BatchThread));
+    for (int t = 0; t < b.nthreads; t++)
+        threads[t] = (BatchThread){&b, t};
+    // Every job runs until the batch is done, so each gets a thread.
+    // Even a single one runs on the pool, loads on pool threads build
+    // their meshes and grids inline instead of starting pools of their own.
+    Pool *pool = newpool(b.nthreads);
+    for (int t = 0; t < b.nthreads; t++)
+        poolsubmit(pool, batchthread, &threads[t]);
+    poolwait(pool);
+    freepool(pool);
+    printf("batch: %i scenes on %i threads in %.3fs\n", b.finished, b.nthreads, now() - start);
+    if (b.failed)
+        printf("batch: %i scenes failed to load\n", b.failed);
+    xfree(threads);
+    xfree(b.live);
+    pthread_cond_destroy(&b.wake);
+    pthread_mutex_destroy(&b.lock);
+    return b.failed;
+}
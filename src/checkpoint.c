@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <string.h>
+#include <raytracer/math.h>
+#include <raytracer/obj.h>
+#include <raytracer/raytracer.h>
+#include <raytracer/render.h>
+#include <raytracer/checkpoint.h>
+
+#define CKPT_MAGIC "RTCK"
+#define CKPT_VERSION 1
+
+typedef struct {
+    char magic[4];
+    unsigned version;
+    unsigned key;
+    int width;
+    int height;
+    int tilesize;
+    int ntiles;
+} CkptHdr;
+
+static void mkhdr(CkptHdr *hdr, unsigned key, Bitmap *bmp,
+        int tilesize, int ntiles) {
+    memset(hdr, 0, sizeof(CkptHdr));
+    memcpy(hdr->magic, CKPT_MAGIC, 4);
+    hdr->version = CKPT_VERSION;
+    hdr->key = key;
+    hdr->width = bmp->width;
+    hdr->height = bmp->height;
+    hdr->tilesize = tilesize;
+    hdr->ntiles = ntiles;
+}
+
+int loadcheckpoint(const char *file, unsigned key, Bitmap *bmp,
+        int tilesize, unsigned char *done, int ntiles) {
+    FILE *f = fopen(file, "rb");
+    if (!f) return 0;
+    CkptHdr want, hdr;
+    mkhdr(&want, key, bmp, tilesize, ntiles);
+    int npixels = bmp->width * bmp->height;
+    int ok = fread(&hdr, sizeof(hdr), 1, f) == 1
+            && memcmp(&hdr, &want, sizeof(hdr)) == 0
+            && fread(done, ntiles, 1, f) == 1
+            && fread(bmp->pixels, sizeof(Color), npixels, f) == npixels;
+    fclose(f);
+    if (!ok) {
+        printf("checkpoint: ignoring stale or damaged %s\n", file);
+        memset(done, 0, ntiles);
+    }
+    return ok;
+}
+
+void savecheckpoint(const char *file, unsigned key, Bitmap *bmp,
+        int tilesize, unsigned char *done, int ntiles) {
+    // write next to the old checkpoint and swap it in, so a kill
+    // mid-write never leaves a truncated file behind
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        printf("checkpoint: can't write %s\n", tmp);
+        return;
+    }
+    CkptHdr hdr;
+    mkhdr(&hdr, key, bmp, tilesize, ntiles);
+    int npixels = bmp->width * bmp->height;
+    int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1
+            && fwrite(done, ntiles, 1, f) == 1
+            && fwrite(bmp->pixels, sizeof(Color), npixels, f) == npixels;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, file) != 0) {
+        printf("checkpoint: failed to write %s\n", file);
+        remove(tmp);
+    }
+}
+
+void removecheckpoint(const char *file) {
+    remove(file);
+}
@@ -1,4 +1,5 @@
 #include <ctype.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -21,13 +22,27 @@ typedef struct {
 } Tok;
 
 typedef struct {
+    const char *file;
     char *src;
     Tok prev;
     Tok cur;
+    // set by the first error, everything after it unwinds to parseconf
+    int failed;
 } Parser;
 
 static Allocator _alloc = {"conf"};
 
+static void fail(Parser *p, const char *fmt, ...) {
+    if (p->failed) return;
+    p->failed = 1;
+    va_list args;
+    va_start(args, fmt);
+    printf("conf: %s: ", p->file);
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+}
+
 static Tok _nexttok(Parser *p) {
     while (isspace(*p->src))
         p->src++;
@@ -44,15 +59,16 @@ static Tok _nexttok(Parser *p) {
     case '-': p->src++; goto num;
     }
     if (isdigit(*start)) goto num;
-    err("conf: unexpected char: %c", *start);
-    return (Tok){T_EOF};
+    fail(p, "unexpected char: %c", *start);
+    return (Tok){T_EOF, start, 0};
 str:
     while (*p->src) {
         p->src++;
         if (*(p->src - 1) == '"')
             return (Tok){T_STR, start + 1, p->src - start - 2};
     }
-    err("conf: unterminated string");
+    fail(p, "unterminated string");
+    return (Tok){T_EOF, p->src, 0};
 num:
     while (isdigit(*p->src))
         p->src++;
@@ -77,7 +93,7 @@ static int match(Parser *p, int type) {
 
 static void expect(Parser *p, int type) {
     if (match(p, type)) return;
-    err("conf: expected %i, got %i", type, p->cur.type);
+    fail(p, "expected %i, got %i", type, p->cur.type);
 }
 
 static ConfVal *newval(int type) {
@@ -131,7 +147,7 @@ static ConfVal *parseexp(Parser *p);
 static ConfVal *parseobj(Parser *p) {
     ConfVal *obj = newobj();
     expect(p, T_L_BRACE);
-    while (!match(p, T_R_BRACE)) {
+    while (!p->failed && !match(p, T_R_BRACE)) {
         expect(p, T_STR);
         Tok key = p->prev;
         expect(p, T_COLON);
@@ -145,7 +161,7 @@ static ConfVal *parseobj(Parser *p) {
 static ConfVal *parsearray(Parser *p) {
     ConfVal *arr = newarr();
     expect(p, T_L_BRACK);
-    while (!match(p, T_R_BRACK)) {
+    while (!p->failed && !match(p, T_R_BRACK)) {
         ConfVal *val = parseexp(p);
         match(p, T_COMMA);
         pushval(&arr->as.arr, val);
@@ -160,19 +176,31 @@ ConfVal *parseexp(Parser *p) {
     case T_STR: expect(p, T_STR); return newstr(p->prev);
     case T_NUM: expect(p, T_NUM); return newnum(p->prev);
     }
-    err("conf: unexpected tok %i", p->cur.type);
-    return 0;
+    fail(p, "unexpected tok %i", p->cur.type);
+    return newval(CONF_NONE);
 }
 
+static void freeval(ConfVal *v);
+
 Conf *parseconf(const char *file) {
-    Conf *conf = xmalloc(&_alloc, sizeof(Conf));
-    memset(conf, 0, sizeof(Conf));
-    char *src = readfile(file);
+    char *src = tryreadfile(file);
+    if (!src) {
+        printf("conf: can't read %s\n", file);
+        return 0;
+    }
     Parser p = {0};
+    p.file = file;
     p.src = src;
     advance(&p);
-    conf->root = parseexp(&p);
-    free(src);
+    ConfVal *root = parseexp(&p);
+    xfree(src);
+    if (p.failed) {
+        freeval(root);
+        return 0;
+    }
+    Conf *conf = xmalloc(&_alloc, sizeof(Conf));
+    memset(conf, 0, sizeof(Conf));
+    conf->root = root;
     return conf;
 }
 
@@ -244,7 +272,7 @@ void dumpconf(Conf *conf) {
 }
 
 void dumpconfmem() {
-    printf("conf mem usage: %u bytes\n", _alloc.size);
+    printf("conf mem usage: %lu bytes\n", _alloc.size);
 }
 
 ConfVal *confobjget(ConfVal *obj, const char *name) {
@@ -305,3 +333,24 @@ float confarrgetnum(ConfVal *obj, int i, float def) {
     if (!val) return def;
     return val->as.num;
 }
+
+unsigned confhash(ConfVal *v) {
+    unsigned h = hashbytes(&v->type, sizeof(v->type));
+    switch (v->type) {
+    case CONF_STR:
+        return h * 16777619u ^ hashbytes(v->as.str, strlen(v->as.str));
+    case CONF_NUM:
+        return h * 16777619u ^ hashbytes(&v->as.num, sizeof(float));
+    case CONF_ARR:
+        for (int i = 0; i < v->as.arr.nvals; i++)
+            h = h * 16777619u ^ confhash(v->as.arr.vals[i]);
+        break;
+    case CONF_OBJ:
+        for (int i = 0; i < v->as.obj.nkvs; i++) {
+            h = h * 16777619u ^ confhash(v->as.obj.keys[i]);
+            h = h * 16777619u ^ confhash(v->as.obj.vals[i]);
+        }
+        break;
+    }
+    return h;
+}
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <raytracer/math.h>
+#include <raytracer/obj.h>
+#include <raytracer/raytracer.h>
+#include <raytracer/render.h>
+#include <raytracer/shade.h>
+#include <raytracer/util.h>
+
+static Allocator _alloc = {"cull"};
+
+// Bounding sphere of a finite shape, 0 for anything else.
+static ShapeSphere *boundsof(Shape *s) {
+    if (s->type == SHAPE_SPHERE) return (ShapeSphere *)s;
+    if (s->type == SHAPE_MESH) return ((ShapeMesh *)s)->bounds;
+    return 0;
+}
+
+// Pixel rect covered by the corners of the sphere's box, padded by a
+// pixel for rounding. The camera sits at the origin looking down -z, so
+// nothing at z >= 0 is seen, and a box reaching there can't be bounded.
+// Returns 0 if the sphere is behind the camera, -1 if it can't be
+// bounded.
+static int project(Camera *c, ShapeSphere *sp, float *x0, float *y0, float *x1, float *y1) {
+    Vec3 r = vec3(sp->radius, sp->radius, sp->radius);
+    Vec3 min = vsub(sp->center, r), max = vadd(sp->center, r);
+    if (min.z >= 0) return 0;
+    if (max.z >= 0) return -1;
+    *x0 = *y0 = INFINITY;
+    *x1 = *y1 = -INFINITY;
+    for (int i = 0; i < 8; i++) {
+        Vec3 p = vec3(i & 1 ? max.x : min.x, i & 2 ? max.y : min.y, i & 4 ? max.z : min.z);
+        // inverse of primaryray
+        float sx = (p.x / -p.z + c->width / 2) / c->width * c->w;
+        float sy = c->h - (p.y / -p.z + c->height / 2) / c->height * c->h;
+        *x0 = fminf(*x0, sx - 1);
+        *y0 = fminf(*y0, sy - 1);
+        *x1 = fmaxf(*x1, sx + 1);
+        *y1 = fmaxf(*y1, sy + 1);
+    }
+    return 1;
+}
+
+// Tile rect of every shape first, so each tile's list is allocated once.
+void buildtilecull(TileCull *tc, Scene *s, Bitmap *bmp, int ts) {
+    Camera cam;
+    initcamera(&cam, s, bmp->width, bmp->height);
+    int tw = (bmp->width + ts - 1) / ts;
+    int th = (bmp->height + ts - 1) / ts;
+    tc->ntiles = tw * th;
+    tc->tiles = xcalloc(&_alloc, tc->ntiles, sizeof(Batches));
+    int *counts = xcalloc(&_alloc, tc->ntiles, sizeof(int));
+    // tx0, ty0, tx1, ty1, with tx0 -1 for shapes in no tile
+    int *rects = xmalloc(&_alloc, (s->nshapes ? s->nshapes : 1) * 4 * sizeof(int));
+    for (int i = 0; i < s->nshapes; i++) {
+        ShapeSphere *sp = boundsof(s->shapes[i]);
+        int *r = &rects[i * 4];
+        r[0] = 0, r[1] = 0, r[2] = tw - 1, r[3] = th - 1;
+        if (sp) {
+            float x0, y0, x1, y1;
+            int vis = project(&cam, sp, &x0, &y0, &x1, &y1);
+            if (vis > 0 && (x1 < 0 || y1 < 0 || x0 > bmp->width - 1 || y0 > bmp->height - 1))
+                vis = 0;
+            if (!vis) {
+                r[0] = -1;
+                continue;
+            }
+            if (vis > 0) {
+                r[0] = clampi(floorf(x0 / ts), tw - 1);
+                r[1] = clampi(floorf(y0 / ts), th - 1);
+                r[2] = clampi(floorf(x1 / ts), tw - 1);
+                r[3] = clampi(floorf(y1 / ts), th - 1);
+            }
+        }
+        for (int ty = r[1]; ty <= r[3]; ty++)
+            for (int tx = r[0]; tx <= r[2]; tx++)
+                counts[ty * tw + tx]++;
+    }
+    Shape ***lists = xmalloc(&_alloc, tc->ntiles * sizeof(Shape **));
+    for (int t = 0; t < tc->ntiles; t++) {
+        lists[t] = xmalloc(&_alloc, (counts[t] ? counts[t] : 1) * sizeof(Shape *));
+        counts[t] = 0;
+    }
+    for (int i = 0; i < s->nshapes; i++) {
+        int *r = &rects[i * 4];
+        if (r[0] < 0) continue;
+        for (int ty = r[1]; ty <= r[3]; ty++) {
+            for (int tx = r[0]; tx <= r[2]; tx++) {
+                int t = ty * tw + tx;
+                lists[t][counts[t]++] = s->shapes[i];
+            }
+        }
+    }
+    // in scene order, so ties resolve as they do against all shapes
+    for (int t = 0; t < tc->ntiles; t++) {
+        buildbatches(&tc->tiles[t], lists[t], counts[t]);
+        xfree(lists[t]);
+    }
+    xfree(lists);
+    xfree(rects);
+    xfree(counts);
+}
+
+void freetilecull(TileCull *tc) {
+    for (int t = 0; t < tc->ntiles; t++)
+        freebatches(&tc->tiles[t]);
+    xfree(tc->tiles);
+    memset(tc, 0, sizeof(TileCull));
+}
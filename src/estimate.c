@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <raytracer/math.h>
+#include <raytracer/obj.h>
+#include <raytracer/raytracer.h>
+#include <raytracer/render.h>
+#include <raytracer/shade.h>
+#include <raytracer/estimate.h>
+#include <raytracer/pool.h>
+#include <raytracer/util.h>
+
+// less work than this isn't worth starting threads for
+#define MIN_PARALLEL 0.05
+// the costliest tile may take at most this share of a thread's work,
+// beyond that one late tile decides when the image is done
+#define TAIL_SHARE 0.25
+#define MAX_TILE 64
+#define MIN_TILE ESTIMATE_REGION
+// a budget is met by raising the cutoff this much at a time
+#define CUTOFF_FIRST 0.001
+#define CUTOFF_STEP 3
+#define MAX_RETUNES 8
+
+static Allocator _alloc = {"estimate"};
+
+// what reading the clock twice costs, taken off every timed pixel
+static double clockcost() {
+    double min = 1;
+    for (int i = 0; i < 16; i++) {
+        double t0 = now();
+        double dt = now() - t0;
+        if (dt < min) min = dt;
+    }
+    return min;
+}
+
+// One pixel per region at a hashed spot, so regular patterns in the
+// image don't line up with the probe, scaled up to the region's size.
+// Rays see the same tile culling the render will.
+static void probe(Bitmap *bmp, Scene *s, RenderOpts *opts, RenderEstimate *est) {
+    double start = now();
+    compilescene(s);
+    int ts = opts->tilesize;
+    TileCull tc = {0};
+    if (s->accel == ACCEL_NONE)
+        buildtilecull(&tc, s, bmp, ts);
+    Worker w;
+    initworker(&w, s);
+    Camera cam;
+    initcamera(&cam, s, bmp->width, bmp->height);
+    double overhead = clockcost();
+    int tw = (bmp->width + ts - 1) / ts;
+    est->time = 0;
+    est->probed = 0;
+    for (int ry = 0; ry < est->rows; ry++) {
+        for (int rx = 0; rx < est->cols; rx++) {
+            int x0 = rx * ESTIMATE_REGION, y0 = ry * ESTIMATE_REGION;
+            int x1 = x0 + ESTIMATE_REGION < bmp->width ? x0 + ESTIMATE_REGION : bmp->width;
+            int y1 = y0 + ESTIMATE_REGION < bmp->height ? y0 + ESTIMATE_REGION : bmp->height;
+            int region = ry * est->cols + rx;
+            unsigned h = hashbytes(&region, sizeof(region));
+            int x = x0 + h % (x1 - x0), y = y0 + (h >> 16) % (y1 - y0);
+            if (tc.tiles)
+                w.tile = &tc.tiles[(y / ts) * tw + x / ts];
+            rngseed(&w.rng, s->seed, y * bmp->width + x);
+            double t0 = now();
+            Ray ray = primaryray(&cam, x, y);
+            Hit hit;
+            xcast(s, &ray, 0, &hit, &w);
+            double dt = now() - t0 - overhead;
+            est->cost[region] = (dt > 0 ? dt : 0) * (x1 - x0) * (y1 - y0);
+            est->time += est->cost[region];
+            est->probed++;
+        }
+    }
+    freeworker(&w);
+    freetilecull(&tc);
+    est->probetime += now() - start;
+}
+
+void estimaterender(Bitmap *bmp, Scene *scene, RenderOpts *opts, RenderEstimate *est) {
+    memset(est, 0, sizeof(RenderEstimate));
+    est->cols = (bmp->width + ESTIMATE_REGION - 1) / ESTIMATE_REGION;
+    est->rows = (bmp->height + ESTIMATE_REGION - 1) / ESTIMATE_REGION;
+    int n = est->cols * est->rows;
+    est->cost = xcalloc(&_alloc, n ? n : 1, sizeof(double));
+    probe(bmp, scene, opts, est);
+    est->tilesize = opts->tilesize;
+    est->nthreads = opts->nthreads > 0 ? opts->nthreads : ncpus();
+    est->lightcutoff = scene->lightcutoff;
+    est->lightsamples = scene->lightsamples;
+    est->wall = est->time / est->nthreads;
+}
+
+// summed cost of the costliest tile ts pixels wide
+static double maxtile(RenderEstimate *est, int ts) {
+    int k = ts > ESTIMATE_REGION ? ts / ESTIMATE_REGION : 1;
+    double max = 0;
+    for (int ty = 0; ty < est->rows; ty += k) {
+        for (int tx = 0; tx < est->cols; tx += k) {
+            double sum = 0;
+            for (int y = ty; y < ty + k && y < est->rows; y++)
+                for (int x = tx; x < tx + k && x < est->cols; x++)
+                    sum += est->cost[y * est->cols + x];
+            if (sum > max) max = sum;
+        }
+    }
+    return max;
+}
+
+// Tiles are handed out as threads free up, the image takes about its
+// share per thread unless one tile takes longer on its own. Settings
+// given on the command line are kept and predicted with as they are.
+static void pick(RenderEstimate *est, Bitmap *bmp) {
+    int n = est->nthreads;
+    if (!est->fixedthreads)
+        n = est->time < MIN_PARALLEL ? 1 : ncpus();
+    int ts = est->tilesize;
+    if (!est->fixedtile && n > 1) {
+        ts = MAX_TILE;
+        while (ts > MIN_TILE && maxtile(est, ts) > TAIL_SHARE * est->time / n)
+            ts /= 2;
+    }
+    // threads beyond the tile count have nothing to do
+    int ntiles = tilecount(bmp, ts);
+    int busy = n < ntiles ? n : ntiles;
+    if (!est->fixedthreads) n = busy;
+    est->tilesize = ts;
+    est->nthreads = n;
+    double tail = maxtile(est, ts);
+    est->wall = est->time / busy > tail ? est->time / busy : tail;
+}
+
+void tunerender(Bitmap *bmp, Scene *scene, RenderOpts *opts, double budget, RenderEstimate *est) {
+    pick(est, bmp);
+    // sampled lights are halved, otherwise the cutoff is raised, until
+    // the probe fits; both only ever make the image cheaper
+    for (int i = 0; budget > 0 && est->wall > budget && i < MAX_RETUNES; i++) {
+        if (scene->nlights < 2) break;
+        if (scene->lightsamples > 0) {
+            if (scene->lightsamples == 1) break;
+            scene->lightsamples /= 2;
+        }
+        else if (scene->lightcutoff <= 0)
+            scene->lightcutoff = CUTOFF_FIRST;
+        else
+            scene->lightcutoff *= CUTOFF_STEP;
+        probe(bmp, scene, opts, est);
+        est->lightcutoff = scene->lightcutoff;
+        est->lightsamples = scene->lightsamples;
+        pick(est, bmp);
+    }
+}
+
+void printestimate(RenderEstimate *est, FILE *f) {
+    int n = est->cols * est->rows, hot = 0;
+    for (int i = 1; i < n; i++)
+        if (est->cost[i] > est->cost[hot]) hot = i;
+    double mean = n ? est->time / n : 0;
+    fprintf(f, "{\n");
+    fprintf(f, "  \"estimate\": {\"time\": %.3f, \"wall\": %.3f, \"probe\": %.3f, \"pixels\": %i},\n",
+            est->time, est->wall, est->probetime, est->probed);
+    fprintf(f, "  \"regions\": {\"size\": %i, \"cols\": %i, \"rows\": %i, "
+            "\"mean\": %.6f, \"max\": %.6f, \"hottest\": [%i, %i]},\n",
+            ESTIMATE_REGION, est->cols, est->rows, mean, n ? est->cost[hot] : 0,
+            (hot % (est->cols ? est->cols : 1)) * ESTIMATE_REGION,
+            (hot / (est->cols ? est->cols : 1)) * ESTIMATE_REGION);
+    fprintf(f, "  \"picked\": {\"tile_size\": %i, \"threads\": %i, \"lightcutoff\": %g, \"lightsamples\": %i}\n",
+            est->tilesize, est->nthreads, est->lightcutoff, est->lightsamples);
+    fprintf(f, "}\n");
+}
+
+void freeestimate(RenderEstimate *est) {
+    xfree(est->cost);
+}
@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <raytracer/math.h>
+#include <raytracer/obj.h>
+#include <raytracer/raytracer.h>
+#include <raytracer/render.h>
+#include <raytracer/shade.h>
+#include <raytracer/gbuffer.h>
+#include <raytracer/util.h>
+#include <raytracer/stream.h>
+#include <raytracer/lazy.h>
+
+#define NDEPTHS (MAX_RECUR + 1)
+#define GBUF_MAGIC "RTGB"
+#define GBUF_VERSION 1
+
+static Allocator _alloc = {"gbuffer"};
+
+typedef struct {
+    char magic[4];
+    unsigned version;
+    unsigned key;
+    int width;
+    int height;
+    int ndepths;
+    int nlights;
+    int hasvis;
+} GBufHdr;
+
+static unsigned mix(unsigned h, const void *data, unsigned size) {
+    return h * 16777619u ^ hashbytes(data, size);
+}
+
+// Hash of everything primary and reflection visibility depends on:
+// resolution, camera and geometry, but not materials or lights.
+static unsigned geomkey(Scene *s, int w, int h) {
+    unsigned key = 0;
+    key = mix(key, &w, sizeof(w));
+    key = mix(key, &h, sizeof(h));
+    key = mix(key, &s->vfov, sizeof(s->vfov));
+    key = mix(key, &s->nshapes, sizeof(s->nshapes));
+    for (int i = 0; i < s->nshapes; i++) {
+        Shape *shape = s->shapes[i];
+        key = mix(key, &shape->type, sizeof(shape->type));
+        key = mix(key, &shape->transform, sizeof(Matrix));
+        if (shape->type == SHAPE_SPHERE) {
+            ShapeSphere *sp = (ShapeSphere *)shape;
+            key = mix(key, &sp->center, sizeof(Vec3));
+            key = mix(key, &sp->radius, sizeof(float));
+        }
+        else if (shape->type == SHAPE_PLANE) {
+            ShapePlane *p = (ShapePlane *)shape;
+            key = mix(key, &p->point, sizeof(Vec3));
+            key = mix(key, &p->normal, sizeof(Vec3));
+        }
+        else if (shape->type == SHAPE_MESH) {
+            ShapeMesh *m = (ShapeMesh *)shape;
+            key = mix(key, &m->smooth, sizeof(int));
+            if (m->stream)
+                key = mix(key, &m->stream->key, sizeof(unsigned));
+            // the same whether or not it got loaded yet
+            else if (m->lazy) {
+                key = mix(key, &m->lazy->key, sizeof(unsigned));
+                key = mix(key, &m->lazy->box, sizeof(Aabb));
+            }
+            else if (m->q) {
+                MeshQ *q = m->q;
+                key = mix(key, q->verts, q->nverts * 3 * sizeof(short));
+                if (q->tris16)
+                    key = mix(key, q->tris16, q->ntris * 3 * sizeof(short));
+                else
+                    key = mix(key, q->tris32, q->ntris * 3 * sizeof(int));
+            }
+            else {
+                Obj *o = m->obj;
+                key = mix(key, o->verts, o->nverts * 3 * sizeof(float));
+                key = mix(key, o->tris, o->ntris * 3 * sizeof(int));
+                if (o->nnorms) {
+                    key = mix(key, o->norms, o->nnorms * 3 * sizeof(float));
+                    key = mix(key, o->normidx, o->ntris * 3 * sizeof(int));
+                }
+            }
+        }
+    }
+    return key;
+}
+
+static void resetvis(GBuffer *gb, Scene *s) {
+    xfree(gb->vis);
+    xfree(gb->lightpos);
+    gb->vis = 0;
+    gb->lightpos = 0;
+    gb->nlights = s->nlights;
+    if (gb->nlights > GBUF_MAX_LIGHTS || !gb->nlights) return;
+    int npixels = gb->width * gb->height;
+    gb->vis = xcalloc(&_alloc, npixels * NDEPTHS * gb->nlights, 1);
+    gb->lightpos = xmalloc(&_alloc, gb->nlights * sizeof(Vec3));
+    for (int i = 0; i < gb->nlights; i++)
+        gb->lightpos[i] = s->lights[i]->pos;
+}
+
+// Marks shadow results unknown for every light whose position differs
+// from gb->lightpos. Returns how many did.
+static int syncvis(GBuffer *gb, Vec3 *pos) {
+    int nhits = gb->width * gb->height * NDEPTHS;
+    int nmoved = 0;
+    for (int k = 0; k < gb->nlights; k++) {
+        if (memcmp(&pos[k], &gb->lightpos[k], sizeof(Vec3)) == 0)
+            continue;
+        nmoved++;
+        for (int i = 0; i < nhits; i++)
+            gb->vis[i * gb->nlights + k] = GVIS_UNKNOWN;
+    }
+    return nmoved;
+}
+
+void syncgbufferlights(GBuffer *gb, Scene *s) {
+    if (s->nlights != gb->nlights || !gb->vis) {
+        resetvis(gb, s);
+        return;
+    }
+    Vec3 *pos = xmalloc(&_alloc, s->nlights * sizeof(Vec3));
+    for (int k = 0; k < s->nlights; k++)
+        pos[k] = s->lights[k]->pos;
+    syncvis(gb, pos);
+    xfree(gb->lightpos);
+    gb->lightpos = pos;
+}
+
+void cleargbuffer(GBuffer *gb, int x0, int y0, int x1, int y1) {
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            int slot = (y * gb->width + x) * NDEPTHS;
+            for (int d = 0; d < NDEPTHS; d++)
+                gb->hits[slot + d].shape = GHIT_UNKNOWN;
+            if (gb->vis)
+                memset(&gb->vis[slot * gb->nlights], 0, NDEPTHS * gb->nlights);
+        }
+    }
+}
+
+static int load(GBuffer *gb, Scene *s) {
+    FILE *f = fopen(gb->file, "rb");
+    if (!f) return 0;
+    GBufHdr hdr;
+    int npixels = gb->width * gb->height;
+    int nhits = npixels * NDEPTHS;
+    int ok = fread(&hdr, sizeof(hdr), 1, f) == 1
+            && memcmp(hdr.magic, GBUF_MAGIC, 4) == 0
+            && hdr.version == GBUF_VERSION
+            && hdr.key == gb->key
+            && hdr.width == gb->width
+            && hdr.height == gb->height
+            && hdr.ndepths == NDEPTHS
+            && fread(gb->hits, sizeof(GHit), nhits, f) == nhits;
+    if (!ok) {
+        fclose(f);
+        printf("gbuffer: %s doesn't match the scene, retracing\n", gb->file);
+        return 0;
+    }
+    gb->reused = 1;
+    // shadow results only carry over for lights that didn't move
+    if (hdr.hasvis && hdr.nlights == gb->nlights && gb->vis) {
+        Vec3 *cur = gb->lightpos;
+        gb->lightpos = xmalloc(&_alloc, hdr.nlights * sizeof(Vec3));
+        int nvis = nhits * hdr.nlights;
+        if (fread(gb->lightpos, sizeof(Vec3), hdr.nlights, f) == hdr.nlights
+                && fread(gb->vis, 1, nvis, f) == nvis) {
+            int nmoved = syncvis(gb, cur);
+            printf("gbuffer: reusing hits, %i/%i lights moved\n", nmoved, gb->nlights);
+        }
+        else
+            memset(gb->vis, 0, nvis);
+        xfree(gb->lightpos);
+        gb->lightpos = cur;
+    }
+    else
+        printf("gbuffer: reusing hits, retracing all shadow rays\n");
+    fclose(f);
+    return 1;
+}
+
+// file may be null for a buffer that only lives in memory
+GBuffer *opengbuffer(const char *file, Scene *s, int w, int h) {
+    GBuffer *gb = xcalloc(&_alloc, 1, sizeof(GBuffer));
+    gb->file = file;
+    gb->width = w;
+    gb->height = h;
+    gb->key = geomkey(s, w, h);
+    int nhits = w * h * NDEPTHS;
+    gb->hits = xmalloc(&_alloc, nhits * sizeof(GHit));
+    resetvis(gb, s);
+    if (!file || !load(gb, s)) {
+        for (int i = 0; i < nhits; i++)
+            gb->hits[i].shape = GHIT_UNKNOWN;
+    }
+    return gb;
+}
+
+void savegbuffer(GBuffer *gb, Scene *s) {
+    if (!gb->file) return;
+    // an interrupted write keeps the previous G-buffer
+    char tmp[1100];
+    FILE *f = opentemp(gb->file, tmp, sizeof(tmp));
+    if (!f) {
+        printf("gbuffer: can't write %s\n", gb->file);
+        return;
+    }
+    GBufHdr hdr = {{0}};
+    memcpy(hdr.magic, GBUF_MAGIC, 4);
+    hdr.version = GBUF_VERSION;
+    hdr.key = gb->key;
+    hdr.width = gb->width;
+    hdr.height = gb->height;
+    hdr.ndepths = NDEPTHS;
+    hdr.nlights = gb->nlights;
+    hdr.hasvis = gb->vis != 0;
+    int nhits = gb->width * gb->height * NDEPTHS;
+    int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1
+            && fwrite(gb->hits, sizeof(GHit), nhits, f) == nhits;
+    if (ok && gb->vis) {
+        ok = fwrite(gb->lightpos, sizeof(Vec3), gb->nlights, f) == gb->nlights
+                && fwrite(gb->vis, 1, nhits * gb->nlights, f) == nhits * gb->nlights;
+    }
+    if (!closetemp(f, tmp, gb->file, ok))
+        printf("gbuffer: failed to write %s\n", gb->file);
+}
+
+void freegbuffer(GBuffer *gb) {
+    xfree(gb->hits);
+    xfree(gb->vis);
+    xfree(gb->lightpos);
+    xfree(gb);
+}
+
+static int ghit(Scene *s, Worker *w, GHit *rec, Ray *r, int recur, Hit *hit) {
+    if (rec->shape == GHIT_UNKNOWN) {
+        if (!(recur ? testscene(s, w, r, hit) : testprimary(s, w, r, hit))) {
+            rec->shape = GHIT_MISS;
+            return 0;
+        }
+        rec->shape = hit->shape->id;
+        rec->dist = hit->dist;
+        rec->point = hit->point;
+        rec->norm = hit->norm;
+        return 1;
+    }
+    if (rec->shape == GHIT_MISS) return 0;
+    hit->shape = s->shapes[rec->shape];
+    hit->dist = rec->dist;
+    hit->point = rec->point;
+    hit->norm = rec->norm;
+    return 1;
+}
+
+static int gvisible(Scene *s, unsigned char *vis, Hit *hit,
+        Light *light, Worker *w) {
+    unsigned char *v = vis ? &vis[light->id] : 0;
+    if (v && *v != GVIS_UNKNOWN) return *v == GVIS_LIT;
+    Ray ray;
+    float dist = shadowray(hit, light, &ray);
+    int lit = !occluded(s, w, light, &ray, dist);
+    if (v) *v = lit ? GVIS_LIT : GVIS_BLOCKED;
+    return lit;
+}
+
+static Vec3 _gcast(Scene *s, GBuffer *gb, int pixel, Ray *r, int recur, Worker *w) {
+    int slot = pixel * NDEPTHS + recur;
+    Hit hit;
+    if (!ghit(s, w, &gb->hits[slot], r, recur, &hit)) return s->background;
+    touchshape(w, hit.shape);
+    unsigned char *vis = gb->vis ? &gb->vis[slot * gb->nlights] : 0;
+    Vec3 color = vec3(0.0, 0.0, 0.0);
+    Vec3 v = vsub(r->orig, hit.point);
+
+    // lights, as in xcast
+    int npicks = picklights(s, w, hit.point, recur);
+    for (int k = 0; k < npicks; k++) {
+        LightPick *pick = &w->picks[k];
+        if (!gvisible(s, vis, &hit, pick->light, w)) continue;
+        Vec3 lc = lightcolor(&hit, v, pick->light);
+        color = vadd(color, vmul(lc, pick->weight));
+    }
+
+    // reflections
+    if (recur < MAX_RECUR) {
+        w->stats.reflectionrays++;
+        Ray ray = reflray(r, &hit);
+        Vec3 rc = _gcast(s, gb, pixel, &ray, recur + 1, w);
+        float irefl = hit.shape->mat.reflectiveness;
+        color = vadd(color, vmul(rc, irefl));
+    }
+
+    return color;
+}
+
+Vec3 gcast(Scene *s, GBuffer *gb, int pixel, Ray *r, Worker *w) {
+    return _gcast(s, gb, pixel, r, 0, w);
+}
@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <raytracer/math.h>
+#include <raytracer/obj.h>
+#include <raytracer/raytracer.h>
+#include <raytracer/pool.h>
+#include <raytracer/util.h>
+
+// about this many cells per sphere, with no axis finer than MAX_CELLS
+#define CELLS_PER_SPHERE 2
+#define MAX_CELLS 512
+// fewer spheres than this are binned on the calling thread
+#define PARALLEL_MIN (1 << 14)
+
+static Allocator _alloc = {"grid"};
+
+static Vec3 center(Batches *b, int i) {
+    return vec3(b->sx[i], b->sy[i], b->sz[i]);
+}
+
+// cells overlapped by the box of sphere i
+static void cellrange(Grid *g, Batches *b, int i, int lo[3], int hi[3]) {
+    float r = sqrtf(b->sr2[i]);
+    Vec3 c = center(b, i);
+    Vec3 bmin = vsub(c, vec3(r, r, r)), bmax = vadd(c, vec3(r, r, r));
+    int n[3] = {g->nx, g->ny, g->nz};
+    for (int k = 0; k < 3; k++) {
+        float o = axisof(g->min, k), cs = axisof(g->cellsize, k);
+        lo[k] = clampi(floorf((axisof(bmin, k) - o) / cs), n[k] - 1);
+        hi[k] = clampi(floorf((axisof(bmax, k) - o) / cs), n[k] - 1);
+    }
+}
+
+// Bins spheres lo to hi, counting cell sizes into starts or, once those
+// are offsets, writing items through cursor.
+typedef struct {
+    Grid *g;
+    Batches *b;
+    int lo, hi;
+    int *cursor;
+} BinJob;
+
+static void binjob(void *arg) {
+    BinJob *job = arg;
+    Grid *g = job->g;
+    for (int i = job->lo; i < job->hi; i++) {
+        int lo[3], hi[3];
+        cellrange(g, job->b, i, lo, hi);
+        for (int z = lo[2]; z <= hi[2]; z++) {
+            for (int y = lo[1]; y <= hi[1]; y++) {
+                for (int x = lo[0]; x <= hi[0]; x++) {
+                    int c = (z * g->ny + y) * g->nx + x;
+                    if (job->cursor)
+                        g->items[__atomic_fetch_add(&job->cursor[c], 1, __ATOMIC_RELAXED)] = i;
+                    else
+                        __atomic_fetch_add(&g->starts[c], 1, __ATOMIC_RELAXED);
+                }
+            }
+        }
+    }
+}
+
+static void bin(Grid *g, Batches *b, Pool *pool, BinJob *jobs, int njobs, int *cursor) {
+    for (int j = 0; j < njobs; j++) {
+        jobs[j] = (BinJob){g, b, (long)b->nspheres * j / njobs,
+                (long)b->nspheres * (j + 1) / njobs, cursor};
+        if (pool) poolsubmit(pool, binjob, &jobs[j]);
+        else binjob(&jobs[j]);
+    }
+    if (pool) poolwait(pool);
+}
+
+static int cmpint(const void *a, const void *b) {
+    return *(int *)a - *(int *)b;
+}
+
+// Two passes over the spheres, both split across the pool: count per
+// cell, then place into the offsets. Parallel placement leaves cells in
+// any order, they are sorted back so ties resolve as in the plain loop.
+Grid *newgrid(Batches *b) {
+    Grid *g = xcalloc(&_alloc, 1, sizeof(Grid));
+    int n = b->nspheres;
+    g->min = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+    g->max = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for (int i = 0; i < n; i++) {
+        float r = sqrtf(b->sr2[i]);
+        g->min = vmin(g->min, vsub(center(b, i), vec3(r, r, r)));
+        g->max = vmax(g->max, vadd(center(b, i), vec3(r, r, r)));
+    }
+    if (!n) g->min = g->max = vec3(0, 0, 0);
+    Vec3 ext = vsub(g->max, g->min);
+    ext = vmax(ext, vec3(1e-6, 1e-6, 1e-6));
+    float k = cbrtf(CELLS_PER_SPHERE * (n ? n : 1) / (ext.x * ext.y * ext.z));
+    int dims[3];
+    for (int a = 0; a < 3; a++)
+        dims[a] = fmaxf(1, fminf(MAX_CELLS, ceilf(axisof(ext, a) * k)));
+    // flat or stretched scenes can ask for far more cells than spheres
+    while ((long)dims[0] * dims[1] * dims[2] > 8L * CELLS_PER_SPHERE * n + 64) {
+        int a = dims[0] > dims[1] ? (dims[0] > dims[2] ? 0 : 2) : (dims[1] > dims[2] ? 1 : 2);
+        dims[a] = (dims[a] + 1) / 2;
+    }
+    // cells are sized to fit the box exactly, nothing lands outside
+    g->nx = dims[0], g->ny = dims[1], g->nz = dims[2];
+    g->cellsize = vec3(ext.x / g->nx, ext.y / g->ny, ext.z / g->nz);
+    int ncells = g->nx * g->ny * g->nz;
+    g->starts = xcalloc(&_alloc, ncells + 1, sizeof(int));
+
+    int njobs = n >= PARALLEL_MIN ? poolcpus() : 1;
+    Pool *pool = njobs > 1 ? newpool(njobs) : 0;
+    BinJob *jobs = xmalloc(&_alloc, njobs * sizeof(BinJob));
+    bin(g, b, pool, jobs, njobs, 0);
+    int total = 0;
+    for (int c = 0; c <= ncells; c++) {
+        int count = g->starts[c];
+        g->starts[c] = total;
+        total += count;
+    }
+    g->items = xmalloc(&_alloc, (total ? total : 1) * sizeof(int));
+    int *cursor = xmalloc(&_alloc, (ncells + 1) * sizeof(int));
+    memcpy(cursor, g->starts, (ncells + 1) * sizeof(int));
+    bin(g, b, pool, jobs, njobs, cursor);
+    if (pool) {
+        for (int c = 0; c < ncells; c++)
+            qsort(&g->items[g->starts[c]], g->starts[c + 1] - g->starts[c], sizeof(int), cmpint);
+        freepool(pool);
+    }
+    xfree(cursor);
+    xfree(jobs);
+    return g;
+}
+
+Grid *copygrid(Grid *g) {
+    Grid *c = xmalloc(&_alloc, sizeof(Grid));
+    *c = *g;
+    int ncells = g->nx * g->ny * g->nz;
+    int nitems = g->starts[ncells];
+    c->starts = xmalloc(&_alloc, (ncells + 1) * sizeof(int));
+    memcpy(c->starts, g->starts, (ncells + 1) * sizeof(int));
+    c->items = xmalloc(&_alloc, (nitems ? nitems : 1) * sizeof(int));
+    memcpy(c->items, g->items, nitems * sizeof(int));
+    return c;
+}
+
+void freegrid(Grid *g) {
+    xfree(g->starts);
+    xfree(g->items);
+    xfree(g);
+}
+
+// 3D-DDA through the cells from where the ray enters the grid. A hit is
+// final once it is no further than where the current cell is left,
+// every sphere reaching closer is listed in a cell already visited.
+int gridtest(Grid *g, Batches *b, Ray *r, float *dist) {
+    float t0 = 0, t1 = *dist;
+    for (int k = 0; k < 3; k++) {
+        float o = axisof(r->orig, k), d = axisof(r->dir, k);
+        float lo = axisof(g->min, k), hi = axisof(g->max, k);
+        if (d == 0) {
+            if (o < lo || o > hi) return -1;
+            continue;
+        }
+        float ta = (lo - o) / d, tb = (hi - o) / d;
+        t0 = fmaxf(t0, fminf(ta, tb));
+        t1 = fminf(t1, fmaxf(ta, tb));
+    }
+    if (t0 > t1) return -1;
+    Vec3 p = vadd(r->orig, vmul(r->dir, t0));
+    int n[3] = {g->nx, g->ny, g->nz};
+    int cell[3], step[3];
+    float next[3], delta[3];
+    for (int k = 0; k < 3; k++) {
+        float o = axisof(r->orig, k), d = axisof(r->dir, k);
+        float lo = axisof(g->min, k), cs = axisof(g->cellsize, k);
+        cell[k] = clampi(floorf((axisof(p, k) - lo) / cs), n[k] - 1);
+        if (d > 0) {
+            step[k] = 1;
+            next[k] = (lo + (cell[k] + 1) * cs - o) / d;
+            delta[k] = cs / d;
+        }
+        else if (d < 0) {
+            step[k] = -1;
+            next[k] = (lo + cell[k] * cs - o) / d;
+            delta[k] = -cs / d;
+        }
+        else {
+            step[k] = 0;
+            next[k] = delta[k] = FLT_MAX;
+        }
+    }
+    int best = -1;
+    float bestdist = *dist;
+    for (;;) {
+        int c = (cell[2] * g->ny + cell[1]) * g->nx + cell[0];
+        for (int j = g->starts[c]; j < g->starts[c + 1]; j++) {
+            int i = g->items[j];
+            float d;
+            if (!spheredist(center(b, i), b->sr2[i], r, &d)) continue;
+            // the highest index wins ties, as in the plain loop
+            if (d < bestdist || (d == bestdist && i > best)) {
+                bestdist = d;
+                best = i;
+            }
+        }
+        int k = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+        if (best >= 0 && bestdist < next[k]) break;
+        if (next[k] > t1) break;
+        cell[k] += step[k];
+        if (cell[k] < 0 || cell[k] >= n[k]) break;
+        next[k] += delta[k];
+    }
+    if (best >= 0) *dist = bestdist;
+    return best;
+}
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <sys/stat.h>
+#include <raytracer/math.h>
+#include <raytracer/obj.h>
+#include <raytracer/raytracer.h>
+#include <raytracer/lazy.h>
+#include <raytracer/util.h>
+
+#define BOUNDS_MAGIC "RTMB"
+#define BOUNDS_VERSION 1
+#define BOUNDS_EXT ".rtbounds"
+
+static Allocator _alloc = {"lazy"};
+
+typedef struct {
+    char magic[4];
+    unsigned version;
+    unsigned key;
+    Aabb box;
+} BoundsHdr;
+
+unsigned lazykey(const char *objfile) {
+    struct stat st;
+    if (stat(objfile, &st) != 0) return 0;
+    long long v[3] = {st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+    return hashbytes(v, sizeof(v));
+}
+
+static void boundsfile(const char *objfile, char *path, int size) {
+    snprintf(path, size, "%s%s", objfile, BOUNDS_EXT);
+}
+
+int loadbounds(const char *objfile, Aabb *box) {
+    char path[1100];
+    boundsfile(objfile, path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    BoundsHdr hdr;
+    int ok = fread(&hdr, sizeof(hdr), 1, f) == 1
+            && memcmp(hdr.magic, BOUNDS_MAGIC, 4) == 0
+            && hdr.version == BOUNDS_VERSION
+            && hdr.key == lazykey(objfile);
+    fclose(f);
+    if (ok) *box = hdr.box;
+    return ok;
+}
+
+void savebounds(const char *objfile, Obj *o, Aabb *box) {
+    BoundsHdr hdr = {{0}};
+    memcpy(hdr.magic, BOUNDS_MAGIC, 4);
+    hdr.version = BOUNDS_VERSION;
+    hdr.key = lazykey(objfile);
+    hdr.box.min = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+    hdr.box.max = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for (int i = 0; i < o->nverts; i++) {
+        float *v = &o->verts[i * 3];
+        hdr.box.min = vec3(fminf(hdr.box.min.x, v[0]), fminf(hdr.box.min.y, v[1]),
+                fminf(hdr.box.min.z, v[2]));
+        hdr.box.max = vec3(fmaxf(hdr.box.max.x, v[0]), fmaxf(hdr.box.max.y, v[1]),
+                fmaxf(hdr.box.max.z, v[2]));
+    }
+    *box = hdr.box;
+    char path[1100], tmp[1120];
+    boundsfile(objfile, path, sizeof(path));
+    FILE *f = opentemp(path, tmp, sizeof(tmp));
+    if (!f) {
+        printf("lazy: can't write %s\n", path);
+        return;
+    }
+    int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    if (!closetemp(f, tmp, path, ok))
+        printf("lazy: failed to write %s\n", path);
+}
+
+MeshLazy *newlazy(Aabb box, unsigned key) {
+    MeshLazy *l = xcalloc(&_alloc, 1, sizeof(MeshLazy));
+    pthread_mutex_init(&l->lock, 0);
+    l->box = box;
+    l->key = key;
+    return l;
+}
+
+void freelazy(MeshLazy *l) {
+    pthread_mutex_destroy(&l->lock);
+    xfree(l);
+}
@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <raytracer/math.h>
+#include <raytracer/obj.h>
+#include <raytracer/raytracer.h>
+#include <raytracer/util.h>
+
+static Allocator _alloc = {"lighttree"};
+
+static int cmpaxis(const void *a, const void *b, int axis) {
+    float fa = axisof((*(Light **)a)->pos, axis);
+    float fb = axisof((*(Light **)b)->pos, axis);
+    return fa < fb ? -1 : fa > fb;
+}
+
+// one per axis, scenes can be built on several threads at once
+static int cmpx(const void *a, const void *b) { return cmpaxis(a, b, 0); }
+static int cmpy(const void *a, const void *b) { return cmpaxis(a, b, 1); }
+static int cmpz(const void *a, const void *b) { return cmpaxis(a, b, 2); }
+
+// Median split on the widest axis down to single light leaves.
+static int build(LightTree *t, Light **lights, int n) {
+    int idx = t->nnodes++;
+    LightNode *node = &t->nodes[idx];
+    node->min = node->max = lights[0]->pos;
+    node->intensity = 0;
+    for (int i = 0; i < n; i++) {
+        node->min = vmin(node->min, lights[i]->pos);
+        node->max = vmax(node->max, lights[i]->pos);
+        node->intensity += lights[i]->intensity;
+    }
+    if (n == 1) {
+        node->light = lights[0];
+        node->right = -1;
+        return idx;
+    }
+    Vec3 ext = vsub(node->max, node->min);
+    int axis = ext.x > ext.y ? (ext.x > ext.z ? 0 : 2) : (ext.y > ext.z ? 1 : 2);
+    int (*cmp[3])(const void *, const void *) = {cmpx, cmpy, cmpz};
+    qsort(lights, n, sizeof(Light *), cmp[axis]);
+    node->light = 0;
+    build(t, lights, n / 2);
+    node->right = build(t, lights + n / 2, n - n / 2);
+    return idx;
+}
+
+void buildlighttree(LightTree *t, Light **lights, int nlights) {
+    freelighttree(t);
+    if (!nlights) return;
+    t->nodes = xmalloc(&_alloc, (2 * nlights - 1) * sizeof(LightNode));
+    Light **sorted = xmalloc(&_alloc, nlights * sizeof(Light *));
+    memcpy(sorted, lights, nlights * sizeof(Light *));
+    build(t, sorted, nlights);
+    xfree(sorted);
+}
+
+void freelighttree(LightTree *t) {
+    xfree(t->nodes);
+    memset(t, 0, sizeof(LightTree));
+}
+
+static float boxdist(LightNode *n, Vec3 p) {
+    Vec3 c = vmax(n->min, vmin(p, n->max));
+    return vmag(vsub(c, p));
+}
+
+// Upper bound on what the lights under n can add at p. Shading is
+// intensity / dist scaled by a diffuse and a specular term, each <= 1.
+static float maxcontrib(LightNode *n, Vec3 p) {
+    float d = fmaxf(boxdist(n, p), 1e-4);
+    return 2 * n->intensity / d;
+}
+
+void lightiterinit(LightIter *it, LightTree *t, Vec3 p, float cutoff) {
+    it->tree = t;
+    it->p = p;
+    it->cutoff = cutoff;
+    it->sp = 0;
+    if (t->nnodes)
+        it->stack[it->sp++] = 0;
+}
+
+Light *lightiternext(LightIter *it) {
+    while (it->sp) {
+        int idx = it->stack[--it->sp];
+        LightNode *n = &it->tree->nodes[idx];
+        if (it->cutoff > 0 && maxcontrib(n, it->p) < it->cutoff)
+            continue;
+        if (n->light) return n->light;
+        it->stack[it->sp++] = n->right;
+        it->stack[it->sp++] = idx + 1;
+    }
+    return 0;
+}
+
+// Sampling weight of a subtree as seen from p. The distance is floored
+// at half the box diagonal so that p inside a big cluster doesn't make
+// the whole cluster look infinitely bright.
+static float importance(LightNode *n, Vec3 p) {
+    Vec3 c = vmul(vadd(n->min, n->max), 0.5);
+    float d = vmag(vsub(c, p));
+    float r = vmag(vsub(n->max, n->min)) / 2;
+    return n->intensity / fmaxf(fmaxf(d, r), 1e-4);
+}
+
+Light *samplelight(LightTree *t, Vec3 p, float u, float *pdf) {
+    *pdf = 0;
+    if (!t->nnodes) return 0;
+    int idx = 0;
+    float prob = 1;
+    while (!t->nodes[idx].light) {
+        LightNode *l = &t->nodes[idx + 1];
+        LightNode *r = &t->nodes[t->nodes[idx].right];
+        float il = importance(l, p);
+        float ir = importance(r, p);
+        float pl = il + ir > 0 ? il / (il + ir) : 0.5;
+        // reuse u for the next level by rescaling it into [0, 1)
+        if (u < pl || pl >= 1) {
+            u = fminf(u / pl, 0.99999994);
+            prob *= pl;
+            idx = idx + 1;
+        }
+        else {
+            u = (u - pl) / (1 - pl);
+            prob *= 1 - pl;
+            idx = t->nodes[idx].right;
+        }
+    }
+    *pdf = prob;
+    return t->nodes[idx].light;
+}
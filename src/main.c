@@ -1,186 +1,211 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <math.h>
-#include <float.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include <raytracer/math.h>
 #include <raytracer/obj.h>
 #include <raytracer/raytracer.h>
+#include <raytracer/render.h>
+#include <raytracer/estimate.h>
+#include <raytracer/batch.h>
 #include <raytracer/conf.h>
-
-#define PI 3.14159265358979323846
-#define MAX_RECUR 1
-
-#define RED (Color){255}
-#define GREEN (Color){0, 255}
-#define BLUE (Color){0, 0, 255}
-#define MAGENTA (Color){255, 0, 255}
-#define CYAN (Color){0, 255, 255}
-#define YELLOW (Color){255, 255, 0}
-
-typedef struct {
-    int width;
-    int height;
-    Color *pixels;
-} Bitmap;
-
-static void initbitmap(Bitmap *bmp, int w, int h) {
-    bmp->width = w;
-    bmp->height = h;
-    bmp->pixels = malloc(w * h * sizeof(Color));
+#include <raytracer/scene.h>
+#include <raytracer/watch.h>
+#include <raytracer/tracing.h>
+#include <raytracer/util.h>
+
+static unsigned filekey(const char *file) {
+    struct stat st;
+    if (stat(file, &st) != 0) return 0;
+    unsigned long long id[3] = {st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+    return hashbytes(id, sizeof(id));
 }
 
-static void freebitmap(Bitmap *bmp) {
-    free(bmp->pixels);
+// value of a numeric option, which has to be all number and at least min
+static double numarg(const char *opt, const char *val, double min) {
+    char *end;
+    double v = strtod(val, &end);
+    if (end == val || *end || !(v >= min))
+        err("%s needs a number of at least %g: %s", opt, min, val);
+    return v;
 }
 
-static void clear(Bitmap *bmp, Color c) {
-    for (int y = 0; y < bmp->height; y++)
-        for (int x = 0; x < bmp->width; x++)
-            bmp->pixels[y * bmp->width + x] = c;
+// numarg that has to be whole and fit an int
+static int intarg(const char *opt, const char *val, int min) {
+    double v = numarg(opt, val, min);
+    if (v > INT_MAX || v != (long long)v)
+        err("%s needs a whole number of at least %i: %s", opt, min, val);
+    return v;
 }
 
-static void output(Bitmap *bmp, const char *file) {
-    FILE *f = fopen(file, "w");
-    fprintf(f, "P6\n%i %i\n%i\n", bmp->width, bmp->height, 255);
-    for (int y = 0; y < bmp->height; y++) {
-        for (int x = 0; x < bmp->width; x++) {
-            Color c = bmp->pixels[y * bmp->width + x];
-            fwrite(&c, 3, 1, f);
-        }
+// Conf text is hashed, a compiled scene is large and identified by
+// size and mtime instead. The OBJ files of the meshes are mixed in the
+// same way, a mesh edited between runs invalidates the checkpoint.
+static unsigned confkey(const char *file, Scene *s) {
+    unsigned key;
+    if (isrtscene(file))
+        key = filekey(file);
+    else {
+        char *src = readfile(file);
+        key = hashbytes(src, strlen(src));
+        xfree(src);
     }
-    fclose(f);
-}
-
-static float clamp(float f, float min, float max) {
-    return f < min ? min : (f > max ? max : f);
-}
-
-static float torad(float deg) {
-    return deg * PI / 180.0;
-}
-
-static int testscene(Scene *s, Ray *r, Hit *h) {
-    Hit tmp;
-    float last_dist = FLT_MAX;
-    int success = 0;
     for (int i = 0; i < s->nshapes; i++) {
-        Shape *shape = s->shapes[i];
-        if (!testshape(shape, r, &tmp)) continue;
-        if (tmp.dist > last_dist) continue;
-        last_dist = tmp.dist;
-        *h = tmp;
-        success = 1;
+        if (s->shapes[i]->type != SHAPE_MESH) continue;
+        ShapeMesh *m = (ShapeMesh *)s->shapes[i];
+        if (!m->objfile) continue;
+        unsigned k[2] = {key, filekey(m->objfile)};
+        key = hashbytes(k, sizeof(k));
     }
-    return success;
+    return key;
 }
 
-static Vec3 vclamp(Vec3 v) {
-    return vec3(clamp(v.x, 0, 1), clamp(v.y, 0, 1), clamp(v.z, 0, 1));
+// <name>.conf becomes <name>.rtscene, anything else gets it appended
+static void compile(int argc, char **argv) {
+    for (int i = 0; i < argc; i++) {
+        char out[1024];
+        int n = strlen(argv[i]);
+        if (n > 5 && strcmp(argv[i] + n - 5, ".conf") == 0) n -= 5;
+        snprintf(out, sizeof(out), "%.*s.rtscene", n, argv[i]);
+        writertscene(argv[i], out);
+    }
 }
 
-static Vec3 xcast(Scene *s, Ray *r, int recur, Hit *xhit) {
-    xhit->dist = FLT_MAX;
-    Hit hit;
-    if (!testscene(s, r, &hit)) return s->background;
-    *xhit = hit;
-    Vec3 diffuse = hit.shape->mat.diffuse;
-    Vec3 specular = vec3(1.0, 1.0, 1.0);
-    Vec3 ambient = s->background;
-    Vec3 color = vec3(0.0, 0.0, 0.0);
-    Vec3 v = vsub(r->orig, hit.point);
-    Vec3 vr = vrefl(vsub(hit.point, r->orig), hit.norm);
+int main(int argc, char **argv) {
+    printf("Hello, World!\n");
+
+    if (argc > 1 && strcmp(argv[1], "compile") == 0) {
+        compile(argc - 2, argv + 2);
+        memreport(stdout);
+        return 0;
+    }
 
-    // lights
-    for (int k = 0; k < s->nlights; k++) {
-        Light *light = s->lights[k];
-        Vec3 l = vsub(light->pos, hit.point);
-        // occlusion
-        {
-            Ray ray = {hit.point, vnorm(l)};
-            ray.orig = vadd(ray.orig, vmul(ray.dir, 0.0001));
-            Hit lh;
-            if (testscene(s, &ray, &lh))
-                if (lh.dist < vmag(l))
-                    continue;
+    RenderOpts opts;
+    initrenderopts(&opts);
+    int stats = 0;
+    int watch = 0;
+    // probe first, then only print the estimate or also tune
+    int estimate = 0, tune = 0;
+    double budget = 0;
+    int settile = 0, setthreads = 0;
+    int batch = 0;
+    BatchOpts bo = {0};
+    int i = 1;
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+        if (strcmp(argv[i], "--resume") == 0)
+            opts.resume = 1;
+        else if (strcmp(argv[i], "--stats") == 0)
+            stats = 1;
+        else if (strcmp(argv[i], "--gbuffer") == 0 && i + 1 < argc)
+            opts.gbuffer = argv[++i];
+        else if (strcmp(argv[i], "--watch") == 0)
+            watch = 1;
+        else if (strcmp(argv[i], "--wavefront") == 0)
+            opts.wavefront = 1;
+        else if (strcmp(argv[i], "--tile-size") == 0 && i + 1 < argc) {
+            opts.tilesize = atoi(argv[++i]), settile = 1;
+            if (opts.tilesize < 1) err("--tile-size must be at least 1: %s", argv[i]);
         }
-        float attenuation = 1.0 / vmag(l);
-        float ilight = light->intensity * attenuation;
-        // diffuse
-        {
-            float idiffuse = vdot(vnorm(l), hit.norm);
-            idiffuse = clamp(idiffuse, 0.0, 1.0);
-            idiffuse *= ilight;
-            color = vadd(color, vmul(diffuse, idiffuse));
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            opts.nthreads = atoi(argv[++i]), setthreads = 1;
+            if (opts.nthreads < 0) err("--threads can't be negative: %s", argv[i]);
         }
-        // specular
-        {
-            Vec3 lr = vrefl(vsub(hit.point, light->pos), hit.norm);
-            float ispecular = vdot(vnorm(v), vnorm(lr));
-            ispecular = clamp(ispecular, 0.0, 1.0);
-            ispecular = pow(ispecular, 16);
-            ispecular *= ilight;
-            color = vadd(color, vmul(specular, ispecular));
+        else if (strcmp(argv[i], "--estimate") == 0)
+            estimate = 1;
+        else if (strcmp(argv[i], "--auto") == 0)
+            tune = 1;
+        else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc)
+            budget = atof(argv[++i]), tune = 1;
+        else if (strcmp(argv[i], "--numa") == 0)
+            opts.numa = 1;
+        else if (strcmp(argv[i], "--replicate") == 0)
+            opts.replicate = opts.numa = 1;
+        else if (strcmp(argv[i], "--batch") == 0)
+            batch = 1;
+        else if (strcmp(argv[i], "--batch-scenes") == 0 && i + 1 < argc)
+            bo.maxscenes = intarg("--batch-scenes", argv[++i], 1), batch = 1;
+        else if (strcmp(argv[i], "--batch-memory") == 0 && i + 1 < argc) {
+            double mb = numarg("--batch-memory", argv[++i], 0);
+            if (mb >= (double)ULONG_MAX / (1 << 20))
+                err("--batch-memory is too large: %s", argv[i]);
+            bo.memcap = mb * (1 << 20);
+            batch = 1;
         }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            starttracing(argv[++i]);
+        else if (strcmp(argv[i], "--checkpoint-interval") == 0 && i + 1 < argc)
+            opts.ckptinterval = numarg("--checkpoint-interval", argv[++i], 0);
+        else
+            err("unknown option: %s", argv[i]);
     }
 
-    // reflections
-    if (recur < MAX_RECUR) {
-        Ray ray = {hit.point, vnorm(vr)};
-        ray.orig = vadd(ray.orig, vmul(hit.norm, 0.0001));
-        Hit rhit;
-        Vec3 rc = xcast(s, &ray, recur + 1, &rhit);
-        float reflectiveness = hit.shape->mat.reflectiveness;
-        // float attenuation = 1.0 / rhit.dist;
-        // attenuation = clamp(attenuation, 0.0, 1.0);
-        // float irefl = attenuation * reflectiveness;
-        float irefl = reflectiveness;
-        color = vadd(color, vmul(rc, irefl));
-    }
-
-    return color;
-}
-
-static Color cast(Ray *r, Scene *s) {
-    Hit hit;
-    Vec3 fc = xcast(s, r, 0, &hit);
-    fc = vclamp(fc);
-    return (Color){255 * fc.x, 255 * fc.y, 255 * fc.z};
-}
+    // replayed hits are shaded depth first, there's no wavefront path
+    if (opts.gbuffer && opts.wavefront)
+        err("--wavefront can't be used with --gbuffer");
 
-static void renderscene(Bitmap *bmp, Scene *scene) {
-    float height = tan(torad(scene->vfov / 2)) * 2;
-    float width = height * scene->aspect;
-    for (int y = 0; y < bmp->height; y++) {
-        for (int x = 0; x < bmp->width; x++) {
-            int iy = bmp->height - y;
-            Ray ray = {
-                .orig = {0, 0, 0},
-                .dir = {
-                    (width * (x / (float)bmp->width)) - width / 2,
-                    (height * (iy / (float)bmp->height)) - height / 2,
-                    -1,
-                },
-            };
-            ray.dir = vnorm(ray.dir);
-            bmp->pixels[y * bmp->width + x] = cast(&ray, scene);
-        }
+    if (watch) {
+        if (argc - i != 1) err("--watch takes exactly one scene");
+        if (isrtscene(argv[i])) err("--watch needs the conf, not a compiled scene");
+        watchscene(argv[i], &opts);
     }
-}
 
-int main(int argc, char **argv) {
-    printf("Hello, World!\n");
+    // the checkpoint is keyed on the conf and tile size, a tuned tile
+    // size or light budget could resume pixels made with other settings
+    if (opts.resume && tune && (budget > 0 || !settile))
+        err("--resume can't take --budget, or --auto without --tile-size");
+
+    if (batch) {
+        if (opts.gbuffer || opts.resume || estimate || tune)
+            err("--batch renders without gbuffers, checkpoints or probing");
+        // all CPUs unless told otherwise, that's the point of a batch
+        if (!setthreads) opts.nthreads = 0;
+        bo.stats = stats;
+        int failed = renderbatch(argv + i, argc - i, &opts, &bo);
+        memreport(stdout);
+        return failed ? 1 : 0;
+    }
 
-    for (int i = 1; i < argc; i++) {
+    for (; i < argc; i++) {
+        tracebegin("load scene", argv[i]);
         Scene *s = newscene(argv[i]);
+        traceend();
+        if (!s) err("can't load %s", argv[i]);
+        char ckptfile[1024];
+        snprintf(ckptfile, sizeof(ckptfile), "%s.ckpt", s->output);
+        opts.ckptfile = ckptfile;
+        opts.ckptkey = confkey(argv[i], s);
         Bitmap bmp;
         initbitmap(&bmp, s->width, s->height);
-        clear(&bmp, (Color){0});
-        renderscene(&bmp, s);
+        // with --numa the render threads clear what they'll write
+        if (!opts.numa)
+            clear(&bmp, (Color){0});
+        RenderOpts o = opts;
+        if (estimate || tune) {
+            RenderEstimate est;
+            estimaterender(&bmp, s, &o, &est);
+            est.fixedtile = settile;
+            est.fixedthreads = setthreads;
+            tunerender(&bmp, s, &o, budget, &est);
+            printestimate(&est, stdout);
+            if (!settile) o.tilesize = est.tilesize;
+            if (!setthreads) o.nthreads = est.nthreads;
+            freeestimate(&est);
+        }
+        if (estimate) {
+            freebitmap(&bmp);
+            freescene(s);
+            continue;
+        }
+        RenderStats st;
+        renderscene(&bmp, s, &o, &st);
+        if (stats)
+            printstats(&st, stdout);
         output(&bmp, s->output);
         freebitmap(&bmp);
         freescene(s);
     }
 
+    memreport(stdout);
     return 0;
 }
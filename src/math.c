@@ -1,46 +1,6 @@
 #include <math.h>
 #include <raytracer/math.h>
 
-float vmag(Vec3 v) {
-    return sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
-}
-
-Vec3 vsub(Vec3 a, Vec3 b) {
-    return (Vec3){a.x - b.x, a.y - b.y, a.z - b.z};
-}
-
-Vec3 vadd(Vec3 a, Vec3 b) {
-    return (Vec3){a.x + b.x, a.y + b.y, a.z + b.z};
-}
-
-Vec3 vmul(Vec3 v, float f) {
-    return (Vec3){v.x * f, v.y * f, v.z * f};
-}
-
-Vec3 vnorm(Vec3 v) {
-    return vmul(v, 1 / vmag(v));
-}
-
-float vdot(Vec3 a, Vec3 b) {
-    return a.x * b.x + a.y * b.y + a.z * b.z;
-}
-
-Vec3 vproj(Vec3 a, Vec3 b) {
-    return vmul(b, vdot(a, b) / (vmag(b) * vmag(b)));
-}
-
-// V has to point towards the intersection point
-Vec3 vrefl(Vec3 v, Vec3 n) {
-    return vsub(v, vmul(n, 2 * vdot(v, n)));
-}
-
-Vec3 vcross(Vec3 a, Vec3 b) {
-    return (Vec3){
-        a.y * b.z - a.z * b.y,
-        a.z * b.x - a.x * b.z,
-        a.x * b.y - a.y * b.x};
-}
-
 void matrixinit(Matrix *m) {
     m->rows[0] = vec4(1, 0, 0, 0);
     m->rows[1] = vec4(0, 1, 0, 0);
@@ -52,12 +12,19 @@ static float v4dot(Vec4 a, Vec4 b) {
     return a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w;
 }
 
-Vec3 matrixmul(Matrix *m, Vec3 v) {
-    Vec4 v4 = vec4(v.x, v.y, v.z, 1);
-    float x = v4dot(m->rows[0], v4);
-    float y = v4dot(m->rows[1], v4);
-    float z = v4dot(m->rows[2], v4);
-    return vec3(x, y, z);
+// Transforms n packed xyz points. Each point becomes one column-major
+// multiply-add chain over V4 lanes instead of three scalar dot products.
+void matrixmulv(Matrix *m, const float *in, Vec3 *out, int n) {
+    Vec4 *r = m->rows;
+    V4 c0 = {r[0].x, r[1].x, r[2].x, 0};
+    V4 c1 = {r[0].y, r[1].y, r[2].y, 0};
+    V4 c2 = {r[0].z, r[1].z, r[2].z, 0};
+    V4 c3 = {r[0].w, r[1].w, r[2].w, 0};
+    for (int i = 0; i < n; i++) {
+        const float *p = &in[i * 3];
+        V4 v = c0 * p[0] + c1 * p[1] + c2 * p[2] + c3;
+        out[i] = vec3(v[0], v[1], v[2]);
+    }
 }
 
 void matrixtranslate(Matrix *m, Vec3 trans) {
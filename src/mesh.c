@@ -0,0 +1,624 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <raytracer/math.h>
+#include <raytracer/obj.h>
+#include <raytracer/raytracer.h>
+#include <raytracer/util.h>
+#include <raytracer/stream.h>
+#include <raytracer/lazy.h>
+#include <raytracer/tracing.h>
+
+#define LEAF_TRIS 4
+#define STACK_SIZE 64
+
+static Allocator _alloc = {"mesh"};
+
+static Vec3 tri_normal(Tri *tri) {
+    Vec3 ab = vsub(tri->b, tri->a);
+    Vec3 ac = vsub(tri->c, tri->a);
+    return vnorm(vcross(ab, ac));
+}
+
+// Moller-Trumbore, u and v are the weights of b and c at the hit.
+// Only front faces at or ahead of the origin count.
+static int tri_intersect(Ray *r, Tri *tri,
+        float *idist, float *u, float *v) {
+    Vec3 ab = vsub(tri->b, tri->a);
+    Vec3 ac = vsub(tri->c, tri->a);
+    Vec3 p = vcross(r->dir, ac);
+    float det = vdot(ab, p);
+    if (det <= 0) return 0;
+    Vec3 ao = vsub(r->orig, tri->a);
+    float bu = vdot(ao, p);
+    if (bu < 0 || bu > det) return 0;
+    Vec3 q = vcross(ao, ab);
+    float bv = vdot(r->dir, q);
+    if (bv < 0 || bu + bv > det) return 0;
+    float t = vdot(ac, q);
+    if (t < 0) return 0;
+    float inv = 1 / det;
+    *idist = t * inv;
+    *u = bu * inv;
+    *v = bv * inv;
+    return 1;
+}
+
+static float max(float a, float b) {
+    return a > b ? a : b;
+}
+
+// bvh build
+
+typedef struct {
+    Vec3 *verts;
+    int *tris;
+    Vec3 *cents;
+    int *order;
+    BvhNode *nodes;
+    int nnodes;
+    int leafsize;
+    float pad;
+} Builder;
+
+// per thread, clusters of streamed meshes get built while rendering
+static __thread int _sortaxis;
+static __thread Vec3 *_sortcents;
+
+static int cmpcents(const void *a, const void *b) {
+    float fa = axisof(_sortcents[*(int *)a], _sortaxis);
+    float fb = axisof(_sortcents[*(int *)b], _sortaxis);
+    return fa < fb ? -1 : fa > fb;
+}
+
+// Median split on the widest centroid axis. Boxes are padded a little
+// so that hit points the triangle test rounds outwards stay inside.
+static void build(Builder *b, int start, int n) {
+    int idx = b->nnodes++;
+    BvhNode *node = &b->nodes[idx];
+    Vec3 min = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+    Vec3 max = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    Vec3 cmin = min, cmax = max;
+    for (int i = start; i < start + n; i++) {
+        int *t = &b->tris[b->order[i] * 3];
+        for (int k = 0; k < 3; k++) {
+            min = vmin(min, b->verts[t[k]]);
+            max = vmax(max, b->verts[t[k]]);
+        }
+        cmin = vmin(cmin, b->cents[b->order[i]]);
+        cmax = vmax(cmax, b->cents[b->order[i]]);
+    }
+    Vec3 pad = vec3(b->pad, b->pad, b->pad);
+    node->min = vsub(min, pad);
+    node->max = vadd(max, pad);
+    if (n <= b->leafsize) {
+        node->index = start;
+        node->count = n;
+        return;
+    }
+    Vec3 ext = vsub(cmax, cmin);
+    _sortaxis = ext.x > ext.y ? (ext.x > ext.z ? 0 : 2) : (ext.y > ext.z ? 1 : 2);
+    _sortcents = b->cents;
+    qsort(&b->order[start], n, sizeof(int), cmpcents);
+    node->count = 0;
+    build(b, start, n / 2);
+    node->index = b->nnodes;
+    build(b, start + n / 2, n - n / 2);
+}
+
+BvhNode *buildbvh(Vec3 *verts, int *tris, int *attrs, int ntris, int leafsize, int *nnodes) {
+    tracebegin("build bvh", 0);
+    Builder b = {0};
+    b.leafsize = leafsize;
+    b.verts = verts;
+    b.tris = tris;
+    b.cents = xmalloc(&_alloc, ntris * sizeof(Vec3));
+    b.order = xmalloc(&_alloc, ntris * sizeof(int));
+    b.nodes = xmalloc(&_alloc, (2 * ntris + 1) * sizeof(BvhNode));
+    Vec3 min = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+    Vec3 max = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for (int i = 0; i < ntris; i++) {
+        Vec3 a = verts[tris[i * 3]], bb = verts[tris[i * 3 + 1]], c = verts[tris[i * 3 + 2]];
+        b.cents[i] = vmul(vadd(vadd(a, bb), c), 1.0 / 3);
+        b.order[i] = i;
+        min = vmin(min, vmin(a, vmin(bb, c)));
+        max = vmax(max, vmax(a, vmax(bb, c)));
+    }
+    b.pad = ntris ? vmag(vsub(max, min)) * 1e-5 + 1e-6 : 0;
+    if (ntris)
+        build(&b, 0, ntris);
+    int *sorted = xmalloc(&_alloc, ntris * 3 * sizeof(int));
+    for (int i = 0; i < ntris; i++)
+        memcpy(&sorted[i * 3], &tris[b.order[i] * 3], 3 * sizeof(int));
+    memcpy(tris, sorted, ntris * 3 * sizeof(int));
+    if (attrs) {
+        for (int i = 0; i < ntris; i++)
+            memcpy(&sorted[i * 3], &attrs[b.order[i] * 3], 3 * sizeof(int));
+        memcpy(attrs, sorted, ntris * 3 * sizeof(int));
+    }
+    xfree(sorted);
+    xfree(b.cents);
+    xfree(b.order);
+    *nnodes = b.nnodes;
+    traceend();
+    return xrealloc(&_alloc, b.nodes, (b.nnodes ? b.nnodes : 1) * sizeof(BvhNode));
+}
+
+// world box around the transformed corners of box
+Aabb transformbox(Matrix *m, Aabb box) {
+    Aabb out = {vec3(FLT_MAX, FLT_MAX, FLT_MAX), vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX)};
+    for (int k = 0; k < 8; k++) {
+        Vec3 corner = vec3(k & 1 ? box.max.x : box.min.x,
+                k & 2 ? box.max.y : box.min.y,
+                k & 4 ? box.max.z : box.min.z);
+        Vec3 p = matrixmul(m, corner);
+        out.min = vmin(out.min, p);
+        out.max = vmax(out.max, p);
+    }
+    return out;
+}
+
+static void boxbounds(ShapeMesh *m, Aabb box) {
+    setsphere(m->bounds, vmul(vadd(box.min, box.max), 0.5), vmag(vsub(box.max, box.min)) / 2);
+}
+
+// Normals go through the cofactor matrix of the linear part, which is
+// the inverse transpose up to a factor of the determinant, so non
+// uniform scales keep them perpendicular.
+static void updatenorms(ShapeMesh *m) {
+    Obj *o = m->obj;
+    if (!m->smooth || !o->nnorms) {
+        xfree(m->xnorms);
+        m->xnorms = 0;
+        return;
+    }
+    Vec4 *r = m->shape.transform.rows;
+    Vec3 c0 = vec3(r[0].x, r[1].x, r[2].x);
+    Vec3 c1 = vec3(r[0].y, r[1].y, r[2].y);
+    Vec3 c2 = vec3(r[0].z, r[1].z, r[2].z);
+    Vec3 k0 = vcross(c1, c2), k1 = vcross(c2, c0), k2 = vcross(c0, c1);
+    float sign = vdot(c0, k0) < 0 ? -1 : 1;
+    m->xnorms = xrealloc(&_alloc, m->xnorms, o->nnorms * sizeof(Vec3));
+    for (int i = 0; i < o->nnorms; i++) {
+        float *n = &o->norms[i * 3];
+        Vec3 x = vadd(vadd(vmul(k0, n[0]), vmul(k1, n[1])), vmul(k2, n[2]));
+        m->xnorms[i] = vmul(x, sign);
+    }
+}
+
+static void updateverts(ShapeMesh *m) {
+    Obj *o = m->obj;
+    m->xverts = xrealloc(&_alloc, m->xverts, o->nverts * sizeof(Vec3));
+    matrixmulv(&m->shape.transform, o->verts, m->xverts, o->nverts);
+    updatenorms(m);
+    xfree(m->nodes);
+    m->nodes = buildbvh(m->xverts, o->tris, o->normidx, o->ntris, LEAF_TRIS, &m->nnodes);
+}
+
+// Caches the world space vertices, the bounding sphere and the BVH.
+// Has to run whenever the transform changes.
+void updatemesh(ShapeMesh *m) {
+    if (m->q) err("mesh: can't transform a compacted mesh");
+    if (m->stream) {
+        MeshStream *ms = m->stream;
+        transformmeshstream(ms, &m->shape.transform);
+        if (ms->nnodes)
+            boxbounds(m, (Aabb){ms->nodes[0].min, ms->nodes[0].max});
+        return;
+    }
+    if (m->lazy) {
+        // the bounds stay those of the header even once loaded, they are
+        // read by threads that don't take the lock
+        boxbounds(m, transformbox(&m->shape.transform, m->lazy->box));
+        if (m->obj)
+            updateverts(m);
+        return;
+    }
+    updateverts(m);
+    Obj *o = m->obj;
+    Vec3 center = matrixmul(&m->shape.transform, (Vec3){0, 0, 0});
+    float radius = 0.0;
+    for (int i = 0; i < o->nverts; i++)
+        radius = max(radius, vmag(vsub(m->xverts[i], center)));
+    setsphere(m->bounds, center, radius);
+}
+
+// Other threads that hit the same mesh wait here, everything else
+// carries on.
+void loadlazymesh(ShapeMesh *m) {
+    MeshLazy *l = m->lazy;
+    pthread_mutex_lock(&l->lock);
+    if (!l->loaded) {
+        // shared like any other mesh, a batch loads each OBJ once
+        m->obj = shareobj(m->objfile, 0);
+        if (!m->obj)
+            printf("mesh: can't load %s, it stays empty\n", m->objfile);
+        else {
+            updateverts(m);
+            if (l->compact)
+                compactmesh(m);
+        }
+        __atomic_store_n(&l->loaded, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&l->lock);
+}
+
+// bvh traversal
+
+static Vec3 invdir(Vec3 d) {
+    return vec3(1 / d.x, 1 / d.y, 1 / d.z);
+}
+
+static int boxhit(Vec3 min, Vec3 max, Ray *r, Vec3 inv, float tmax) {
+    float tx0 = (min.x - r->orig.x) * inv.x, tx1 = (max.x - r->orig.x) * inv.x;
+    float ty0 = (min.y - r->orig.y) * inv.y, ty1 = (max.y - r->orig.y) * inv.y;
+    float tz0 = (min.z - r->orig.z) * inv.z, tz1 = (max.z - r->orig.z) * inv.z;
+    float tnear = fmaxf(fmaxf(fminf(tx0, tx1), fminf(ty0, ty1)), fminf(tz0, tz1));
+    float tfar = fminf(fminf(fmaxf(tx0, tx1), fmaxf(ty0, ty1)), fmaxf(tz0, tz1));
+    return tfar >= fmaxf(tnear, 0) && tnear <= tmax;
+}
+
+static int testtri(Shape *s, Ray *r, Tri *tri, int prim, float *last_dist, Hit *h) {
+    float idist, u, v;
+    if (!tri_intersect(r, tri, &idist, &u, &v)) return 0;
+    if (idist > *last_dist) return 0;
+    *last_dist = idist;
+    h->shape = s;
+    h->dist = idist;
+    h->prim = prim;
+    h->u = u;
+    h->v = v;
+    return 1;
+}
+
+// Closest hit among the triangles under nodes, closer than *last_dist.
+// Hits get the triangle index plus primbase as their prim.
+static int testnodes(Shape *s, BvhNode *nodes, int nnodes, Vec3 *verts, int *tris,
+        int primbase, Ray *r, Vec3 inv, float *last_dist, Hit *h) {
+    int success = 0;
+    int stack[STACK_SIZE];
+    int sp = 0;
+    if (nnodes)
+        stack[sp++] = 0;
+    while (sp) {
+        int idx = stack[--sp];
+        BvhNode *node = &nodes[idx];
+        if (!boxhit(node->min, node->max, r, inv, *last_dist)) continue;
+        if (!node->count) {
+            stack[sp++] = node->index;
+            stack[sp++] = idx + 1;
+            continue;
+        }
+        for (int i = node->index; i < node->index + node->count; i++) {
+            Tri tri = {verts[tris[i * 3 + 0]], verts[tris[i * 3 + 1]], verts[tris[i * 3 + 2]]};
+            success |= testtri(s, r, &tri, i + primbase, last_dist, h);
+        }
+    }
+    return success;
+}
+
+// Same walk over the cluster tree, leaves are tested against their
+// cluster, which gets paged in for it.
+static int teststream(ShapeMesh *m, Ray *r, Hit *h) {
+    MeshStream *ms = m->stream;
+    float last_dist = FLT_MAX;
+    int success = 0;
+    Vec3 inv = invdir(r->dir);
+    int stack[STACK_SIZE];
+    int sp = 0;
+    if (ms->nnodes)
+        stack[sp++] = 0;
+    while (sp) {
+        int idx = stack[--sp];
+        BvhNode *node = &ms->nodes[idx];
+        if (!boxhit(node->min, node->max, r, inv, last_dist)) continue;
+        if (!node->count) {
+            stack[sp++] = node->index;
+            stack[sp++] = idx + 1;
+            continue;
+        }
+        Cluster *c = acquirecluster(ms, node->index);
+        if (!c) continue;
+        success |= testnodes(AS_SHAPE(m), c->nodes, c->nnodes, c->verts, c->tris,
+                node->index * CLUSTER_TRIS, r, inv, &last_dist, h);
+        releasecluster(c);
+    }
+    return success;
+}
+
+static int testcompact(ShapeMesh *m, Ray *r, Hit *h);
+
+int testmesh(Shape *s, Ray *r, Hit *h) {
+    ShapeMesh *m = (ShapeMesh *)s;
+    Hit hit;
+    if (!testshape(AS_SHAPE(m->bounds), r, &hit)) return 0;
+    if (m->lazy && !lazyloaded(m->lazy))
+        loadlazymesh(m);
+    if (m->q) return testcompact(m, r, h);
+    if (m->stream) return teststream(m, r, h);
+    // a lazy OBJ that failed to load
+    if (!m->obj) return 0;
+    float last_dist = FLT_MAX;
+    return testnodes(s, m->nodes, m->nnodes, m->xverts, m->obj->tris,
+            0, r, invdir(r->dir), &last_dist, h);
+}
+
+// compact meshes
+//
+// Vertices are stored as 16 bit offsets into the mesh bounds and
+// indices as 16 bit when there are few enough vertices. BVH nodes keep
+// their box as 8 bit offsets into the parent's box, rounded outwards,
+// so a box decoded during traversal always contains what it should.
+
+static float deq8(unsigned char q, float lo, float hi) {
+    return q == 255 ? hi : lo + q * ((hi - lo) / 255);
+}
+
+static unsigned char qlo(float v, float lo, float hi) {
+    int q = hi > lo ? floorf((v - lo) / (hi - lo) * 255) : 0;
+    q = q < 0 ? 0 : (q > 255 ? 255 : q);
+    while (q > 0 && deq8(q, lo, hi) > v) q--;
+    return q;
+}
+
+static unsigned char qhi(float v, float lo, float hi) {
+    int q = hi > lo ? ceilf((v - lo) / (hi - lo) * 255) : 255;
+    q = q < 0 ? 0 : (q > 255 ? 255 : q);
+    while (q < 255 && deq8(q, lo, hi) < v) q++;
+    return q;
+}
+
+static Aabb qbox(QNode *n, Aabb *parent) {
+    Aabb b;
+    b.min.x = deq8(n->qmin[0], parent->min.x, parent->max.x);
+    b.min.y = deq8(n->qmin[1], parent->min.y, parent->max.y);
+    b.min.z = deq8(n->qmin[2], parent->min.z, parent->max.z);
+    b.max.x = deq8(n->qmax[0], parent->min.x, parent->max.x);
+    b.max.y = deq8(n->qmax[1], parent->min.y, parent->max.y);
+    b.max.z = deq8(n->qmax[2], parent->min.z, parent->max.z);
+    return b;
+}
+
+static void quantnode(QNode *q, BvhNode *n, Aabb *parent) {
+    q->qmin[0] = qlo(n->min.x, parent->min.x, parent->max.x);
+    q->qmin[1] = qlo(n->min.y, parent->min.y, parent->max.y);
+    q->qmin[2] = qlo(n->min.z, parent->min.z, parent->max.z);
+    q->qmax[0] = qhi(n->max.x, parent->min.x, parent->max.x);
+    q->qmax[1] = qhi(n->max.y, parent->min.y, parent->max.y);
+    q->qmax[2] = qhi(n->max.z, parent->min.z, parent->max.z);
+    q->count = n->count;
+    q->index = n->index;
+}
+
+static void quanttree(MeshQ *mq, BvhNode *nodes, int idx, Aabb *parent) {
+    QNode *q = &mq->nodes[idx];
+    quantnode(q, &nodes[idx], parent);
+    if (q->count) return;
+    Aabb box = qbox(q, parent);
+    quanttree(mq, nodes, idx + 1, &box);
+    quanttree(mq, nodes, q->index, &box);
+}
+
+static Vec3 qvert(MeshQ *mq, int i) {
+    unsigned short *v = &mq->verts[i * 3];
+    return vec3(mq->min.x + v[0] * mq->step.x,
+            mq->min.y + v[1] * mq->step.y,
+            mq->min.z + v[2] * mq->step.z);
+}
+
+static int qindex(MeshQ *mq, int i) {
+    return mq->tris16 ? mq->tris16[i] : mq->tris32[i];
+}
+
+static CompactStats _compact;
+
+static unsigned long meshbytes(ShapeMesh *m) {
+    if (m->q) {
+        MeshQ *q = m->q;
+        return sizeof(MeshQ) + q->nverts * 3 * sizeof(short)
+                + q->ntris * 3 * (q->tris16 ? sizeof(short) : sizeof(int))
+                + q->nnodes * sizeof(QNode);
+    }
+    Obj *o = m->obj;
+    return o->nverts * 3 * sizeof(float) + o->ntris * 3 * sizeof(int)
+            + o->nverts * sizeof(Vec3) + m->nnodes * sizeof(BvhNode);
+}
+
+void compactmesh(ShapeMesh *m) {
+    if (m->q) return;
+    if (m->stream) err("mesh: %s is streamed, it can't also be compacted", m->objfile);
+    Obj *o = m->obj;
+    unsigned long before = meshbytes(m);
+    MeshQ *mq = xcalloc(&_alloc, 1, sizeof(MeshQ));
+    mq->nverts = o->nverts;
+    mq->ntris = o->ntris;
+    // vertices, 16 bit within the bounds
+    Vec3 min = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+    Vec3 max = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for (int i = 0; i < o->nverts; i++) {
+        min = vmin(min, m->xverts[i]);
+        max = vmax(max, m->xverts[i]);
+    }
+    mq->min = min;
+    mq->step = vmul(vsub(max, min), 1.0 / 65535);
+    mq->verts = xmalloc(&_alloc, o->nverts * 3 * sizeof(short));
+    for (int i = 0; i < o->nverts; i++) {
+        Vec3 v = m->xverts[i];
+        for (int k = 0; k < 3; k++) {
+            float lo = axisof(min, k), step = axisof(mq->step, k);
+            float f = step > 0 ? (axisof(v, k) - lo) / step : 0;
+            mq->verts[i * 3 + k] = f < 0 ? 0 : (f > 65535 ? 65535 : lrintf(f));
+        }
+    }
+    // the BVH is built over the decoded vertices, so its boxes hold the
+    // triangles that are actually tested
+    Vec3 *dverts = xmalloc(&_alloc, o->nverts * sizeof(Vec3));
+    for (int i = 0; i < o->nverts; i++)
+        dverts[i] = qvert(mq, i);
+    int nnodes;
+    BvhNode *nodes = buildbvh(dverts, o->tris, 0, o->ntris, LEAF_TRIS, &nnodes);
+    xfree(dverts);
+    mq->nnodes = nnodes;
+    mq->nodes = xmalloc(&_alloc, (nnodes ? nnodes : 1) * sizeof(QNode));
+    if (nnodes) {
+        mq->root = (Aabb){nodes[0].min, nodes[0].max};
+        quanttree(mq, nodes, 0, &mq->root);
+    }
+    xfree(nodes);
+    if (o->nverts <= 65536) {
+        mq->tris16 = xmalloc(&_alloc, o->ntris * 3 * sizeof(short));
+        for (int i = 0; i < o->ntris * 3; i++)
+            mq->tris16[i] = o->tris[i];
+    }
+    else {
+        mq->tris32 = xmalloc(&_alloc, o->ntris * 3 * sizeof(int));
+        memcpy(mq->tris32, o->tris, o->ntris * 3 * sizeof(int));
+    }
+    freeobj(m->obj);
+    m->obj = 0;
+    xfree(m->xverts);
+    m->xverts = 0;
+    xfree(m->xnorms);
+    m->xnorms = 0;
+    xfree(m->nodes);
+    m->nodes = 0;
+    m->nnodes = 0;
+    m->q = mq;
+    // reported by --stats; lazy meshes compact on render threads, so
+    // nothing is printed here
+    __atomic_add_fetch(&_compact.meshes, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_compact.before, before, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_compact.after, meshbytes(m), __ATOMIC_RELAXED);
+}
+
+void compactstats(CompactStats *st) {
+    st->meshes = __atomic_load_n(&_compact.meshes, __ATOMIC_RELAXED);
+    st->before = __atomic_load_n(&_compact.before, __ATOMIC_RELAXED);
+    st->after = __atomic_load_n(&_compact.after, __ATOMIC_RELAXED);
+}
+
+static int testcompact(ShapeMesh *m, Ray *r, Hit *h) {
+    MeshQ *mq = m->q;
+    float last_dist = FLT_MAX;
+    int success = 0;
+    Vec3 inv = invdir(r->dir);
+    struct {
+        int idx;
+        Aabb box;
+    } stack[STACK_SIZE];
+    int sp = 0;
+    if (mq->nnodes)
+        stack[sp++].idx = 0, stack[0].box = mq->root;
+    while (sp) {
+        sp--;
+        int idx = stack[sp].idx;
+        Aabb box = stack[sp].box;
+        QNode *node = &mq->nodes[idx];
+        if (!boxhit(box.min, box.max, r, inv, last_dist)) continue;
+        if (!node->count) {
+            stack[sp].idx = node->index;
+            stack[sp++].box = qbox(&mq->nodes[node->index], &box);
+            stack[sp].idx = idx + 1;
+            stack[sp++].box = qbox(&mq->nodes[idx + 1], &box);
+            continue;
+        }
+        for (int i = node->index; i < node->index + node->count; i++) {
+            Tri tri = {
+                qvert(mq, qindex(mq, i * 3 + 0)),
+                qvert(mq, qindex(mq, i * 3 + 1)),
+                qvert(mq, qindex(mq, i * 3 + 2)),
+            };
+            success |= testtri(AS_SHAPE(m), r, &tri, i, &last_dist, h);
+        }
+    }
+    return success;
+}
+
+// Looks the kept triangle up again, only the winner of a query pays for
+// its normal.
+void finalizemesh(Shape *s, Ray *r, Hit *h) {
+    ShapeMesh *m = (ShapeMesh *)s;
+    Tri tri;
+    if (m->q) {
+        MeshQ *mq = m->q;
+        tri = (Tri){
+            qvert(mq, qindex(mq, h->prim * 3 + 0)),
+            qvert(mq, qindex(mq, h->prim * 3 + 1)),
+            qvert(mq, qindex(mq, h->prim * 3 + 2)),
+        };
+    }
+    else if (m->stream) {
+        Cluster *c = acquirecluster(m->stream, h->prim / CLUSTER_TRIS);
+        // evicted since the hit and unreadable now, face the ray
+        if (!c) {
+            h->norm = vmul(r->dir, -1);
+            return;
+        }
+        int *t = &c->tris[h->prim % CLUSTER_TRIS * 3];
+        tri = (Tri){c->verts[t[0]], c->verts[t[1]], c->verts[t[2]]};
+        releasecluster(c);
+    }
+    else {
+        int *t = &m->obj->tris[h->prim * 3];
+        tri = (Tri){m->xverts[t[0]], m->xverts[t[1]], m->xverts[t[2]]};
+    }
+    h->norm = tri_normal(&tri);
+    if (!m->xnorms) return;
+    int *n = &m->obj->normidx[h->prim * 3];
+    if (n[0] < 0 || n[1] < 0 || n[2] < 0) return;
+    float w = 1 - h->u - h->v;
+    h->norm = vnorm(vadd(vadd(vmul(m->xnorms[n[0]], w),
+            vmul(m->xnorms[n[1]], h->u)), vmul(m->xnorms[n[2]], h->v)));
+}
+
+static void *dup(void *src, unsigned size) {
+    void *dst = xmalloc(&_alloc, size ? size : 1);
+    memcpy(dst, src, size);
+    return dst;
+}
+
+ShapeMesh *replicatemesh(ShapeMesh *m) {
+    if (!m->obj || m->lazy || m->stream || m->q) return 0;
+    Obj *o = m->obj;
+    ShapeMesh *r = dup(m, sizeof(ShapeMesh));
+    r->obj = dup(o, sizeof(Obj));
+    r->obj->tris = dup(o->tris, o->ntris * 3 * sizeof(int));
+    r->obj->normidx = dup(o->normidx, o->ntris * 3 * sizeof(int));
+    r->xverts = dup(m->xverts, o->nverts * sizeof(Vec3));
+    r->nodes = dup(m->nodes, m->nnodes * sizeof(BvhNode));
+    if (m->xnorms)
+        r->xnorms = dup(m->xnorms, o->nnorms * sizeof(Vec3));
+    r->bounds = newsphere(m->bounds->center, m->bounds->radius);
+    return r;
+}
+
+void freereplica(ShapeMesh *r) {
+    freeshape(AS_SHAPE(r->bounds));
+    xfree(r->obj->tris);
+    xfree(r->obj->normidx);
+    xfree(r->obj);
+    xfree(r->xverts);
+    xfree(r->nodes);
+    xfree(r->xnorms);
+    xfree(r);
+}
+
+void freemesh(ShapeMesh *m) {
+    freeshape(AS_SHAPE(m->bounds));
+    if (m->obj) freeobj(m->obj);
+    if (m->stream) freemeshstream(m->stream);
+    if (m->lazy) freelazy(m->lazy);
+    xfree(m->objfile);
+    xfree(m->xverts);
+    xfree(m->xnorms);
+    xfree(m->nodes);
+    if (m->q) {
+        xfree(m->q->verts);
+        xfree(m->q->tris16);
+        xfree(m->q->tris32);
+        xfree(m->q->nodes);
+        xfree(m->q);
+    }
+}
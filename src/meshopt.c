@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <limits.h>
+#include <pthread.h>
+#include <raytracer/math.h>
+#include <raytracer/obj.h>
+#include <raytracer/raytracer.h>
+#include <raytracer/lazy.h>
+#include <raytracer/util.h>
+#include <raytracer/tracing.h>
+
+#define OPT_MAGIC "RTOB"
+#define OPT_VERSION 2
+#define OPT_EXT ".rtobj"
+
+static Allocator _alloc = {"meshopt"};
+
+typedef struct {
+    char magic[4];
+    unsigned version;
+    // lazykey of the OBJ it was built from
+    unsigned key;
+    int cells;
+    int nverts, ntris, nnorms;
+} OptHdr;
+
+typedef struct {
+    unsigned code;
+    int tri;
+} TriKey;
+
+// One OBJ as loaded by shareobj. refs counts borrowers and threads
+// waiting on the load, the entry goes with the last of them. An OBJ
+// that changed on disk gets a new entry, old borrowers keep the old.
+typedef struct Shared {
+    struct Shared *next;
+    char *file;
+    int cells;
+    unsigned key;
+    int loading;
+    Obj *obj;
+    int refs;
+} Shared;
+
+static OptStats _stats;
+static Shared *_shared;
+static pthread_mutex_t _sharelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _shareload = PTHREAD_COND_INITIALIZER;
+
+static Vec3 vertof(Obj *o, int i) {
+    return vec3(o->verts[i * 3], o->verts[i * 3 + 1], o->verts[i * 3 + 2]);
+}
+
+// Maps each vertex to the first one with the same position. Adding 0
+// folds -0 into 0 so both hash alike.
+static int weld(Obj *o, int *remap) {
+    int size = 1;
+    while (size < o->nverts * 2)
+        size <<= 1;
+    int *table = xmalloc(&_alloc, size * sizeof(int));
+    memset(table, -1, size * sizeof(int));
+    int welded = 0;
+    for (int i = 0; i < o->nverts; i++) {
+        float *v = &o->verts[i * 3];
+        float p[3] = {v[0] + 0.0f, v[1] + 0.0f, v[2] + 0.0f};
+        unsigned h = hashbytes(p, sizeof(p)) & (size - 1);
+        while (table[h] >= 0 && memcmp(&o->verts[table[h] * 3], p, sizeof(p)) != 0)
+            h = (h + 1) & (size - 1);
+        if (table[h] < 0) {
+            memcpy(v, p, sizeof(p));
+            table[h] = i;
+            remap[i] = i;
+        }
+        else {
+            remap[i] = table[h];
+            welded++;
+        }
+    }
+    xfree(table);
+    return welded;
+}
+
+static int cmptrikey(const void *a, const void *b) {
+    const TriKey *ka = a, *kb = b;
+    if (ka->code != kb->code) return ka->code < kb->code ? -1 : 1;
+    return ka->tri - kb->tri;
+}
+
+void optimizeobj(Obj *o) {
+    int *remap = xmalloc(&_alloc, (o->nverts ? o->nverts : 1) * sizeof(int));
+    int welded = weld(o, remap);
+
+    // welded tris, minus those with no area; tri_intersect divides by it
+    TriKey *keys = xmalloc(&_alloc, (o->ntris ? o->ntris : 1) * sizeof(TriKey));
+    Vec3 *cents = xmalloc(&_alloc, (o->ntris ? o->ntris : 1) * sizeof(Vec3));
+    Vec3 lo = vec3(FLT_MAX, FLT_MAX, FLT_MAX), hi = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    int nkeep = 0;
+    for (int i = 0; i < o->ntris; i++) {
+        int *t = &o->tris[i * 3];
+        for (int k = 0; k < 3; k++)
+            t[k] = remap[t[k]];
+        Vec3 a = vertof(o, t[0]), b = vertof(o, t[1]), c = vertof(o, t[2]);
+        if (vmag(vcross(vsub(b, a), vsub(c, a))) == 0) continue;
+        Vec3 cent = vmul(vadd(vadd(a, b), c), 1.0 / 3);
+        lo = vec3(fminf(lo.x, cent.x), fminf(lo.y, cent.y), fminf(lo.z, cent.z));
+        hi = vec3(fmaxf(hi.x, cent.x), fmaxf(hi.y, cent.y), fmaxf(hi.z, cent.z));
+        cents[nkeep] = cent;
+        keys[nkeep++].tri = i;
+    }
+    int dropped = o->ntris - nkeep;
+
+    // Morton order of the centroids, ties keep file order
+    for (int i = 0; i < nkeep; i++)
+        keys[i].code = morton(cents[i], lo, hi);
+    qsort(keys, nkeep, sizeof(TriKey), cmptrikey);
+
+    // vertices follow in the order the sorted tris first use them,
+    // anything left unused is dropped
+    int *tris = xmalloc(&_alloc, (nkeep ? nkeep : 1) * 3 * sizeof(int));
+    int *normidx = xmalloc(&_alloc, (nkeep ? nkeep : 1) * 3 * sizeof(int));
+    float *verts = xmalloc(&_alloc, (o->nverts ? o->nverts : 1) * 3 * sizeof(float));
+    memset(remap, -1, (o->nverts ? o->nverts : 1) * sizeof(int));
+    int nverts = 0;
+    for (int i = 0; i < nkeep; i++) {
+        int src = keys[i].tri;
+        for (int k = 0; k < 3; k++) {
+            int v = o->tris[src * 3 + k];
+            if (remap[v] < 0) {
+                memcpy(&verts[nverts * 3], &o->verts[v * 3], 3 * sizeof(float));
+                remap[v] = nverts++;
+            }
+            tris[i * 3 + k] = remap[v];
+            normidx[i * 3 + k] = o->normidx[src * 3 + k];
+        }
+    }
+    __atomic_add_fetch(&_stats.objs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_stats.welded, welded, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&_stats.dropped, dropped, __ATOMIC_RELAXED);
+    xfree(o->verts);
+    xfree(o->tris);
+    xfree(o->normidx);
+    o->verts = verts;
+    o->nverts = nverts;
+    o->tris = tris;
+    o->normidx = normidx;
+    o->ntris = nkeep;
+    xfree(cents);
+    xfree(keys);
+    xfree(remap);
+}
+
+void optstats(OptStats *st) {
+    st->objs = __atomic_load_n(&_stats.objs, __ATOMIC_RELAXED);
+    st->welded = __atomic_load_n(&_stats.welded, __ATOMIC_RELAXED);
+    st->dropped = __atomic_load_n(&_stats.dropped, __ATOMIC_RELAXED);
+    st->lodbefore = __atomic_load_n(&_stats.lodbefore, __ATOMIC_RELAXED);
+    st->lodafter = __atomic_load_n(&_stats.lodafter, __ATOMIC_RELAXED);
+}
+
+typedef struct {
+    int x, y, z;
+    int used;
+    Vec3 sum;
+    int count;
+} Cell;
+
+static Cell *findcell(Cell *table, int size, int x, int y, int z) {
+    int key[3] = {x, y, z};
+    unsigned h = hashbytes(key, sizeof(key)) & (size - 1);
+    while (table[h].used && (table[h].x != x || table[h].y != y || table[h].z != z))
+        h = (h + 1) & (size - 1);
+    table[h].x = x, table[h].y = y, table[h].z = z;
+    table[h].used = 1;
+    return &table[h];
+}
+
+void simplifyobj(Obj *o, int cells) {
+    Vec3 lo = vec3(FLT_MAX, FLT_MAX, FLT_MAX), hi = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for (int i = 0; i < o->nverts; i++) {
+        Vec3 v = vertof(o, i);
+        lo = vec3(fminf(lo.x, v.x), fminf(lo.y, v.y), fminf(lo.z, v.z));
+        hi = vec3(fmaxf(hi.x, v.x), fmaxf(hi.y, v.y), fmaxf(hi.z, v.z));
+    }
+    Vec3 ext = vsub(hi, lo);
+    float step = fmaxf(ext.x, fmaxf(ext.y, ext.z)) / cells;
+    if (!o->nverts || step <= 0) return;
+    int size = 1;
+    while (size < o->nverts * 2)
+        size <<= 1;
+    Cell *table = xcalloc(&_alloc, size, sizeof(Cell));
+    Cell **cellof = xmalloc(&_alloc, o->nverts * sizeof(Cell *));
+    for (int i = 0; i < o->nverts; i++) {
+        Vec3 v = vertof(o, i);
+        Vec3 c = vmul(vsub(v, lo), 1 / step);
+        Cell *cell = findcell(table, size, (int)c.x, (int)c.y, (int)c.z);
+        cell->sum = vadd(cell->sum, v);
+        cell->count++;
+        cellof[i] = cell;
+    }
+    for (int i = 0; i < o->nverts; i++) {
+        Vec3 mean = vmul(cellof[i]->sum, 1.0 / cellof[i]->count);
+        o->verts[i * 3] = mean.x;
+        o->verts[i * 3 + 1] = mean.y;
+        o->verts[i * 3 + 2] = mean.z;
+    }
+    xfree(cellof);
+    xfree(table);
+}
+
+static void optfile(const char *file, int cells, char *path, int size) {
+    if (cells)
+        snprintf(path, size, "%s.lod%i%s", file, cells, OPT_EXT);
+    else
+        snprintf(path, size, "%s%s", file, OPT_EXT);
+}
+
+static int readarr(FILE *f, void **arr, int n, int size) {
+    *arr = xmalloc(&_alloc, (n ? n : 1) * size);
+    return fread(*arr, size, n, f) == n;
+}
+
+// counts and indices come from disk, a cache that doesn't add up is
+// ignored and the OBJ parsed again
+static int checkopt(FILE *f, OptHdr *hdr) {
+    if (hdr->nverts < 0 || hdr->ntris < 0 || hdr->nnorms < 0
+            || hdr->nverts > INT_MAX / 3 || hdr->ntris > INT_MAX / 3 || hdr->nnorms > INT_MAX / 3)
+        return 0;
+    long long size = sizeof(OptHdr) + (long long)hdr->nverts * 3 * sizeof(float)
+            + (long long)hdr->ntris * 6 * sizeof(int) + (long long)hdr->nnorms * 3 * sizeof(float);
+    if (fseek(f, 0, SEEK_END) != 0) return 0;
+    long long actual = ftell(f);
+    return actual == size && fseek(f, sizeof(OptHdr), SEEK_SET) == 0;
+}
+
+static int checkoptindices(Obj *o) {
+    for (int i = 0; i < o->ntris * 3; i++)
+        if (o->tris[i] < 0 || o->tris[i] >= o->nverts
+                || o->normidx[i] < -1 || o->normidx[i] >= o->nnorms)
+            return 0;
+    return 1;
+}
+
+static Obj *loadopt(const char *file, int cells) {
+    char path[1100];
+    optfile(file, cells, path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    OptHdr hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, OPT_MAGIC, 4) != 0
+            || hdr.version != OPT_VERSION || hdr.key != lazykey(file) || hdr.cells != cells) {
+        fclose(f);
+        return 0;
+    }
+    if (!checkopt(f, &hdr)) {
+        printf("obj: %s is corrupt, ignoring it\n", path);
+        fclose(f);
+        return 0;
+    }
+    Obj *o = xcalloc(&_alloc, 1, sizeof(Obj));
+    o->nverts = hdr.nverts;
+    o->ntris = hdr.ntris;
+    o->nnorms = hdr.nnorms;
+    int ok = readarr(f, (void **)&o->verts, o->nverts * 3, sizeof(float))
+            && readarr(f, (void **)&o->tris, o->ntris * 3, sizeof(int))
+            && readarr(f, (void **)&o->normidx, o->ntris * 3, sizeof(int));
+    // an OBJ without vn has no norms array
+    if (ok && o->nnorms)
+        ok = readarr(f, (void **)&o->norms, o->nnorms * 3, sizeof(float));
+    fclose(f);
+    if (ok && !checkoptindices(o)) {
+        printf("obj: %s is corrupt, ignoring it\n", path);
+        ok = 0;
+    }
+    if (!ok) {
+        freeobj(o);
+        return 0;
+    }
+    return o;
+}
+
+// Written aside under a unique name and renamed over, a reader never
+// sees half a file and two writers of the same OBJ don't share a temp.
+static void saveopt(const char *file, int cells, Obj *o) {
+    char path[1100], tmp[1110];
+    optfile(file, cells, path, sizeof(path));
+    OptHdr hdr = {{0}};
+    memcpy(hdr.magic, OPT_MAGIC, 4);
+    hdr.version = OPT_VERSION;
+    hdr.key = lazykey(file);
+    hdr.cells = cells;
+    hdr.nverts = o->nverts;
+    hdr.ntris = o->ntris;
+    hdr.nnorms = o->nnorms;
+    FILE *f = opentemp(path, tmp, sizeof(tmp));
+    if (!f) {
+        printf("obj: can't write %s\n", path);
+        return;
+    }
+    int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1
+            && fwrite(o->verts, sizeof(float), o->nverts * 3, f) == o->nverts * 3
+            && fwrite(o->tris, sizeof(int), o->ntris * 3, f) == o->ntris * 3
+            && fwrite(o->normidx, sizeof(int), o->ntris * 3, f) == o->ntris * 3
+            && fwrite(o->norms, sizeof(float), o->nnorms * 3, f) == o->nnorms * 3;
+    if (!closetemp(f, tmp, path, ok))
+        printf("obj: failed to write %s\n", path);
+}
+
+Obj *loadlod(const char *file, int cells) {
+    tracebegin("load obj", file);
+    Obj *o = loadopt(file, cells);
+    if (o) {
+        traceend();
+        return o;
+    }
+    o = newobj(file);
+    if (!o) {
+        traceend();
+        return 0;
+    }
+    int ntris = o->ntris;
+    if (cells)
+        simplifyobj(o, cells);
+    optimizeobj(o);
+    if (cells) {
+        __atomic_add_fetch(&_stats.lodbefore, ntris, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&_stats.lodafter, o->ntris, __ATOMIC_RELAXED);
+    }
+    saveopt(file, cells, o);
+    traceend();
+    return o;
+}
+
+Obj *loadobj(const char *file) {
+    return loadlod(file, 0);
+}
+
+static int *copyints(int *src, int n) {
+    int *dst = xmalloc(&_alloc, (n ? n : 1) * sizeof(int));
+    memcpy(dst, src, n * sizeof(int));
+    return dst;
+}
+
+static void unshare(Shared *e) {
+    Shared **p = &_shared;
+    while (*p != e)
+        p = &(*p)->next;
+    *p = e->next;
+    if (e->obj) freeobj(e->obj);
+    xfree(e->file);
+    xfree(e);
+}
+
+// Loads happen outside the lock, a second caller for the same file
+// waits for the first instead of parsing it again.
+Obj *shareobj(const char *file, int cells) {
+    unsigned key = lazykey(file);
+    pthread_mutex_lock(&_sharelock);
+    Shared *e = _shared;
+    while (e && (e->cells != cells || e->key != key || strcmp(e->file, file) != 0))
+        e = e->next;
+    if (!e) {
+        e = xcalloc(&_alloc, 1, sizeof(Shared));
+        e->file = xstrdup(&_alloc, file);
+        e->cells = cells;
+        e->key = key;
+        e->loading = 1;
+        e->refs = 1;
+        e->next = _shared;
+        _shared = e;
+        pthread_mutex_unlock(&_sharelock);
+        Obj *o = loadlod(file, cells);
+        pthread_mutex_lock(&_sharelock);
+        e->obj = o;
+        e->loading = 0;
+        pthread_cond_broadcast(&_shareload);
+    }
+    else {
+        e->refs++;
+        while (e->loading)
+            pthread_cond_wait(&_shareload, &_sharelock);
+    }
+    Obj *o = e->obj;
+    if (!o) {
+        if (--e->refs == 0) unshare(e);
+        pthread_mutex_unlock(&_sharelock);
+        return 0;
+    }
+    pthread_mutex_unlock(&_sharelock);
+    Obj *v = xmalloc(&_alloc, sizeof(Obj));
+    *v = *o;
+    v->base = o;
+    v->tris = copyints(o->tris, o->ntris * 3);
+    v->normidx = copyints(o->normidx, o->ntris * 3);
+    return v;
+}
+
+void releaseobj(Obj *base) {
+    pthread_mutex_lock(&_sharelock);
+    Shared *e = _shared;
+    while (e && e->obj != base)
+        e = e->next;
+    if (!e) err("obj: released an obj that isn't shared");
+    if (--e->refs == 0) unshare(e);
+    pthread_mutex_unlock(&_sharelock);
+}
@@ -0,0 +1,101 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+#include <raytracer/numa.h>
+#include <raytracer/pool.h>
+#include <raytracer/util.h>
+
+#define NODE_DIR "/sys/devices/system/node"
+
+static Allocator _alloc = {"numa"};
+
+// "0-3,8-11" into cpus, returns how many
+static int parsecpulist(const char *s, int *cpus, int max) {
+    int n = 0;
+    while (*s && *s != '\n') {
+        char *end;
+        int lo = strtol(s, &end, 10), hi = lo;
+        if (end == s) break;
+        s = end;
+        if (*s == '-') {
+            hi = strtol(s + 1, &end, 10);
+            s = end;
+        }
+        for (int c = lo; c <= hi && n < max; c++)
+            cpus[n++] = c;
+        if (*s == ',') s++;
+    }
+    return n;
+}
+
+static int cmpint(const void *a, const void *b) {
+    return *(int *)a - *(int *)b;
+}
+
+static void addnode(Topology *t, int *cpus, int n) {
+    t->ncpus = xrealloc(&_alloc, t->ncpus, (t->nnodes + 1) * sizeof(int));
+    t->cpus = xrealloc(&_alloc, t->cpus, (t->nnodes + 1) * sizeof(int *));
+    t->ncpus[t->nnodes] = n;
+    t->cpus[t->nnodes] = xmalloc(&_alloc, n * sizeof(int));
+    memcpy(t->cpus[t->nnodes], cpus, n * sizeof(int));
+    t->nnodes++;
+}
+
+void readtopology(Topology *t) {
+    memset(t, 0, sizeof(Topology));
+    int max = CPU_SETSIZE;
+    int *cpus = xmalloc(&_alloc, max * sizeof(int));
+    int ids[256], nids = 0;
+    DIR *d = opendir(NODE_DIR);
+    struct dirent *e;
+    while (d && (e = readdir(d)) && nids < 256) {
+        int id;
+        char c;
+        if (sscanf(e->d_name, "node%d%c", &id, &c) == 1)
+            ids[nids++] = id;
+    }
+    if (d) closedir(d);
+    qsort(ids, nids, sizeof(int), cmpint);
+    for (int i = 0; i < nids; i++) {
+        char path[300], line[4096];
+        snprintf(path, sizeof(path), "%s/node%i/cpulist", NODE_DIR, ids[i]);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        int n = fgets(line, sizeof(line), f) ? parsecpulist(line, cpus, max) : 0;
+        fclose(f);
+        if (n) addnode(t, cpus, n);
+    }
+    if (!t->nnodes) {
+        int n = ncpus();
+        for (int c = 0; c < n && c < max; c++)
+            cpus[c] = c;
+        addnode(t, cpus, n < max ? n : max);
+    }
+    xfree(cpus);
+}
+
+void freetopology(Topology *t) {
+    for (int i = 0; i < t->nnodes; i++)
+        xfree(t->cpus[i]);
+    xfree(t->cpus);
+    xfree(t->ncpus);
+}
+
+int topologycpus(Topology *t) {
+    int n = 0;
+    for (int i = 0; i < t->nnodes; i++)
+        n += t->ncpus[i];
+    return n;
+}
+
+int pinnode(Topology *t, int node) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < t->ncpus[node]; i++)
+        CPU_SET(t->cpus[node][i], &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
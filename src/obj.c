@@ -1,3 +1,5 @@
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
@@ -5,6 +7,7 @@
 #include <raytracer/util.h>
 #include <raytracer/obj.h>
 #include <raytracer/raytracer.h>
+#include <raytracer/tracing.h>
 
 enum {
     T_NONE, T_EOF,
@@ -23,12 +26,33 @@ typedef struct {
 } Tok;
 
 typedef struct {
+    const char *file;
     char *src;
     Obj *obj;
     Tok cur;
     Tok prev;
+    // set by the first error, parse stops there
+    int failed;
+    // room in obj's arrays, in elements
+    int capverts, capnorms, captris;
 } Parser;
 
+// bytes of whole lines scanobj parses at a time
+#define SCAN_CHUNK (4 << 20)
+
+static Allocator _alloc = {"obj"};
+
+static void fail(Parser *p, const char *fmt, ...) {
+    if (p->failed) return;
+    p->failed = 1;
+    va_list args;
+    va_start(args, fmt);
+    printf("obj: %s: ", p->file);
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+}
+
 static Tok _nexttok(Parser *p) {
     while (isspace(*p->src))
         p->src++;
@@ -44,7 +68,7 @@ static Tok _nexttok(Parser *p) {
     }
     if (isalpha(*p->src)) goto id;
     else if (isdigit(*p->src)) goto num;
-    err("unexpected char: %c", *start);
+    fail(p, "unexpected char: %c", *start);
     return (Tok){T_EOF};
 num:
     while (isdigit(*p->src))
@@ -92,30 +116,64 @@ static int match(Parser *p, int type) {
 
 static void expect(Parser *p, int type) {
     if (match(p, type)) return;
-    err("obj: expected %i, got %i", type, p->cur.type);
+    fail(p, "expected %i, got %i", type, p->cur.type);
 }
 
-static void pushvert(Obj *obj, float *v) {
+// arrays double as they fill, the tracked allocator isn't hit per element
+static void *grow(void *arr, int *cap, int n, int size) {
+    if (n < *cap) return arr;
+    *cap = *cap ? *cap * 2 : 256;
+    return xrealloc(&_alloc, arr, (unsigned)*cap * size);
+}
+
+static void pushvert(Parser *p, float *v) {
+    Obj *obj = p->obj;
+    obj->verts = grow(obj->verts, &p->capverts, obj->nverts, 3 * sizeof(float));
+    memcpy(&obj->verts[obj->nverts * 3], v, 3 * sizeof(float));
     obj->nverts++;
-    obj->verts = realloc(obj->verts, obj->nverts * 3 * sizeof(float));
-    memcpy(&obj->verts[obj->nverts * 3 - 3], v, 3 * sizeof(float));
 }
 
-static void pushtri(Obj *obj, int *tri) {
+static void pushnorm(Parser *p, float *n) {
+    Obj *obj = p->obj;
+    obj->norms = grow(obj->norms, &p->capnorms, obj->nnorms, 3 * sizeof(float));
+    memcpy(&obj->norms[obj->nnorms * 3], n, 3 * sizeof(float));
+    obj->nnorms++;
+}
+
+static void pushtri(Parser *p, int *tri, int *norm) {
+    Obj *obj = p->obj;
+    int cap = p->captris;
+    obj->tris = grow(obj->tris, &p->captris, obj->ntris, 3 * sizeof(int));
+    // normidx keeps step with tris
+    obj->normidx = grow(obj->normidx, &cap, obj->ntris, 3 * sizeof(int));
+    memcpy(&obj->tris[obj->ntris * 3], tri, 3 * sizeof(int));
+    memcpy(&obj->normidx[obj->ntris * 3], norm, 3 * sizeof(int));
     obj->ntris++;
-    obj->tris = realloc(obj->tris, obj->ntris * 3 * sizeof(int));
-    memcpy(&obj->tris[obj->ntris * 3 - 3], tri, 3 * sizeof(int));
+}
+
+// a fresh obj for the parser to fill
+static void startobj(Parser *p) {
+    p->obj = xcalloc(&_alloc, 1, sizeof(Obj));
+    p->capverts = p->capnorms = p->captris = 0;
+}
+
+// gives back what doubling left unused
+static void trimobj(Obj *o) {
+    o->verts = xrealloc(&_alloc, o->verts, o->nverts * 3 * sizeof(float));
+    o->norms = xrealloc(&_alloc, o->norms, o->nnorms * 3 * sizeof(float));
+    o->tris = xrealloc(&_alloc, o->tris, o->ntris * 3 * sizeof(int));
+    o->normidx = xrealloc(&_alloc, o->normidx, o->ntris * 3 * sizeof(int));
 }
 
 static void parse(Parser *p) {
-    while (!match(p, T_EOF)) {
+    while (!p->failed && !match(p, T_EOF)) {
         if (match(p, T_V)) {
             float v[3];
             for (int i = 0; i < 3; i++) {
                 expect(p, T_FLOAT);
                 v[i] = atof(p->prev.str);
             }
-            pushvert(p->obj, v);
+            pushvert(p, v);
             continue;
         }
         else if (match(p, T_VT)) {
@@ -124,23 +182,28 @@ static void parse(Parser *p) {
             continue;
         }
         else if (match(p, T_VN)) {
-            for (int i = 0; i < 3; i++)
+            float n[3];
+            for (int i = 0; i < 3; i++) {
                 expect(p, T_FLOAT);
+                n[i] = atof(p->prev.str);
+            }
+            pushnorm(p, n);
             continue;
         }
         else if (match(p, T_F)) {
-            int tri[3];
+            int tri[3], norm[3];
             for (int i = 0; i < 3; i++) {
                 expect(p, T_INT);
                 tri[i] = atoi(p->prev.str) - 1;
+                norm[i] = -1;
                 // tex
                 if (match(p, T_SLASH))
                     match(p, T_INT);
                 // norm
-                if (match(p, T_SLASH))
-                    match(p, T_INT);
+                if (match(p, T_SLASH) && match(p, T_INT))
+                    norm[i] = atoi(p->prev.str) - 1;
             }
-            pushtri(p->obj, tri);
+            pushtri(p, tri, norm);
             continue;
         }
         else if (match(p, T_USEMTL)) {
@@ -151,24 +214,106 @@ static void parse(Parser *p) {
             expect(p, T_INT);
             continue;
         }
-        err("unexpected tok: %i, %.*s", p->cur.type, p->cur.len, p->cur.str);
+        fail(p, "unexpected tok: %i, %.*s", p->cur.type, p->cur.len, p->cur.str);
+    }
+}
+
+// every face corner has to name one of the first nverts vertices, and
+// of the first nnorms normals if any
+static void checkindices(Parser *p, int nverts, int nnorms) {
+    Obj *o = p->obj;
+    for (int i = 0; i < o->ntris * 3 && !p->failed; i++) {
+        if (o->tris[i] < 0 || o->tris[i] >= nverts)
+            fail(p, "face %i uses vertex %i of %i", i / 3, o->tris[i] + 1, nverts);
+        else if (o->normidx[i] < -1 || o->normidx[i] >= nnorms)
+            fail(p, "face %i uses normal %i of %i", i / 3, o->normidx[i] + 1, nnorms);
     }
 }
 
 Obj *newobj(const char *file) {
-    Parser p;
-    char *full = readfile(file);
+    char *full = tryreadfile(file);
+    if (!full) {
+        printf("obj: can't read %s\n", file);
+        return 0;
+    }
+    tracebegin("parse obj", file);
+    Parser p = {0};
+    p.file = file;
     p.src = full;
-    p.obj = malloc(sizeof(Obj));
-    memset(p.obj, 0, sizeof(Obj));
+    startobj(&p);
     advance(&p);
     parse(&p);
-    free(full);
+    trimobj(p.obj);
+    checkindices(&p, p.obj->nverts, p.obj->nnorms);
+    xfree(full);
+    traceend();
+    if (p.failed) {
+        freeobj(p.obj);
+        return 0;
+    }
     return p.obj;
 }
 
+int scanobj(const char *file, void (*chunk)(void *ctx, Obj *o), void *ctx) {
+    FILE *f = fopen(file, "r");
+    if (!f) {
+        printf("obj: can't read %s\n", file);
+        return 0;
+    }
+    tracebegin("scan obj", file);
+    Parser p = {0};
+    p.file = file;
+    int cap = SCAN_CHUNK, len = 0, eof = 0;
+    char *buf = xmalloc(&_alloc, cap + 1);
+    int nverts = 0, nnorms = 0;
+    while (!p.failed && (!eof || len)) {
+        int want = cap - len;
+        int got = fread(buf + len, 1, want, f);
+        len += got;
+        eof = got < want;
+        // whole lines only, the rest moves to the front for next time
+        int end = len;
+        if (!eof) {
+            while (end > 0 && buf[end - 1] != '\n')
+                end--;
+            if (!end) {
+                cap *= 2;
+                buf = xrealloc(&_alloc, buf, cap + 1);
+                continue;
+            }
+        }
+        char c = buf[end];
+        buf[end] = 0;
+        p.src = buf;
+        startobj(&p);
+        advance(&p);
+        parse(&p);
+        checkindices(&p, nverts + p.obj->nverts, nnorms + p.obj->nnorms);
+        if (!p.failed)
+            chunk(ctx, p.obj);
+        nverts += p.obj->nverts;
+        nnorms += p.obj->nnorms;
+        freeobj(p.obj);
+        buf[end] = c;
+        memmove(buf, buf + end, len - end);
+        len -= end;
+    }
+    if (ferror(f))
+        fail(&p, "read failed");
+    fclose(f);
+    xfree(buf);
+    traceend();
+    return !p.failed;
+}
+
 void freeobj(Obj *o) {
-    if (o->verts) free(o->verts);
-    if (o->tris) free(o->tris);
-    free(o);
+    if (o->base)
+        releaseobj(o->base);
+    else {
+        xfree(o->verts);
+        xfree(o->norms);
+    }
+    xfree(o->tris);
+    xfree(o->normidx);
+    xfree(o);
 }
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <raytracer/pool.h>
+#include <raytracer/util.h>
+
+static Allocator _alloc = {"pool"};
+
+typedef struct Job {
+    void (*fn)(void *arg);
+    void *arg;
+    struct Job *next;
+} Job;
+
+struct Pool {
+    pthread_mutex_t lock;
+    // signalled when a job is queued or the pool shuts down
+    pthread_cond_t work;
+    // signalled when the last pending job finishes
+    pthread_cond_t idle;
+    Job *head, *tail;
+    // queued plus running
+    int pending;
+    int quit;
+    pthread_t *threads;
+    int nthreads;
+};
+
+// set on pool threads, whose pool already has the CPUs busy
+static __thread int _injob;
+
+int ncpus() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+int poolcpus() {
+    return _injob ? 1 : ncpus();
+}
+
+static void *worker(void *arg) {
+    Pool *p = arg;
+    _injob = 1;
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->head && !p->quit)
+            pthread_cond_wait(&p->work, &p->lock);
+        if (!p->head) break;
+        Job *job = p->head;
+        p->head = job->next;
+        if (!p->head) p->tail = 0;
+        pthread_mutex_unlock(&p->lock);
+        job->fn(job->arg);
+        xfree(job);
+        pthread_mutex_lock(&p->lock);
+        if (--p->pending == 0)
+            pthread_cond_broadcast(&p->idle);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+Pool *newpool(int nthreads) {
+    Pool *p = xcalloc(&_alloc, 1, sizeof(Pool));
+    pthread_mutex_init(&p->lock, 0);
+    pthread_cond_init(&p->work, 0);
+    pthread_cond_init(&p->idle, 0);
+    p->nthreads = nthreads > 0 ? nthreads : poolcpus();
+    p->threads = xmalloc(&_alloc, p->nthreads * sizeof(pthread_t));
+    for (int i = 0; i < p->nthreads; i++)
+        if (pthread_create(&p->threads[i], 0, worker, p) != 0)
+            err("pool: can't start thread %i", i);
+    return p;
+}
+
+void poolsubmit(Pool *p, void (*fn)(void *arg), void *arg) {
+    Job *job = xmalloc(&_alloc, sizeof(Job));
+    job->fn = fn;
+    job->arg = arg;
+    job->next = 0;
+    pthread_mutex_lock(&p->lock);
+    if (p->tail) p->tail->next = job;
+    else p->head = job;
+    p->tail = job;
+    p->pending++;
+    pthread_cond_signal(&p->work);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void poolwait(Pool *p) {
+    pthread_mutex_lock(&p->lock);
+    while (p->pending)
+        pthread_cond_wait(&p->idle, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void freepool(Pool *p) {
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->nthreads; i++)
+        pthread_join(p->threads[i], 0);
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->work);
+    pthread_cond_destroy(&p->idle);
+    xfree(p->threads);
+    xfree(p);
+}
+
+int poolthreads(Pool *p) {
+    return p->nthreads;
+}
@@ -5,136 +5,65 @@
 #include <raytracer/math.h>
 #include <raytracer/obj.h>
 #include <raytracer/raytracer.h>
+#include <raytracer/util.h>
+#include <raytracer/lazy.h>
+
+static Allocator _alloc = {"shapes"};
+static Allocator _batches = {"batches"};
 
 int testshape(Shape *s, Ray *r, Hit *h) {
     if (s->test) return s->test(s, r, h);
     return 0;
 }
 
-static int testsphere(Shape *s, Ray *r, Hit *h) {
-    ShapeSphere *sp = (ShapeSphere *)s;
-    Vec3 toc = vsub(sp->center, r->orig);
-    float dot = vdot(toc, r->dir);
-    int inside = vmag(toc) < sp->radius;
-    if (!inside && dot < 0) return 0;
-    Vec3 proj = vproj(toc, r->dir);
-    Vec3 toray = vsub(proj, toc);
-    float raydist = vmag(toray);
-    if (raydist > sp->radius) return 0;
-    float offset = sqrt(sp->radius * sp->radius - raydist * raydist);
-    h->shape = s;
-    if (inside) {
-        if (dot > 0) h->dist = vmag(proj) + offset;
-        else h->dist = offset - vmag(proj);
-    }
-    else
-        h->dist = vmag(proj) - offset;
+void finalizehit(Ray *r, Hit *h) {
     h->point = vadd(r->orig, vmul(r->dir, h->dist));
-    h->norm = vnorm(vsub(h->point, sp->center));
-    return 1;
+    if (h->shape->finalize)
+        h->shape->finalize(h->shape, r, h);
 }
 
-static int testplane(Shape *s, Ray *r, Hit *h) {
-    ShapePlane *p = (ShapePlane *)s;
-    if (vdot(r->dir, p->normal) > 0) return 0;
-    Vec3 vp = vproj(r->dir, p->normal);
-    Vec3 vpp = vproj(vsub(p->point, r->orig), p->normal);
+static void sethit(Shape *s, float dist, Hit *h) {
     h->shape = s;
-    h->point = vadd(r->orig, vmul(r->dir, vmag(vpp) / vmag(vp)));
-    h->dist = vmag(vpp) / vmag(vp);
-    h->norm = p->normal;
+    h->dist = dist;
+    h->prim = 0;
+}
+
+static int testsphere(Shape *s, Ray *r, Hit *h) {
+    ShapeSphere *sp = (ShapeSphere *)s;
+    float dist;
+    if (!spheredist(sp->center, sp->r2, r, &dist)) return 0;
+    sethit(s, dist, h);
     return 1;
 }
 
-static int plane_intersect(Ray *r, Vec3 p, Vec3 n,
-        Vec3 *ip, float *idist) {
-    if (vdot(r->dir, n) > 0) return 0;
-    Vec3 vp = vproj(r->dir, n);
-    Vec3 vpp = vproj(vsub(p, r->orig), n);
-    *ip = vadd(r->orig, vmul(r->dir, vmag(vpp) / vmag(vp)));
-    *idist = vmag(vpp) / vmag(vp);
+static void finalizesphere(Shape *s, Ray *r, Hit *h) {
+    h->norm = vnorm(vsub(h->point, ((ShapeSphere *)s)->center));
+}
+
+// Only planes facing the ray and ahead of it are hit.
+static int planedist(Vec3 n, float d, Ray *r, float *dist) {
+    float denom = vdot(r->dir, n);
+    if (denom >= 0) return 0;
+    float t = (d - vdot(r->orig, n)) / denom;
+    if (t < 0) return 0;
+    *dist = t;
     return 1;
 }
 
-static float tri_area(Tri *tri) {
-    Vec3 ab = vsub(tri->b, tri->a);
-    Vec3 ac = vsub(tri->c, tri->a);
-    return vmag(vcross(ab, ac)) / 2;
-}
-
-static int tri_intersect(Ray *r, Tri *tri,
-        Vec3 *ip, Vec3 *in, float *idist) {
-    Vec3 ab = vsub(tri->b, tri->a);
-    Vec3 ac = vsub(tri->c, tri->a);
-    // Vec3 cb = vsub(tri->b, tri->c);
-    Vec3 tn = vnorm(vcross(ab, ac));
-    Vec3 plane_ip;
-    float plane_idist;
-    if (!plane_intersect(r, tri->a, tn, &plane_ip, &plane_idist))
-        return 0;
-    *idist = plane_idist;
-    *ip = plane_ip;
-    *in = tn;
-    float total = tri_area(tri);
-    float x = tri_area(&(Tri){tri->a, tri->b, plane_ip}) / total;
-    float y = tri_area(&(Tri){tri->a, tri->c, plane_ip}) / total;
-    float z = tri_area(&(Tri){tri->b, tri->c, plane_ip}) / total;
-    return x + y >= 0.0 && x + y <= 1.0
-            && x + z >= 0.0 && x + z <= 1.0
-            && y + z >= 0.0 && y + z <= 1.0;
-}
-
-static float max(float a, float b) {
-    return a > b ? a : b;
-}
-
-static void setbounds(ShapeMesh *m) {
-    Obj *o = m->obj;
-    m->bounds->center = matrixmul(&m->shape.transform, (Vec3){0, 0, 0});
-    float radius = 0.0;
-    for (int i = 0; i < o->nverts; i++) {
-        float *vp = &o->verts[i * 3];
-        Vec3 v = vec3(vp[0], vp[1], vp[2]);
-        Vec3 vt = matrixmul(&m->shape.transform, v);
-        radius = max(radius, vmag(vsub(vt, m->bounds->center)));
-    }
-    m->bounds->radius = radius;
+static int testplane(Shape *s, Ray *r, Hit *h) {
+    ShapePlane *p = (ShapePlane *)s;
+    float dist;
+    if (!planedist(p->normal, p->d, r, &dist)) return 0;
+    sethit(s, dist, h);
+    return 1;
 }
 
-static int testmesh(Shape *s, Ray *r, Hit *h) {
-    ShapeMesh *m = (ShapeMesh *)s;
-    Hit hit;
-    setbounds(m);
-    if (!testsphere(AS_SHAPE(m->bounds), r, &hit)) return 0;
-    // *h = hit; return 1;
-    float last_dist = FLT_MAX;
-    int success = 0;
-    for (int i = 0; i < m->obj->ntris; i++) {
-        float *v0 = &m->obj->verts[m->obj->tris[i * 3 + 0] * 3];
-        float *v1 = &m->obj->verts[m->obj->tris[i * 3 + 1] * 3];
-        float *v2 = &m->obj->verts[m->obj->tris[i * 3 + 2] * 3];
-        Tri tri = {
-            matrixmul(&s->transform, (Vec3){v0[0], v0[1], v0[2]}),
-            matrixmul(&s->transform, (Vec3){v1[0], v1[1], v1[2]}),
-            matrixmul(&s->transform, (Vec3){v2[0], v2[1], v2[2]}),
-        };
-        Vec3 ip, in;
-        float idist;
-        if (!tri_intersect(r, &tri, &ip, &in, &idist)) continue;
-        if (idist > last_dist) continue;
-        last_dist = idist;
-        success = 1;
-        h->shape = s;
-        h->dist = idist;
-        h->point = ip;
-        h->norm = in;
-    }
-    return success;
+static void finalizeplane(Shape *s, Ray *r, Hit *h) {
+    h->norm = ((ShapePlane *)s)->normal;
 }
 
 static void *newshape(int type, int size) {
-    Shape *s = malloc(size);
-    memset(s, 0, size);
+    Shape *s = xcalloc(&_alloc, 1, size);
     s->type = type;
     s->mat.diffuse = vec3(1.0, 0.5, 0.0);
     s->mat.reflectiveness = 0.25;
@@ -142,47 +71,251 @@ static void *newshape(int type, int size) {
     return s;
 }
 
+void bindshape(Shape *s) {
+    if (s->type == SHAPE_SPHERE) {
+        s->test = testsphere;
+        s->finalize = finalizesphere;
+    }
+    else if (s->type == SHAPE_PLANE) {
+        s->test = testplane;
+        s->finalize = finalizeplane;
+    }
+}
+
 ShapeSphere *newsphere(Vec3 center, float radius) {
     ShapeSphere *s = newshape(SHAPE_SPHERE, sizeof(ShapeSphere));
-    s->center = center;
-    s->radius = radius;
+    setsphere(s, center, radius);
     s->shape.test = testsphere;
+    s->shape.finalize = finalizesphere;
     return s;
 }
 
+void setsphere(ShapeSphere *s, Vec3 center, float radius) {
+    s->center = center;
+    s->radius = radius;
+    s->r2 = radius * radius;
+}
+
 ShapePlane *newplane(Vec3 point, Vec3 normal) {
     ShapePlane *p = newshape(SHAPE_PLANE, sizeof(ShapePlane));
     p->point = point;
     p->normal = vnorm(normal);
+    p->d = vdot(p->normal, point);
     p->shape.test = testplane;
+    p->shape.finalize = finalizeplane;
     return p;
 }
 
 ShapeMesh *newmesh(Obj *obj) {
-    ShapeMesh *m = newshape(SHAPE_MESH, sizeof(ShapePlane));
+    ShapeMesh *m = newshape(SHAPE_MESH, sizeof(ShapeMesh));
     m->obj = obj;
     m->bounds = newsphere(vec3(0, 0, 0), 0);
     m->shape.test = testmesh;
+    m->shape.finalize = finalizemesh;
+    m->smooth = 1;
+    updatemesh(m);
+    return m;
+}
+
+ShapeMesh *newmeshstream(MeshStream *ms) {
+    ShapeMesh *m = newshape(SHAPE_MESH, sizeof(ShapeMesh));
+    m->stream = ms;
+    m->bounds = newsphere(vec3(0, 0, 0), 0);
+    m->shape.test = testmesh;
+    m->shape.finalize = finalizemesh;
+    m->smooth = 1;
+    updatemesh(m);
+    return m;
+}
+
+ShapeMesh *newlazymesh(MeshLazy *l, Obj *obj) {
+    ShapeMesh *m = newshape(SHAPE_MESH, sizeof(ShapeMesh));
+    m->lazy = l;
+    m->obj = obj;
+    l->loaded = obj != 0;
+    m->bounds = newsphere(vec3(0, 0, 0), 0);
+    m->shape.test = testmesh;
+    m->shape.finalize = finalizemesh;
+    m->smooth = 1;
+    updatemesh(m);
     return m;
 }
 
 void shapetranslate(Shape *s, Vec3 trans) {
     matrixtranslate(&s->transform, trans);
+    if (s->type == SHAPE_MESH)
+        updatemesh((ShapeMesh *)s);
 }
 
 void shaperotate(Shape *s, Vec3 axis, float degrees) {
     matrixrotate(&s->transform, axis, degrees);
+    if (s->type == SHAPE_MESH)
+        updatemesh((ShapeMesh *)s);
 }
 
 void shapescale(Shape *s, Vec3 scale) {
     matrixscale(&s->transform, scale);
+    if (s->type == SHAPE_MESH)
+        updatemesh((ShapeMesh *)s);
 }
 
 void freeshape(Shape *shape) {
-    if (shape->type == SHAPE_MESH) {
-        ShapeMesh *m = (ShapeMesh *)shape;
-        freeshape(AS_SHAPE(m->bounds));
-        freeobj(m->obj);
+    if (shape->type == SHAPE_MESH)
+        freemesh((ShapeMesh *)shape);
+    xfree(shape);
+}
+
+static void *newarr(int n, int size) {
+    return xmalloc(&_batches, (n ? n : 1) * size);
+}
+
+void freebatches(Batches *b) {
+    xfree(b->sx);
+    xfree(b->sy);
+    xfree(b->sz);
+    xfree(b->sr2);
+    xfree(b->sshapes);
+    xfree(b->pnorms);
+    xfree(b->pd);
+    xfree(b->pshapes);
+    xfree(b->meshes);
+    xfree(b->others);
+    if (b->grid) freegrid(b->grid);
+    memset(b, 0, sizeof(Batches));
+}
+
+static int batchof(Shape *s) {
+    if (s->type == SHAPE_SPHERE && s->test == testsphere) return SHAPE_SPHERE;
+    if (s->type == SHAPE_PLANE && s->test == testplane) return SHAPE_PLANE;
+    if (s->type == SHAPE_MESH && s->test == testmesh) return SHAPE_MESH;
+    return SHAPE_NONE;
+}
+
+// Counts first so that every array is allocated once.
+void buildbatches(Batches *b, Shape **shapes, int nshapes) {
+    freebatches(b);
+    int counts[SHAPE_MESH + 1] = {0};
+    for (int i = 0; i < nshapes; i++)
+        counts[batchof(shapes[i])]++;
+    b->sx = newarr(counts[SHAPE_SPHERE], sizeof(float));
+    b->sy = newarr(counts[SHAPE_SPHERE], sizeof(float));
+    b->sz = newarr(counts[SHAPE_SPHERE], sizeof(float));
+    b->sr2 = newarr(counts[SHAPE_SPHERE], sizeof(float));
+    b->sshapes = newarr(counts[SHAPE_SPHERE], sizeof(Shape *));
+    b->pnorms = newarr(counts[SHAPE_PLANE], sizeof(Vec3));
+    b->pd = newarr(counts[SHAPE_PLANE], sizeof(float));
+    b->pshapes = newarr(counts[SHAPE_PLANE], sizeof(Shape *));
+    b->meshes = newarr(counts[SHAPE_MESH], sizeof(ShapeMesh *));
+    b->others = newarr(counts[SHAPE_NONE], sizeof(Shape *));
+    for (int i = 0; i < nshapes; i++) {
+        Shape *s = shapes[i];
+        int kind = batchof(s);
+        if (kind == SHAPE_SPHERE) {
+            ShapeSphere *sp = (ShapeSphere *)s;
+            int n = b->nspheres++;
+            b->sx[n] = sp->center.x;
+            b->sy[n] = sp->center.y;
+            b->sz[n] = sp->center.z;
+            b->sr2[n] = sp->r2;
+            b->sshapes[n] = s;
+        }
+        else if (kind == SHAPE_PLANE) {
+            ShapePlane *p = (ShapePlane *)s;
+            int n = b->nplanes++;
+            b->pnorms[n] = p->normal;
+            b->pd[n] = p->d;
+            b->pshapes[n] = s;
+        }
+        else if (kind == SHAPE_MESH)
+            b->meshes[b->nmeshes++] = (ShapeMesh *)s;
+        else
+            b->others[b->nothers++] = s;
+    }
+}
+
+static void *copyarr(void *src, int n, int size) {
+    void *dst = newarr(n, size);
+    memcpy(dst, src, n * size);
+    return dst;
+}
+
+void copybatches(Batches *dst, Batches *src, Shape **byid) {
+    memset(dst, 0, sizeof(Batches));
+    int ns = src->nspheres, np = src->nplanes;
+    dst->nspheres = ns;
+    dst->sx = copyarr(src->sx, ns, sizeof(float));
+    dst->sy = copyarr(src->sy, ns, sizeof(float));
+    dst->sz = copyarr(src->sz, ns, sizeof(float));
+    dst->sr2 = copyarr(src->sr2, ns, sizeof(float));
+    dst->sshapes = copyarr(src->sshapes, ns, sizeof(Shape *));
+    dst->nplanes = np;
+    dst->pnorms = copyarr(src->pnorms, np, sizeof(Vec3));
+    dst->pd = copyarr(src->pd, np, sizeof(float));
+    dst->pshapes = copyarr(src->pshapes, np, sizeof(Shape *));
+    dst->nmeshes = src->nmeshes;
+    dst->meshes = copyarr(src->meshes, src->nmeshes, sizeof(ShapeMesh *));
+    for (int i = 0; byid && i < dst->nmeshes; i++) {
+        Shape *r = byid[dst->meshes[i]->shape.id];
+        if (r) dst->meshes[i] = (ShapeMesh *)r;
+    }
+    dst->nothers = src->nothers;
+    dst->others = copyarr(src->others, src->nothers, sizeof(Shape *));
+    if (src->grid)
+        dst->grid = copygrid(src->grid);
+}
+
+// Exact ties go to the shape with the higher id, as they did when every
+// shape was tested in scene order.
+static inline int closer(float dist, Shape *s, float best, Shape *bests) {
+    return dist < best || (dist == best && (!bests || s->id > bests->id));
+}
+
+int testbatches(Batches *b, Ray *r, Hit *h) {
+    float last_dist = FLT_MAX;
+    Shape *best = 0;
+    int success = 0;
+    // spheres and planes only track the closest shape
+    if (b->grid) {
+        int i = gridtest(b->grid, b, r, &last_dist);
+        if (i >= 0) best = b->sshapes[i];
     }
-    free(shape);
+    else {
+        for (int i = 0; i < b->nspheres; i++) {
+            float dist;
+            Vec3 c = vec3(b->sx[i], b->sy[i], b->sz[i]);
+            if (!spheredist(c, b->sr2[i], r, &dist)) continue;
+            if (!closer(dist, b->sshapes[i], last_dist, best)) continue;
+            last_dist = dist;
+            best = b->sshapes[i];
+        }
+    }
+    for (int i = 0; i < b->nplanes; i++) {
+        float dist;
+        if (!planedist(b->pnorms[i], b->pd[i], r, &dist)) continue;
+        if (!closer(dist, b->pshapes[i], last_dist, best)) continue;
+        last_dist = dist;
+        best = b->pshapes[i];
+    }
+    if (best) {
+        sethit(best, last_dist, h);
+        success = 1;
+    }
+    Hit tmp;
+    for (int i = 0; i < b->nmeshes; i++) {
+        if (!testmesh(AS_SHAPE(b->meshes[i]), r, &tmp)) continue;
+        if (!closer(tmp.dist, tmp.shape, last_dist, best)) continue;
+        last_dist = tmp.dist;
+        best = tmp.shape;
+        *h = tmp;
+        success = 1;
+    }
+    for (int i = 0; i < b->nothers; i++) {
+        if (!testshape(b->others[i], r, &tmp)) continue;
+        if (!closer(tmp.dist, tmp.shape, last_dist, best)) continue;
+        last_dist = tmp.dist;
+        best = tmp.shape;
+        *h = tmp;
+        success = 1;
+    }
+    return success;
 }
@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <float.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <raytracer/math.h>
+#include <raytracer/obj.h>
+#include <raytracer/raytracer.h>
+#include <raytracer/render.h>
+#include <raytracer/shade.h>
+#include <raytracer/checkpoint.h>
+#include <raytracer/wavefront.h>
+#include <raytracer/gbuffer.h>
+#include <raytracer/util.h>
+#include <raytracer/stream.h>
+#include <raytracer/pool.h>
+#include <raytracer/tracing.h>
+#include <raytracer/numa.h>
+
+#define TILE_SIZE 32
+#define CKPT_INTERVAL 60
+
+static Allocator _alloc = {"render"};
+static Allocator _framebuffer = {"framebuffer"};
+
+void initbitmap(Bitmap *bmp, int w, int h) {
+    bmp->width = w;
+    bmp->height = h;
+    bmp->pixels = xmalloc(&_framebuffer, w * h * sizeof(Color));
+}
+
+void freebitmap(Bitmap *bmp) {
+    xfree(bmp->pixels);
+}
+
+void clear(Bitmap *bmp, Color c) {
+    for (int y = 0; y < bmp->height; y++)
+        for (int x = 0; x < bmp->width; x++)
+            bmp->pixels[y * bmp->width + x] = c;
+}
+
+void output(Bitmap *bmp, const char *file) {
+    tracebegin("encode", file);
+    FILE *f = fopen(file, "w");
+    fprintf(f, "P6\n%i %i\n%i\n", bmp->width, bmp->height, 255);
+    for (int y = 0; y < bmp->height; y++) {
+        for (int x = 0; x < bmp->width; x++) {
+            Color c = bmp->pixels[y * bmp->width + x];
+            fwrite(&c, 3, 1, f);
+        }
+    }
+    fclose(f);
+    traceend();
+}
+
+void initrenderopts(RenderOpts *opts) {
+    memset(opts, 0, sizeof(RenderOpts));
+    opts->tilesize = TILE_SIZE;
+    opts->ckptinterval = CKPT_INTERVAL;
+    opts->nthreads = 1;
+}
+
+int tilecount(Bitmap *bmp, int ts) {
+    return ((bmp->width + ts - 1) / ts) * ((bmp->height + ts - 1) / ts);
+}
+
+void tilerect(Bitmap *bmp, int ts, int i, int *x0, int *y0, int *x1, int *y1) {
+    int tw = (bmp->width + ts - 1) / ts;
+    *x0 = (i % tw) * ts;
+    *y0 = (i / tw) * ts;
+    *x1 = *x0 + ts < bmp->width ? *x0 + ts : bmp->width;
+    *y1 = *y0 + ts < bmp->height ? *y0 + ts : bmp->height;
+}
+
+static void rendertile(Bitmap *bmp, Scene *scene, Worker *w, GBuffer *gb,
+        int x0, int y0, int x1, int y1) {
+    Camera cam;
+    initcamera(&cam, scene, bmp->width, bmp->height);
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            Ray ray = primaryray(&cam, x, y);
+            // keyed per pixel so tile order, threads and resuming
+            // don't matter
+            rngseed(&w->rng, scene->seed, y * bmp->width + x);
+            int pixel = y * bmp->width + x;
+            Hit hit;
+            Vec3 c = gb ? gcast(scene, gb, pixel, &ray, w) : xcast(scene, &ray, 0, &hit, w);
+            bmp->pixels[pixel] = tocolor(c);
+            w->stats.primaryrays++;
+        }
+    }
+}
+
+// A band of tile rows for the threads of one NUMA node, or every tile
+// without --numa. Tiles are handed out in order through next. With
+// --replicate the node's first thread fills in copies of the scene's
+// batches, its meshes and the band's tile lists.
+typedef struct {
+    int node;
+    int first, end;
+    int next;
+    int nthreads;
+    int replicated;
+    // replica meshes by shape id
+    Shape **byid;
+    Batches batches;
+    TileCull tc;
+} TileBand;
+
+// One tileloop, shared by the threads rendering it. Every pixel only
+// depends on its own position so which thread gets which tile doesn't
+// change the image.
+typedef struct {
+    Bitmap *bmp;
+    Scene *scene;
+    RenderOpts *opts;
+    Frame *f;
+    unsigned char *done;
+    TileCull *tc;
+    int ntiles;
+    TileBand *bands;
+    int nbands;
+    // set with --numa, threads wait on ready until every band's memory
+    // has been touched on its node
+    Topology *topo;
+    pthread_barrier_t ready;
+    // held while checkpointing, the others carry on rendering
+    pthread_mutex_t ckptlock;
+    time_t last;
+} TileQueue;
+
+typedef struct {
+    TileQueue *q;
+    int band;
+    // index among the band's threads
+    int slot;
+    Worker w;
+} TileJob;
+
+static void checkpoint(TileQueue *q) {
+    RenderOpts *opts = q->opts;
+    if (pthread_mutex_trylock(&q->ckptlock) != 0) return;
+    if (difftime(time(0), q->last) >= opts->ckptinterval) {
+        // the flags are read once, the pixels of a tile seen done here
+        // were written before its flag; tiles finishing meanwhile are
+        // left for the next checkpoint
+        unsigned char *done = xmalloc(&_alloc, q->ntiles);
+        for (int i = 0; i < q->ntiles; i++)
+            done[i] = __atomic_load_n(&q->done[i], __ATOMIC_ACQUIRE);
+        savecheckpoint(opts->ckptfile, opts->ckptkey, q->bmp, opts->tilesize, done, q->ntiles);
+        xfree(done);
+        q->last = time(0);
+    }
+    pthread_mutex_unlock(&q->ckptlock);
+}
+
+void rendertileat(Bitmap *bmp, Scene *scene, RenderOpts *opts, Frame *f, TileCull *tc,
+        Worker *w, int i) {
+    tracebegini("tile", i);
+    int x0, y0, x1, y1;
+    tilerect(bmp, opts->tilesize, i, &x0, &y0, &x1, &y1);
+    // touch sets only ever grow here, hits replayed from the gbuffer
+    // don't retrace the shadow rays that found their occluders
+    if (f && f->touch)
+        w->touch = &f->touch[i * f->touchbytes];
+    if (tc && tc->tiles) {
+        w->tile = &tc->tiles[i];
+        w->stats.culltiles++;
+        w->stats.cullshapes += w->tile->nspheres + w->tile->nmeshes;
+    }
+    GBuffer *gb = f ? f->gb : 0;
+    if (opts->wavefront && !gb)
+        renderwavefront(bmp, scene, w, x0, y0, x1, y1);
+    else
+        rendertile(bmp, scene, w, gb, x0, y0, x1, y1);
+    traceend();
+}
+
+static void replicate(TileQueue *q, TileBand *b) {
+    Scene *s = q->scene;
+    b->byid = xcalloc(&_alloc, s->nshapes ? s->nshapes : 1, sizeof(Shape *));
+    for (int i = 0; i < s->nshapes; i++)
+        if (s->shapes[i]->type == SHAPE_MESH)
+            b->byid[i] = (Shape *)replicatemesh((ShapeMesh *)s->shapes[i]);
+    copybatches(&b->batches, &s->batches, b->byid);
+    if (q->tc->tiles) {
+        b->tc.ntiles = q->tc->ntiles;
+        b->tc.tiles = xcalloc(&_alloc, q->tc->ntiles, sizeof(Batches));
+        for (int i = b->first; i < b->end; i++)
+            copybatches(&b->tc.tiles[i], &q->tc->tiles[i], b->byid);
+    }
+    b->replicated = 1;
+}
+
+static void freereplicas(TileQueue *q, TileBand *b) {
+    if (!b->replicated) return;
+    freetilecull(&b->tc);
+    freebatches(&b->batches);
+    for (int i = 0; i < q->scene->nshapes; i++)
+        if (b->byid[i]) freereplica((ShapeMesh *)b->byid[i]);
+    xfree(b->byid);
+}
+
+// Pixels are first written by the node that renders them, so their
+// pages are allocated there. Each thread clears its share of the band.
+static void touchband(TileQueue *q, TileBand *b, int slot) {
+    int n = b->end - b->first;
+    int lo = b->first + n * slot / b->nthreads, hi = b->first + n * (slot + 1) / b->nthreads;
+    for (int i = lo; i < hi; i++) {
+        if (q->done[i]) continue;
+        int x0, y0, x1, y1;
+        tilerect(q->bmp, q->opts->tilesize, i, &x0, &y0, &x1, &y1);
+        for (int y = y0; y < y1; y++)
+            memset(&q->bmp->pixels[y * q->bmp->width + x0], 0, (x1 - x0) * sizeof(Color));
+    }
+}
+
+// Own band first, then whatever is left of the others.
+static void tilejob(void *arg) {
+    TileJob *job = arg;
+    TileQueue *q = job->q;
+    TileBand *own = &q->bands[job->band];
+    if (q->topo) {
+        pinnode(q->topo, own->node);
+        if (q->opts->replicate && job->slot == 0)
+            replicate(q, own);
+        touchband(q, own, job->slot);
+        pthread_barrier_wait(&q->ready);
+    }
+    initworker(&job->w, q->scene);
+    if (own->replicated)
+        job->w.batches = &own->batches;
+    for (int k = 0; k < q->nbands; k++) {
+        TileBand *b = &q->bands[(job->band + k) % q->nbands];
+        TileCull *tc = b->replicated && b == own ? &b->tc : q->tc;
+        for (;;) {
+            int i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+            if (i >= b->end) break;
+            if (q->done[i]) continue;
+            rendertileat(q->bmp, q->scene, q->opts, q->f, tc, &job->w, i);
+            // a checkpoint taken on another thread only trusts tiles
+            // marked done after their pixels
+            __atomic_store_n(&q->done[i], 1, __ATOMIC_RELEASE);
+            if (q->opts->ckptfile)
+                checkpoint(q);
+        }
+    }
+}
+
+// Threads go to nodes in proportion to their CPUs, and each node gets
+// rows of tiles in proportion to its threads.
+static void splitbands(TileQueue *q, TileJob *jobs, int nthreads) {
+    Topology *t = q->topo;
+    int nnodes = t ? t->nnodes : 1;
+    int *perthread = xcalloc(&_alloc, nnodes, sizeof(int));
+    int *nodeof = xmalloc(&_alloc, nthreads * sizeof(int));
+    int total = t ? topologycpus(t) : 1;
+    for (int i = 0; i < nthreads; i++) {
+        int cpu = (long)i * total / nthreads, node = 0;
+        while (t && cpu >= t->ncpus[node])
+            cpu -= t->ncpus[node++];
+        nodeof[i] = node;
+        perthread[node]++;
+    }
+    q->bands = xcalloc(&_alloc, nnodes, sizeof(TileBand));
+    int ts = q->opts->tilesize;
+    int tw = (q->bmp->width + ts - 1) / ts, th = (q->bmp->height + ts - 1) / ts;
+    int seen = 0;
+    for (int node = 0; node < nnodes; node++) {
+        if (!perthread[node]) continue;
+        TileBand *b = &q->bands[q->nbands];
+        b->node = node;
+        b->nthreads = perthread[node];
+        b->first = b->next = (long)th * seen / nthreads * tw;
+        seen += perthread[node];
+        b->end = (long)th * seen / nthreads * tw;
+        for (int i = 0, slot = 0; i < nthreads; i++) {
+            if (nodeof[i] != node) continue;
+            jobs[i].band = q->nbands;
+            jobs[i].slot = slot++;
+        }
+        q->nbands++;
+    }
+    xfree(perthread);
+    xfree(nodeof);
+}
+
+void addstats(RenderStats *to, RenderStats *from) {
+    to->primaryrays += from->primaryrays;
+    to->shadowrays += from->shadowrays;
+    to->reflectionrays += from->reflectionrays;
+    to->occludertests += from->occludertests;
+    to->occluderhits += from->occluderhits;
+    to->culltiles += from->culltiles;
+    to->cullshapes += from->cullshapes;
+}
+
+// Renders every tile not marked done, checkpointing as it goes if the
+// options ask for it. More than one thread renders from a pool, each
+// with its own worker. With --numa the threads are pinned, always from
+// a pool so the caller isn't.
+static void tileloop(Bitmap *bmp, Scene *scene, RenderOpts *opts, Frame *f,
+        unsigned char *done, RenderStats *stats) {
+    double start = now();
+    compilescene(scene);
+    int ts = opts->tilesize;
+    TileQueue q = {bmp, scene, opts, f, done};
+    q.ntiles = tilecount(bmp, ts);
+    // a grid culls by itself, and beats long tile lists
+    TileCull tc = {0};
+    if (scene->accel == ACCEL_NONE)
+        buildtilecull(&tc, scene, bmp, ts);
+    q.tc = &tc;
+    pthread_mutex_init(&q.ckptlock, 0);
+    q.last = time(0);
+    Topology topo;
+    if (opts->numa) {
+        readtopology(&topo);
+        q.topo = &topo;
+    }
+    int nthreads = opts->nthreads > 0 ? opts->nthreads : ncpus();
+    if (nthreads > q.ntiles) nthreads = q.ntiles > 0 ? q.ntiles : 1;
+    TileJob *jobs = xcalloc(&_alloc, nthreads, sizeof(TileJob));
+    for (int t = 0; t < nthreads; t++)
+        jobs[t].q = &q;
+    splitbands(&q, jobs, nthreads);
+    if (q.topo)
+        pthread_barrier_init(&q.ready, 0, nthreads);
+    if (nthreads == 1 && !q.topo)
+        tilejob(&jobs[0]);
+    else {
+        Pool *pool = newpool(nthreads);
+        for (int t = 0; t < nthreads; t++)
+            poolsubmit(pool, tilejob, &jobs[t]);
+        poolwait(pool);
+        freepool(pool);
+    }
+    RenderStats total = {0};
+    for (int t = 0; t < nthreads; t++) {
+        addstats(&total, &jobs[t].w.stats);
+        freeworker(&jobs[t].w);
+    }
+    total.time = now() - start;
+    if (stats)
+        *stats = total;
+    for (int b = 0; b < q.nbands; b++)
+        freereplicas(&q, &q.bands[b]);
+    xfree(q.bands);
+    xfree(jobs);
+    if (q.topo) {
+        pthread_barrier_destroy(&q.ready);
+        freetopology(&topo);
+    }
+    pthread_mutex_destroy(&q.ckptlock);
+    freetilecull(&tc);
+}
+
+void renderscene(Bitmap *bmp, Scene *scene, RenderOpts *opts, RenderStats *stats) {
+    Frame f = {0};
+    if (opts->gbuffer)
+        f.gb = opengbuffer(opts->gbuffer, scene, bmp->width, bmp->height);
+    int ts = opts->tilesize;
+    int ntiles = tilecount(bmp, ts);
+    unsigned char *done = xcalloc(&_alloc, ntiles, 1);
+    if (opts->ckptfile && opts->resume
+            && loadcheckpoint(opts->ckptfile, opts->ckptkey, bmp, ts, done, ntiles)) {
+        int ndone = 0;
+        for (int i = 0; i < ntiles; i++)
+            ndone += done[i];
+        printf("resuming: %i/%i tiles done\n", ndone, ntiles);
+    }
+    tileloop(bmp, scene, opts, &f, done, stats);
+    if (opts->ckptfile)
+        removecheckpoint(opts->ckptfile);
+    if (f.gb) {
+        savegbuffer(f.gb, scene);
+        freegbuffer(f.gb);
+    }
+    xfree(done);
+}
+
+void rendertiles(Bitmap *bmp, Scene *scene, RenderOpts *opts, Frame *f,
+        unsigned char *todo, RenderStats *stats) {
+    RenderOpts o = *opts;
+    o.ckptfile = 0;
+    int ntiles = tilecount(bmp, o.tilesize);
+    unsigned char *done = xmalloc(&_alloc, ntiles);
+    for (int i = 0; i < ntiles; i++)
+        done[i] = !todo[i];
+    tileloop(bmp, scene, &o, f, done, stats);
+    xfree(done);
+}
+
+void printstats(RenderStats *st, FILE *f) {
+    unsigned long tests = st->occludertests;
+    fprintf(f, "{\n");
+    fprintf(f, "  \"time\": %.3f,\n", st->time);
+    fprintf(f, "  \"rays\": {\"primary\": %lu, \"shadow\": %lu, \"reflection\": %lu},\n",
+            st->primaryrays, st->shadowrays, st->reflectionrays);
+    fprintf(f, "  \"occluder_cache\": {\"tests\": %lu, \"hits\": %lu, \"hit_rate\": %.4f},\n",
+            tests, st->occluderhits, tests ? (double)st->occluderhits / tests : 0.0);
+    fprintf(f, "  \"tile_cull\": {\"tiles\": %lu, \"shapes_per_tile\": %.2f},\n",
+            st->culltiles, st->culltiles ? (double)st->cullshapes / st->culltiles : 0.0);
+    MeshCacheStats mc;
+    meshcachestats(&mc);
+    fprintf(f, "  \"mesh_cache\": {\"budget\": %lu, \"used\": %lu, \"hits\": %lu, \"misses\": %lu, \"evictions\": %lu},\n",
+            mc.budget, mc.used, mc.hits, mc.misses, mc.evictions);
+    CompactStats cs;
+    compactstats(&cs);
+    fprintf(f, "  \"compact\": {\"meshes\": %lu, \"before\": %lu, \"after\": %lu, \"saved\": %.4f},\n",
+            cs.meshes, cs.before, cs.after, cs.before ? ((double)cs.before - cs.after) / cs.before : 0.0);
+    OptStats os;
+    optstats(&os);
+    fprintf(f, "  \"obj_opt\": {\"objs\": %lu, \"welded\": %lu, \"dropped\": %lu, \"lod_before\": %lu, \"lod_after\": %lu},\n",
+            os.objs, os.welded, os.dropped, os.lodbefore, os.lodafter);
+    fprintf(f, "  \"memory\": ");
+    memjson(f, "  ");
+    fprintf(f, "\n}\n");
+}
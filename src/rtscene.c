@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <raytracer/math.h>
+#include <raytracer/obj.h>
+#include <raytracer/raytracer.h>
+#include <raytracer/conf.h>
+#include <raytracer/scene.h>
+#include <raytracer/stream.h>
+#include <raytracer/lazy.h>
+#include <raytracer/util.h>
+
+#define RTSCENE_MAGIC "RTSC"
+#define RTSCENE_VERSION 4
+#define RTSCENE_EXT ".rtscene"
+#define ALIGN 16
+
+static Allocator _alloc = {"rtscene"};
+
+// File layout: header, then at the offsets it gives one kind byte per
+// shape in scene order, the spheres and planes as their runtime structs
+// with no methods set, one MeshRec per mesh, the lights as Light structs
+// and the strings. The structs are this build's, the header records
+// their sizes and other builds refuse the file.
+typedef struct {
+    char magic[4];
+    unsigned version;
+    int spheresize, planesize, lightsize, meshsize;
+    int width, height;
+    float vfov;
+    Vec3 background;
+    float lightcutoff;
+    int lightsamples;
+    unsigned seed;
+    float meshcache;
+    int accel;
+    int nshapes, nspheres, nplanes, nmeshes, nlights;
+    unsigned viewkey, lightkey;
+    // into the strings
+    long long output;
+    long long kinds, spheres, planes, meshes, lights, strings;
+    long long nstrings;
+} SceneHdr;
+
+// A MeshDesc with its file as an offset into the strings. Streamed
+// meshes name their .rtmesh and lazy meshes carry their bounds, so
+// neither touches the OBJ on load.
+typedef struct {
+    long long objfile;
+    int stream, lazy, compact, smooth, lodcells;
+    int hasbox;
+    Aabb box;
+    Vec3 position;
+    int hasmat;
+    Material mat;
+    unsigned key;
+} MeshRec;
+
+static int endswith(const char *s, const char *end) {
+    int n = strlen(s), m = strlen(end);
+    return n >= m && strcmp(s + n - m, end) == 0;
+}
+
+int isrtscene(const char *file) {
+    return endswith(file, RTSCENE_EXT);
+}
+
+typedef struct {
+    char *data;
+    long long size;
+} Buf;
+
+static long long push(Buf *b, const void *data, long long size) {
+    long long at = b->size;
+    b->data = xrealloc(&_alloc, b->data, at + size);
+    memcpy(b->data + at, data, size);
+    b->size += size;
+    return at;
+}
+
+static long long pushstr(Buf *b, const char *str) {
+    return push(b, str, strlen(str) + 1);
+}
+
+static long long align(long long off) {
+    return (off + ALIGN - 1) / ALIGN * ALIGN;
+}
+
+// Resolves what loading the mesh would otherwise have to work out from
+// the OBJ.
+static void bakemesh(MeshDesc *d, MeshRec *rec, Buf *strs) {
+    memset(rec, 0, sizeof(MeshRec));
+    picklod(d);
+    const char *file = d->objfile;
+    MeshStream *ms = 0;
+    if (d->stream) {
+        ms = openmeshstream(file);
+        if (!ms) err("compile: can't stream %s", file);
+        file = ms->file;
+    }
+    else if (d->lazy && !d->hasbox && !loadbounds(file, &d->box)) {
+        Obj *o = loadobj(file);
+        if (!o) err("compile: can't load %s", file);
+        savebounds(file, o, &d->box);
+        freeobj(o);
+    }
+    rec->objfile = pushstr(strs, file);
+    if (ms) freemeshstream(ms);
+    rec->stream = d->stream;
+    rec->lazy = d->lazy;
+    rec->compact = d->compact;
+    rec->smooth = d->smooth;
+    rec->lodcells = d->lodcells;
+    rec->hasbox = d->lazy;
+    rec->box = d->box;
+    rec->position = d->position;
+    rec->hasmat = d->hasmat;
+    rec->mat = d->mat;
+    rec->key = d->key;
+}
+
+void writertscene(const char *conffile, const char *file) {
+    Conf *conf = parseconf(conffile);
+    if (!conf) err("compile: can't read %s", conffile);
+    Scene *s = newscene(0);
+    if (!loadview(s, conf)) err("compile: bad settings in %s", conffile);
+    loadlights(s, conf);
+    Buf kinds = {0}, spheres = {0}, planes = {0}, meshes = {0}, lights = {0}, strs = {0};
+    SceneHdr hdr = {{0}};
+    hdr.output = pushstr(&strs, s->output);
+    ConfVal *entries = confobjget(conf->root, "shapes");
+    int nentries = confarrsize(entries);
+    for (int i = 0; i < nentries; i++) {
+        ConfVal *entry = confarrget(entries, i);
+        MeshDesc d;
+        unsigned char kind;
+        if (meshdesc(s, entry, &d)) {
+            MeshRec rec;
+            bakemesh(&d, &rec, &strs);
+            push(&meshes, &rec, sizeof(rec));
+            kind = SHAPE_MESH;
+            hdr.nmeshes++;
+        }
+        else {
+            Shape *sh = mkshape(s, entry);
+            if (!sh) continue;
+            kind = sh->type;
+            sh->test = 0;
+            sh->finalize = 0;
+            if (kind == SHAPE_SPHERE) {
+                push(&spheres, sh, sizeof(ShapeSphere));
+                hdr.nspheres++;
+            }
+            else if (kind == SHAPE_PLANE) {
+                push(&planes, sh, sizeof(ShapePlane));
+                hdr.nplanes++;
+            }
+            freeshape(sh);
+        }
+        push(&kinds, &kind, 1);
+        hdr.nshapes++;
+    }
+    for (int i = 0; i < s->nlights; i++)
+        push(&lights, s->lights[i], sizeof(Light));
+    memcpy(hdr.magic, RTSCENE_MAGIC, 4);
+    hdr.version = RTSCENE_VERSION;
+    hdr.spheresize = sizeof(ShapeSphere);
+    hdr.planesize = sizeof(ShapePlane);
+    hdr.lightsize = sizeof(Light);
+    hdr.meshsize = sizeof(MeshRec);
+    hdr.width = s->width;
+    hdr.height = s->height;
+    hdr.vfov = s->vfov;
+    hdr.background = s->background;
+    hdr.lightcutoff = s->lightcutoff;
+    hdr.lightsamples = s->lightsamples;
+    hdr.seed = s->seed;
+    hdr.meshcache = s->meshcache;
+    hdr.accel = s->accel;
+    hdr.nlights = s->nlights;
+    hdr.viewkey = s->viewkey;
+    hdr.lightkey = s->lightkey;
+    Buf *secs[] = {&kinds, &spheres, &planes, &meshes, &lights, &strs};
+    long long *offs[] = {&hdr.kinds, &hdr.spheres, &hdr.planes, &hdr.meshes, &hdr.lights, &hdr.strings};
+    long long off = sizeof(hdr);
+    for (int i = 0; i < 6; i++) {
+        off = align(off);
+        *offs[i] = off;
+        off += secs[i]->size;
+    }
+    hdr.nstrings = strs.size;
+    char tmp[1100];
+    FILE *f = opentemp(file, tmp, sizeof(tmp));
+    if (!f) err("compile: can't write %s", file);
+    int ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    static const char zeros[ALIGN];
+    for (int i = 0; ok && i < 6; i++) {
+        long long pad = *offs[i] - ftell(f);
+        ok = fwrite(zeros, 1, pad, f) == pad
+                && fwrite(secs[i]->data, 1, secs[i]->size, f) == secs[i]->size;
+    }
+    if (!closetemp(f, tmp, file, ok))
+        err("compile: failed to write %s", file);
+    printf("compile: %i shapes, %i lights into %s\n", hdr.nshapes, hdr.nlights, file);
+    for (int i = 0; i < 6; i++)
+        xfree(secs[i]->data);
+    freescene(s);
+    freeconf(conf);
+}
+
+static int fits(unsigned long size, long long off, long long n, int elem) {
+    return off >= (long long)sizeof(SceneHdr) && n >= 0 && off + n * elem <= (long long)size;
+}
+
+// Kinds have to add up to the counts and name what's at their index,
+// mesh records have to point into the strings.
+static int checkrecords(char *map, SceneHdr *hdr) {
+    MeshRec *recs = (MeshRec *)(map + hdr->meshes);
+    for (int i = 0; i < hdr->nmeshes; i++)
+        if (recs[i].objfile < 0 || recs[i].objfile >= hdr->nstrings) return 0;
+    unsigned char *kinds = (unsigned char *)(map + hdr->kinds);
+    ShapeSphere *spheres = (ShapeSphere *)(map + hdr->spheres);
+    ShapePlane *planes = (ShapePlane *)(map + hdr->planes);
+    int nsp = 0, npl = 0, nme = 0;
+    for (int i = 0; i < hdr->nshapes; i++) {
+        if (kinds[i] == SHAPE_SPHERE && nsp < hdr->nspheres) {
+            if (spheres[nsp++].shape.type != SHAPE_SPHERE) return 0;
+        }
+        else if (kinds[i] == SHAPE_PLANE && npl < hdr->nplanes) {
+            if (planes[npl++].shape.type != SHAPE_PLANE) return 0;
+        }
+        else if (kinds[i] == SHAPE_MESH && nme < hdr->nmeshes)
+            nme++;
+        else
+            return 0;
+    }
+    return 1;
+}
+
+// Spheres, planes and lights are used where they lie in the private
+// mapping, setting their methods and ids only copies the pages touched.
+// The whole file is checked before anything is built from it.
+Scene *loadrtscene(const char *file) {
+    int fd = open(file, O_RDONLY);
+    if (fd < 0) {
+        printf("rtscene: can't open %s\n", file);
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (long)sizeof(SceneHdr)) {
+        close(fd);
+        printf("rtscene: %s is truncated\n", file);
+        return 0;
+    }
+    unsigned long size = st.st_size;
+    char *map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("rtscene: can't map %s\n", file);
+        return 0;
+    }
+    SceneHdr *hdr = (SceneHdr *)map;
+    const char *bad = 0;
+    if (memcmp(hdr->magic, RTSCENE_MAGIC, 4) != 0 || hdr->version != RTSCENE_VERSION)
+        bad = "isn't a scene file";
+    else if (hdr->spheresize != sizeof(ShapeSphere) || hdr->planesize != sizeof(ShapePlane)
+            || hdr->lightsize != sizeof(Light) || hdr->meshsize != sizeof(MeshRec))
+        bad = "was written by another build, compile it again";
+    else if (hdr->nspheres + hdr->nplanes + hdr->nmeshes != hdr->nshapes
+            || !fits(size, hdr->kinds, hdr->nshapes, 1)
+            || !fits(size, hdr->spheres, hdr->nspheres, sizeof(ShapeSphere))
+            || !fits(size, hdr->planes, hdr->nplanes, sizeof(ShapePlane))
+            || !fits(size, hdr->meshes, hdr->nmeshes, sizeof(MeshRec))
+            || !fits(size, hdr->lights, hdr->nlights, sizeof(Light))
+            || !fits(size, hdr->strings, hdr->nstrings, 1)
+            || hdr->nstrings < 1 || map[hdr->strings + hdr->nstrings - 1] != 0
+            || hdr->output < 0 || hdr->output >= hdr->nstrings
+            || !checkrecords(map, hdr))
+        bad = "is corrupt";
+    if (bad) {
+        printf("rtscene: %s %s\n", file, bad);
+        munmap(map, size);
+        return 0;
+    }
+    char *strs = map + hdr->strings;
+    Scene *s = newscene(0);
+    s->map = map;
+    s->mapsize = size;
+    s->width = hdr->width;
+    s->height = hdr->height;
+    s->output = xstrdup(&_alloc, strs + hdr->output);
+    s->vfov = hdr->vfov;
+    s->aspect = (float)s->width / s->height;
+    s->background = hdr->background;
+    s->lightcutoff = hdr->lightcutoff;
+    s->lightsamples = hdr->lightsamples;
+    s->seed = hdr->seed;
+    s->meshcache = hdr->meshcache;
+    s->accel = hdr->accel;
+    if (s->meshcache > 0)
+        setmeshcache(s->meshcache * (1 << 20));
+    s->viewkey = hdr->viewkey;
+    s->lightkey = hdr->lightkey;
+
+    // meshes first, they build on the pool while the rest is bound
+    MeshRec *recs = (MeshRec *)(map + hdr->meshes);
+    ShapeLoad ld;
+    initshapeload(&ld, hdr->nmeshes);
+    for (int i = 0; i < hdr->nmeshes; i++) {
+        MeshRec *rec = &recs[i];
+        ld.descs[i] = (MeshDesc){
+            strs + rec->objfile, rec->stream, rec->lazy, rec->compact, rec->smooth,
+            rec->lodcells, rec->hasbox, rec->box, rec->position, rec->hasmat, rec->mat, rec->key,
+        };
+    }
+    startmeshes(&ld);
+
+    Light *lights = (Light *)(map + hdr->lights);
+    s->nlights = hdr->nlights;
+    s->lights = xmalloc(&_alloc, (s->nlights ? s->nlights : 1) * sizeof(Light *));
+    for (int i = 0; i < s->nlights; i++) {
+        s->lights[i] = &lights[i];
+        lights[i].id = i;
+    }
+    unsigned char *kinds = (unsigned char *)(map + hdr->kinds);
+    ShapeSphere *spheres = (ShapeSphere *)(map + hdr->spheres);
+    ShapePlane *planes = (ShapePlane *)(map + hdr->planes);
+    s->shapes = xmalloc(&_alloc, (hdr->nshapes ? hdr->nshapes : 1) * sizeof(Shape *));
+    int nsp = 0, npl = 0;
+    for (int i = 0; i < hdr->nshapes; i++) {
+        Shape *sh = 0;
+        if (kinds[i] == SHAPE_SPHERE)
+            sh = AS_SHAPE(&spheres[nsp++]);
+        else if (kinds[i] == SHAPE_PLANE)
+            sh = AS_SHAPE(&planes[npl++]);
+        if (sh) bindshape(sh);
+        s->shapes[i] = sh;
+    }
+    finishshapes(&ld);
+    // a mesh whose file went missing fails the scene, as it would a conf
+    if (!meshesloaded(&ld)) {
+        for (int k = 0; k < hdr->nmeshes; k++)
+            if (ld.shapes[k]) freeshape(ld.shapes[k]);
+        freeshapeload(&ld);
+        printf("scene: %s failed to load\n", file);
+        freescene(s);
+        return 0;
+    }
+    for (int i = 0, k = 0; i < hdr->nshapes; i++) {
+        if (kinds[i] == SHAPE_MESH)
+            s->shapes[i] = ld.shapes[k++];
+        s->shapes[i]->id = i;
+    }
+    s->nshapes = hdr->nshapes;
+    freeshapeload(&ld);
+    s->dirty = 1;
+    compilescene(s);
+    return s;
+}
+
+void unmaprtscene(Scene *s) {
+    munmap(s->map, s->mapsize);
+    s->map = 0;
+    s->mapsize = 0;
+}
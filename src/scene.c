@@ -1,24 +1,49 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <float.h>
+#include <unistd.h>
 #include <raytracer/math.h>
 #include <raytracer/obj.h>
 #include <raytracer/raytracer.h>
 #include <raytracer/conf.h>
+#include <raytracer/util.h>
+#include <raytracer/stream.h>
+#include <raytracer/lazy.h>
+#include <raytracer/pool.h>
+#include <raytracer/scene.h>
+#include <raytracer/tracing.h>
+
+static Allocator _alloc = {"scene"};
 
 void addshape(Scene *s, Shape *shape) {
     s->nshapes++;
-    s->shapes = realloc(s->shapes, s->nshapes * sizeof(Shape *));
+    s->shapes = xrealloc(&_alloc, s->shapes, s->nshapes * sizeof(Shape *));
     s->shapes[s->nshapes - 1] = shape;
+    shape->id = s->nshapes - 1;
+    s->dirty = 1;
+}
+
+void compilescene(Scene *s) {
+    if (!s->dirty) return;
+    tracebegin("build accel", 0);
+    buildbatches(&s->batches, s->shapes, s->nshapes);
+    if (s->accel == ACCEL_GRID)
+        s->batches.grid = newgrid(&s->batches);
+    buildlighttree(&s->lighttree, s->lights, s->nlights);
+    s->dirty = 0;
+    traceend();
 }
 
-static void addlight(Scene *s, Light *light) {
+void addlight(Scene *s, Light *light) {
     s->nlights++;
-    s->lights = realloc(s->lights, s->nlights * sizeof(Light *));
+    s->lights = xrealloc(&_alloc, s->lights, s->nlights * sizeof(Light *));
     s->lights[s->nlights - 1] = light;
+    light->id = s->nlights - 1;
+    s->dirty = 1;
 }
 
-static Vec3 getvec(ConfVal *obj, const char *name) {
-    ConfVal *val = confobjget(obj, name);
+static Vec3 arrvec(ConfVal *val) {
     if (!val || val->type != CONF_ARR || confarrsize(val) != 3)
         return vec3(0, 0, 0);
     return vec3(
@@ -27,100 +52,475 @@ static Vec3 getvec(ConfVal *obj, const char *name) {
         confarrgetnum(val, 2, 0));
 }
 
+static Vec3 getvec(ConfVal *obj, const char *name) {
+    return arrvec(confobjget(obj, name));
+}
+
+// "bounds": [[minx, miny, minz], [maxx, maxy, maxz]], in object space
+static int getbox(ConfVal *obj, Aabb *box) {
+    ConfVal *val = confobjget(obj, "bounds");
+    if (!val || val->type != CONF_ARR || confarrsize(val) != 2)
+        return 0;
+    box->min = arrvec(confarrget(val, 0));
+    box->max = arrvec(confarrget(val, 1));
+    return 1;
+}
+
+// Bounds for a lazy mesh from the desc or the cached header, parses
+// the OBJ right away only when there are none yet.
+static ShapeMesh *mklazymesh(MeshDesc *d) {
+    Aabb box = d->box;
+    // the OBJ is only read on the first hit, missing it has to show now
+    if (access(d->objfile, R_OK) != 0) {
+        printf("mesh: can't read %s\n", d->objfile);
+        return 0;
+    }
+    if (d->hasbox || loadbounds(d->objfile, &box))
+        return newlazymesh(newlazy(box, lazykey(d->objfile)), 0);
+    Obj *obj = shareobj(d->objfile, 0);
+    if (!obj) return 0;
+    savebounds(d->objfile, obj, &box);
+    return newlazymesh(newlazy(box, lazykey(d->objfile)), obj);
+}
+
 static void loadmaterial(Material *m, ConfVal *obj) {
     m->diffuse = getvec(obj, "diffuse");
     m->reflectiveness = confobjgetnum(obj, "reflectiveness", 0);
 }
 
-static void loadshape(Scene *s, ConfVal *shape) {
-    if (shape->type != CONF_OBJ) return;
+// Rows on screen the bounding sphere of box covers at position, seen
+// from the camera at the origin.
+static float screenrows(MeshDesc *d, Aabb *box) {
+    Vec3 c = vadd(vmul(vadd(box->min, box->max), 0.5), d->position);
+    float r = vmag(vsub(box->max, box->min)) / 2, dist = vmag(c);
+    if (dist <= r) return FLT_MAX;
+    return r / sqrtf(dist * dist - r * r) / tanf(d->vfov * M_PI / 360) * d->height;
+}
+
+// "lods": [{"pixels": 60, "objfile": "far.obj"}, {"pixels": 20, "cells": 8}]
+// A level is used while the mesh covers fewer than pixels rows, the one
+// with the fewest that still applies wins. It's either another OBJ or
+// this one simplified to cells. Bounds come from the base OBJ, which may
+// have to be parsed for them, so this runs with the mesh's job.
+void picklod(MeshDesc *d) {
+    ConfVal *lods = d->lods;
+    d->lods = 0;
+    if (!confarrsize(lods)) return;
+    const char *base = d->objfile;
+    Aabb box = d->box;
+    if (!d->hasbox && !loadbounds(base, &box)) {
+        Obj *obj = loadobj(base);
+        if (!obj) return;
+        savebounds(base, obj, &box);
+        freeobj(obj);
+    }
+    float rows = screenrows(d, &box);
+    float best = FLT_MAX;
+    for (int i = 0; i < confarrsize(lods); i++) {
+        ConfVal *lod = confarrget(lods, i);
+        float pixels = confobjgetnum(lod, "pixels", 0);
+        if (rows >= pixels || pixels >= best) continue;
+        const char *objfile = confobjgetstr(lod, "objfile", 0);
+        int cells = confobjgetnum(lod, "cells", 0);
+        if (!objfile && cells <= 0) continue;
+        best = pixels;
+        d->objfile = objfile ? objfile : base;
+        d->lodcells = objfile ? 0 : cells;
+    }
+    // "bounds" are the base OBJ's, another file brings its own
+    if (d->objfile != base)
+        d->hasbox = 0;
+    // generated levels are small, they load as plain meshes
+    if (d->lodcells)
+        d->stream = d->lazy = 0;
+}
+
+int meshdesc(Scene *s, ConfVal *shape, MeshDesc *d) {
+    memset(d, 0, sizeof(MeshDesc));
+    if (shape->type != CONF_OBJ) return 0;
+    if (strcmp(confobjgetstr(shape, "type", ""), "mesh") != 0) return 0;
+    d->objfile = confobjgetstr(shape, "objfile", 0);
+    if (!d->objfile) return 0;
+    d->stream = confobjgetnum(shape, "stream", 0);
+    d->lazy = confobjgetnum(shape, "lazy", 0);
+    d->compact = confobjgetnum(shape, "compact", 0);
+    // vn normals are interpolated unless turned off
+    d->smooth = confobjgetnum(shape, "smooth", 1);
+    d->hasbox = getbox(shape, &d->box);
+    d->position = getvec(shape, "position");
+    ConfVal *material = confobjget(shape, "material");
+    if (material) {
+        d->hasmat = 1;
+        loadmaterial(&d->mat, material);
+    }
+    d->key = confhash(shape);
+    d->lods = confobjget(shape, "lods");
+    d->vfov = s->vfov;
+    d->height = s->height;
+    return 1;
+}
+
+ShapeMesh *mkmesh(MeshDesc *d) {
+    ShapeMesh *mesh;
+    picklod(d);
+    if (d->lodcells) {
+        Obj *obj = shareobj(d->objfile, d->lodcells);
+        if (!obj) return 0;
+        mesh = newmesh(obj);
+    }
+    else if (d->stream) {
+        MeshStream *ms = openmeshstream(d->objfile);
+        if (!ms) return 0;
+        mesh = newmeshstream(ms);
+    }
+    else if (d->lazy) {
+        mesh = mklazymesh(d);
+        if (!mesh) return 0;
+    }
+    else {
+        Obj *obj = shareobj(d->objfile, 0);
+        if (!obj) return 0;
+        mesh = newmesh(obj);
+    }
+    mesh->objfile = xstrdup(&_alloc, d->objfile);
+    mesh->smooth = d->smooth;
+    shapetranslate(AS_SHAPE(mesh), d->position);
+    if (d->compact) {
+        if (mesh->lazy && !mesh->lazy->loaded)
+            mesh->lazy->compact = 1;
+        else
+            compactmesh(mesh);
+    }
+    if (d->hasmat)
+        mesh->shape.mat = d->mat;
+    mesh->shape.key = d->key;
+    return mesh;
+}
+
+Shape *mkshape(Scene *scene, ConfVal *shape) {
+    if (shape->type != CONF_OBJ) return 0;
     const char *type = confobjgetstr(shape, "type", "");
-    // const char *objfile = confobjgetstr(shape, "objfile", "");
+    Shape *s = 0;
     if (strcmp(type, "sphere") == 0) {
         Vec3 position = getvec(shape, "position");
         float radius = confobjgetnum(shape, "radius", 1);
-        ShapeSphere *sphere = newsphere(position, radius);
-        addshape(s, AS_SHAPE(sphere));
-        ConfVal *material = confobjget(shape, "material");
-        if (material)
-            loadmaterial(&sphere->shape.mat, material);
+        s = AS_SHAPE(newsphere(position, radius));
     }
     else if (strcmp(type, "plane") == 0) {
         Vec3 point = getvec(shape, "point");
         Vec3 normal = getvec(shape, "normal");
-        ShapePlane *plane = newplane(point, normal);
-        addshape(s, AS_SHAPE(plane));
-        ConfVal *material = confobjget(shape, "material");
-        if (material)
-            loadmaterial(&plane->shape.mat, material);
+        s = AS_SHAPE(newplane(point, normal));
     }
     else if (strcmp(type, "mesh") == 0) {
-        const char *objfile = confobjgetstr(shape, "objfile", 0);
-        if (!objfile) return;
-        Obj *obj = newobj(objfile);
-        if (!obj) return;
-        ShapeMesh *mesh = newmesh(obj);
-        Vec3 position = getvec(shape, "position");
-        shapetranslate(AS_SHAPE(mesh), position);
-        addshape(s, AS_SHAPE(mesh));
-        ConfVal *material = confobjget(shape, "material");
-        if (material)
-            loadmaterial(&mesh->shape.mat, material);
+        MeshDesc d;
+        if (!meshdesc(scene, shape, &d)) return 0;
+        return AS_SHAPE(mkmesh(&d));
     }
+    if (!s) return 0;
+    ConfVal *material = confobjget(shape, "material");
+    if (material)
+        loadmaterial(&s->mat, material);
+    s->key = confhash(shape);
+    return s;
+}
+
+typedef struct {
+    ShapeLoad *ld;
+    int first;
+} MeshJob;
+
+static void meshjob(void *arg) {
+    MeshJob *job = arg;
+    ShapeLoad *ld = job->ld;
+    for (int i = job->first; i >= 0; i = ld->next[i])
+        ld->shapes[i] = AS_SHAPE(mkmesh(&ld->descs[i]));
+    xfree(job);
+}
+
+void initshapeload(ShapeLoad *ld, int n) {
+    ld->n = n;
+    ld->descs = xcalloc(&_alloc, n ? n : 1, sizeof(MeshDesc));
+    ld->shapes = xcalloc(&_alloc, n ? n : 1, sizeof(Shape *));
+    ld->next = xmalloc(&_alloc, (n ? n : 1) * sizeof(int));
+    ld->pool = 0;
+}
+
+void startmeshes(ShapeLoad *ld) {
+    // last entry so far of every OBJ file
+    int *tails = xmalloc(&_alloc, (ld->n ? ld->n : 1) * sizeof(int));
+    MeshJob **jobs = xmalloc(&_alloc, (ld->n ? ld->n : 1) * sizeof(MeshJob *));
+    int nfiles = 0;
+    for (int i = 0; i < ld->n; i++) {
+        ld->next[i] = -1;
+        const char *file = ld->descs[i].objfile;
+        if (!file) continue;
+        int k = 0;
+        while (k < nfiles && strcmp(ld->descs[tails[k]].objfile, file) != 0)
+            k++;
+        if (k < nfiles) ld->next[tails[k]] = i;
+        else {
+            if (!ld->pool && poolcpus() > 1) ld->pool = newpool(0);
+            MeshJob *job = xmalloc(&_alloc, sizeof(MeshJob));
+            job->ld = ld;
+            job->first = i;
+            jobs[nfiles++] = job;
+            if (ld->pool) poolsubmit(ld->pool, meshjob, job);
+        }
+        tails[k] = i;
+    }
+    // without a pool the chains are complete only now
+    if (!ld->pool)
+        for (int k = 0; k < nfiles; k++)
+            meshjob(jobs[k]);
+    xfree(jobs);
+    xfree(tails);
+}
+
+// Meshes go to the pool, everything else is built right away.
+static void startshapes(Scene *s, ShapeLoad *ld, ConfVal **entries, int n) {
+    initshapeload(ld, n);
+    for (int i = 0; i < n; i++)
+        meshdesc(s, entries[i], &ld->descs[i]);
+    startmeshes(ld);
+    for (int i = 0; i < n; i++)
+        if (!ld->descs[i].objfile)
+            ld->shapes[i] = mkshape(s, entries[i]);
 }
 
+int meshesloaded(ShapeLoad *ld) {
+    for (int i = 0; i < ld->n; i++)
+        if (ld->descs[i].objfile && !ld->shapes[i]) return 0;
+    return 1;
+}
+
+void finishshapes(ShapeLoad *ld) {
+    if (!ld->pool) return;
+    // time the loading thread sits idle on slow meshes
+    tracebegin("wait meshes", 0);
+    poolwait(ld->pool);
+    traceend();
+    freepool(ld->pool);
+    ld->pool = 0;
+}
+
+void freeshapeload(ShapeLoad *ld) {
+    xfree(ld->descs);
+    xfree(ld->shapes);
+    xfree(ld->next);
+}
 static void loadlight(Scene *s, ConfVal *light) {
     Vec3 position = getvec(light, "position");
     float intensity = confobjgetnum(light, "intensity", 1);
-    Light *l = malloc(sizeof(Light));
-    memset(l, 0, sizeof(Light));
+    Light *l = xcalloc(&_alloc, 1, sizeof(Light));
     l->pos = position;
     l->intensity = intensity;
     addlight(s, l);
 }
 
-static const char *mkstrcpy(const char *str) {
-    char *cpy = malloc(strlen(str) + 1);
-    strcpy(cpy, str);
-    return cpy;
+// Hash of the top level settings, everything but shapes and lights.
+static unsigned viewkey(Conf *conf) {
+    unsigned key = 0;
+    ConfObj *root = &conf->root->as.obj;
+    if (conf->root->type != CONF_OBJ) return key;
+    for (int i = 0; i < root->nkvs; i++) {
+        const char *name = root->keys[i]->as.str;
+        if (strcmp(name, "shapes") == 0 || strcmp(name, "lights") == 0)
+            continue;
+        key = key * 16777619u ^ confhash(root->keys[i]);
+        key = key * 16777619u ^ confhash(root->vals[i]);
+    }
+    return key;
 }
 
-static void load(Scene *s, Conf *conf) {
+static unsigned lightkey(Conf *conf) {
+    ConfVal *lights = confobjget(conf->root, "lights");
+    return lights ? confhash(lights) : 0;
+}
+
+void loadlights(Scene *s, Conf *conf) {
+    ConfVal *lights = confobjget(conf->root, "lights");
+    int nlights = confarrsize(lights);
+    for (int i = 0; i < nlights; i++)
+        loadlight(s, confarrget(lights, i));
+    s->lightkey = lightkey(conf);
+}
+
+int loadview(Scene *s, Conf *conf) {
+    s->viewkey = viewkey(conf);
     s->width = confobjgetnum(conf->root, "width", 640);
     s->height = confobjgetnum(conf->root, "height", 480);
-    s->output = mkstrcpy(confobjgetstr(conf->root, "output", "out.ppm"));
+    s->output = xstrdup(&_alloc, confobjgetstr(conf->root, "output", "out.ppm"));
     s->vfov = confobjgetnum(conf->root, "vfov", 90);
     s->aspect = (float)s->width / s->height;
     s->background = getvec(conf->root, "background");
+    s->lightcutoff = confobjgetnum(conf->root, "lightcutoff", 0);
+    s->lightsamples = confobjgetnum(conf->root, "lightsamples", 0);
+    s->seed = confobjgetnum(conf->root, "seed", 0);
+    // "none" loops over every sphere, "grid" walks a uniform grid
+    const char *accel = confobjgetstr(conf->root, "accel", "none");
+    if (strcmp(accel, "grid") == 0) s->accel = ACCEL_GRID;
+    else if (strcmp(accel, "none") == 0) s->accel = ACCEL_NONE;
+    else {
+        printf("scene: unknown accel: %s\n", accel);
+        return 0;
+    }
+    s->meshcache = confobjgetnum(conf->root, "meshcache", 0);
+    if (s->meshcache > 0)
+        setmeshcache(s->meshcache * (1 << 20));
+    return 1;
+}
+
+// 0 if the settings are off or a mesh failed, what did load is added
+// to s either way
+static int load(Scene *s, Conf *conf) {
+    if (!loadview(s, conf)) return 0;
     ConfVal *shapes = confobjget(conf->root, "shapes");
     int nshapes = confarrsize(shapes);
+    ConfVal **entries = xmalloc(&_alloc, (nshapes ? nshapes : 1) * sizeof(ConfVal *));
     for (int i = 0; i < nshapes; i++)
-        loadshape(s, confarrget(shapes, i));
-    ConfVal *lights = confobjget(conf->root, "lights");
-    int nlights = confarrsize(lights);
-    for (int i = 0; i < nlights; i++)
-        loadlight(s, confarrget(lights, i));
+        entries[i] = confarrget(shapes, i);
+    ShapeLoad ld;
+    startshapes(s, &ld, entries, nshapes);
+    loadlights(s, conf);
+    finishshapes(&ld);
+    int ok = meshesloaded(&ld);
+    for (int i = 0; i < nshapes; i++)
+        if (ld.shapes[i]) addshape(s, ld.shapes[i]);
+    freeshapeload(&ld);
+    xfree(entries);
+    return ok;
+}
+
+static int meshuses(Shape *shape, const char **objfiles, int nobjfiles) {
+    if (shape->type != SHAPE_MESH) return 0;
+    ShapeMesh *m = (ShapeMesh *)shape;
+    for (int i = 0; i < nobjfiles; i++)
+        if (m->objfile && strcmp(m->objfile, objfiles[i]) == 0)
+            return 1;
+    return 0;
+}
+
+int reloadscene(Scene *s, const char *file, const char **objfiles, int nobjfiles,
+        unsigned char **changed, int *nchanged) {
+    Conf *conf = parseconf(file);
+    if (!conf) return RELOAD_FAILED;
+    int flags = 0;
+    if (viewkey(conf) != s->viewkey) {
+        freeconf(conf);
+        return RELOAD_VIEW;
+    }
+    // shapes, matched up by position and kept if their entry and files
+    // are the same. New ones are all built before s is touched.
+    Shape **old = s->shapes;
+    int nold = s->nshapes;
+    ConfVal *shapes = confobjget(conf->root, "shapes");
+    int nshapes = confarrsize(shapes);
+    ConfVal **entries = xmalloc(&_alloc, (nshapes ? nshapes : 1) * sizeof(ConfVal *));
+    int *keep = xmalloc(&_alloc, (nshapes ? nshapes : 1) * sizeof(int));
+    int nnew = 0;
+    for (int i = 0; i < nshapes; i++) {
+        ConfVal *entry = confarrget(shapes, i);
+        keep[i] = i < nold && old[i] && old[i]->key == confhash(entry)
+                && !meshuses(old[i], objfiles, nobjfiles);
+        if (!keep[i])
+            entries[nnew++] = entry;
+    }
+    ShapeLoad ld;
+    startshapes(s, &ld, entries, nnew);
+    finishshapes(&ld);
+    if (!meshesloaded(&ld)) {
+        for (int k = 0; k < nnew; k++)
+            if (ld.shapes[k]) freeshape(ld.shapes[k]);
+        freeshapeload(&ld);
+        xfree(keep);
+        xfree(entries);
+        freeconf(conf);
+        return RELOAD_FAILED;
+    }
+    if (lightkey(conf) != s->lightkey) {
+        for (int i = 0; i < s->nlights; i++)
+            xfree(s->lights[i]);
+        xfree(s->lights);
+        s->lights = 0;
+        s->nlights = 0;
+        loadlights(s, conf);
+        flags |= RELOAD_LIGHTS;
+    }
+    s->shapes = 0;
+    s->nshapes = 0;
+    // an entry that failed to load shifts the ids after it, so nothing
+    // after it is kept
+    int shifted = 0;
+    for (int i = 0, k = 0; i < nshapes; i++) {
+        Shape *sh;
+        if (keep[i] && !shifted) {
+            sh = old[i];
+            old[i] = 0;
+        }
+        else if (keep[i])
+            sh = mkshape(s, confarrget(shapes, i));
+        else
+            sh = ld.shapes[k++];
+        if (sh) addshape(s, sh);
+        else shifted = 1;
+    }
+    freeshapeload(&ld);
+    xfree(keep);
+    xfree(entries);
+    int n = nold > s->nshapes ? nold : s->nshapes;
+    *changed = xcalloc(&_alloc, n ? n : 1, 1);
+    *nchanged = n;
+    for (int i = 0; i < n; i++) {
+        if (i < nold && !old[i]) continue;
+        (*changed)[i] = 1;
+        flags |= RELOAD_SHAPES;
+    }
+    for (int i = 0; i < nold; i++)
+        if (old[i]) freeshape(old[i]);
+    xfree(old);
+    freeconf(conf);
+    compilescene(s);
+    return flags;
 }
 
 Scene *newscene(const char *file) {
-    Scene *s = malloc(sizeof(Scene));
-    memset(s, 0, sizeof(Scene));
+    if (file && isrtscene(file))
+        return loadrtscene(file);
+    Scene *s = xcalloc(&_alloc, 1, sizeof(Scene));
     if (!file) return s;
     Conf *conf = parseconf(file);
-    if (!conf) return s;
+    if (!conf) {
+        freescene(s);
+        return 0;
+    }
     dumpconf(conf);
-    load(s, conf);
+    int ok = load(s, conf);
     freeconf(conf);
+    if (!ok) {
+        printf("scene: %s failed to load\n", file);
+        freescene(s);
+        return 0;
+    }
+    compilescene(s);
     return s;
 }
 
+static int inmap(Scene *s, void *p) {
+    char *c = p, *map = s->map;
+    return map && c >= map && c < map + s->mapsize;
+}
+
 void freescene(Scene *s) {
-    free((void *)s->output);
+    xfree((void *)s->output);
     for (int i = 0; i < s->nshapes; i++)
-        freeshape(s->shapes[i]);
-    if (s->shapes) free(s->shapes);
+        if (!inmap(s, s->shapes[i])) freeshape(s->shapes[i]);
+    xfree(s->shapes);
+    freebatches(&s->batches);
     for (int i = 0; i < s->nlights; i++)
-        free(s->lights[i]);
-    if (s->lights) free(s->lights);
-    free(s);
+        if (!inmap(s, s->lights[i])) xfree(s->lights[i]);
+    xfree(s->lights);
+    freelighttree(&s->lighttree);
+    if (s->map)
+        unmaprtscene(s);
+    xfree(s);
 }
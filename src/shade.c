@@ -0,0 +1,227 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <stdio.h>
+#include <raytracer/math.h>
+#include <raytracer/obj.h>
+#include <raytracer/raytracer.h>
+#include <raytracer/render.h>
+#include <raytracer/shade.h>
+#include <raytracer/util.h>
+
+static Allocator _alloc = {"worker"};
+
+static float clamp(float f, float min, float max) {
+    return f < min ? min : (f > max ? max : f);
+}
+
+static float torad(float deg) {
+    return deg * PI / 180.0;
+}
+
+static Vec3 vclamp(Vec3 v) {
+    return vec3(clamp(v.x, 0, 1), clamp(v.y, 0, 1), clamp(v.z, 0, 1));
+}
+
+void rngseed(Rng *rng, unsigned seed, unsigned pixel) {
+    rng->seed = seed;
+    rng->pixel = pixel;
+}
+
+// PCG output permutation of one LCG step
+static unsigned pcghash(unsigned v) {
+    unsigned state = v * 747796405u + 2891336453u;
+    unsigned word = ((state >> ((state >> 28) + 4)) ^ state) * 277803737u;
+    return (word >> 22) ^ word;
+}
+
+float rngfloat(Rng *rng, unsigned sample, unsigned bounce) {
+    unsigned h = pcghash(rng->seed);
+    h = pcghash(h ^ rng->pixel);
+    h = pcghash(h ^ sample);
+    h = pcghash(h ^ bounce);
+    return (h >> 8) / 16777216.0f;
+}
+
+void initworker(Worker *w, Scene *s) {
+    memset(w, 0, sizeof(Worker));
+    int npicks = s->nlights > s->lightsamples ? s->nlights : s->lightsamples;
+    w->occluders = xcalloc(&_alloc, s->nlights ? s->nlights : 1, sizeof(Shape *));
+    w->picks = xcalloc(&_alloc, npicks ? npicks : 1, sizeof(LightPick));
+}
+
+void freeworker(Worker *w) {
+    xfree(w->occluders);
+    xfree(w->picks);
+}
+
+void initcamera(Camera *c, Scene *s, int w, int h) {
+    c->w = w;
+    c->h = h;
+    c->height = tan(torad(s->vfov / 2)) * 2;
+    c->width = c->height * s->aspect;
+}
+
+Ray primaryray(Camera *c, int x, int y) {
+    int iy = c->h - y;
+    Ray ray = {
+        .orig = {0, 0, 0},
+        .dir = {
+            (c->width * (x / (float)c->w)) - c->width / 2,
+            (c->height * (iy / (float)c->h)) - c->height / 2,
+            -1,
+        },
+    };
+    ray.dir = vnorm(ray.dir);
+    return ray;
+}
+
+static Batches *batchesof(Scene *s, Worker *w) {
+    return w->batches ? w->batches : &s->batches;
+}
+
+int testscene(Scene *s, Worker *w, Ray *r, Hit *h) {
+    if (!testbatches(batchesof(s, w), r, h)) return 0;
+    finalizehit(r, h);
+    return 1;
+}
+
+int testprimary(Scene *s, Worker *w, Ray *r, Hit *h) {
+    if (!w->tile) return testscene(s, w, r, h);
+    if (!testbatches(w->tile, r, h)) return 0;
+    finalizehit(r, h);
+    return 1;
+}
+
+int occluded(Scene *s, Worker *w, Light *light, Ray *ray, float dist) {
+    Hit lh;
+    w->stats.shadowrays++;
+    // neighbouring pixels are usually shadowed by the same shape, and
+    // any hit closer than the light answers the query
+    Shape *last = w->occluders[light->id];
+    if (last) {
+        w->stats.occludertests++;
+        if (testshape(last, ray, &lh) && lh.dist < dist) {
+            w->stats.occluderhits++;
+            touchshape(w, last);
+            return 1;
+        }
+    }
+    if (testbatches(batchesof(s, w), ray, &lh) && lh.dist < dist) {
+        w->occluders[light->id] = lh.shape;
+        touchshape(w, lh.shape);
+        return 1;
+    }
+    return 0;
+}
+
+int picklights(Scene *s, Worker *w, Vec3 p, int bounce) {
+    int n = 0;
+    if (s->lightsamples > 0) {
+        // K lights picked by estimated contribution, each weighted by
+        // its inverse probability
+        for (int k = 0; k < s->lightsamples; k++) {
+            float pdf;
+            Light *light = samplelight(&s->lighttree, p, rngfloat(&w->rng, k, bounce), &pdf);
+            if (!light || pdf <= 0) continue;
+            w->picks[n++] = (LightPick){light, 1 / (pdf * s->lightsamples)};
+        }
+    }
+    else if (s->lightcutoff > 0) {
+        LightIter it;
+        lightiterinit(&it, &s->lighttree, p, s->lightcutoff);
+        Light *light;
+        while ((light = lightiternext(&it)))
+            w->picks[n++] = (LightPick){light, 1};
+    }
+    else {
+        for (int k = 0; k < s->nlights; k++)
+            w->picks[n++] = (LightPick){s->lights[k], 1};
+    }
+    return n;
+}
+
+float shadowray(Hit *hit, Light *light, Ray *ray) {
+    Vec3 l = vsub(light->pos, hit->point);
+    ray->orig = hit->point;
+    ray->dir = vnorm(l);
+    ray->orig = vadd(ray->orig, vmul(ray->dir, 0.0001));
+    return vmag(l);
+}
+
+Vec3 lightcolor(Hit *hit, Vec3 v, Light *light) {
+    Vec3 diffuse = hit->shape->mat.diffuse;
+    Vec3 specular = vec3(1.0, 1.0, 1.0);
+    Vec3 color = vec3(0.0, 0.0, 0.0);
+    Vec3 l = vsub(light->pos, hit->point);
+    float attenuation = 1.0 / vmag(l);
+    float ilight = light->intensity * attenuation;
+    // diffuse
+    {
+        float idiffuse = vdot(vnorm(l), hit->norm);
+        idiffuse = clamp(idiffuse, 0.0, 1.0);
+        idiffuse *= ilight;
+        color = vadd(color, vmul(diffuse, idiffuse));
+    }
+    // specular
+    {
+        Vec3 lr = vrefl(vsub(hit->point, light->pos), hit->norm);
+        float ispecular = vdot(vnorm(v), vnorm(lr));
+        ispecular = clamp(ispecular, 0.0, 1.0);
+        ispecular = pow(ispecular, 16);
+        ispecular *= ilight;
+        color = vadd(color, vmul(specular, ispecular));
+    }
+    return color;
+}
+
+Ray reflray(Ray *r, Hit *hit) {
+    Vec3 vr = vrefl(vsub(hit->point, r->orig), hit->norm);
+    Ray ray = {hit->point, vnorm(vr)};
+    ray.orig = vadd(ray.orig, vmul(hit->norm, 0.0001));
+    return ray;
+}
+
+Vec3 xcast(Scene *s, Ray *r, int recur, Hit *xhit, Worker *w) {
+    xhit->dist = FLT_MAX;
+    Hit hit;
+    if (!(recur ? testscene(s, w, r, &hit) : testprimary(s, w, r, &hit)))
+        return s->background;
+    *xhit = hit;
+    touchshape(w, hit.shape);
+    Vec3 color = vec3(0.0, 0.0, 0.0);
+    Vec3 v = vsub(r->orig, hit.point);
+
+    // lights
+    int npicks = picklights(s, w, hit.point, recur);
+    for (int k = 0; k < npicks; k++) {
+        LightPick *pick = &w->picks[k];
+        Ray ray;
+        float dist = shadowray(&hit, pick->light, &ray);
+        if (occluded(s, w, pick->light, &ray, dist)) continue;
+        Vec3 lc = lightcolor(&hit, v, pick->light);
+        color = vadd(color, vmul(lc, pick->weight));
+    }
+
+    // reflections
+    if (recur < MAX_RECUR) {
+        w->stats.reflectionrays++;
+        Ray ray = reflray(r, &hit);
+        Hit rhit;
+        Vec3 rc = xcast(s, &ray, recur + 1, &rhit, w);
+        float reflectiveness = hit.shape->mat.reflectiveness;
+        // float attenuation = 1.0 / rhit.dist;
+        // attenuation = clamp(attenuation, 0.0, 1.0);
+        // float irefl = attenuation * reflectiveness;
+        float irefl = reflectiveness;
+        color = vadd(color, vmul(rc, irefl));
+    }
+
+    return color;
+}
+
+Color tocolor(Vec3 c) {
+    c = vclamp(c);
+    return (Color){255 * c.x, 255 * c.y, 255 * c.z};
+}
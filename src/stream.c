@@ -0,0 +1,533 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <raytracer/math.h>
+#include <raytracer/obj.h>
+#include <raytracer/raytracer.h>
+#include <raytracer/stream.h>
+#include <raytracer/util.h>
+
+#define STREAM_MAGIC "RTMS"
+#define STREAM_VERSION 1
+#define STREAM_EXT ".rtmesh"
+// triangles per leaf of a cluster's own BVH
+#define CLUSTER_LEAF 4
+#define CACHE_SIZE (256ul << 20)
+
+static Allocator _alloc = {"stream"};
+static Allocator _cachealloc = {"meshcache"};
+
+// File layout: header, nodes, one ClusterRec per cluster, then each
+// cluster's triangles as 9 object space floats.
+typedef struct {
+    char magic[4];
+    unsigned version;
+    int ntris;
+    int nclusters;
+    int nnodes;
+} StreamHdr;
+
+typedef struct {
+    long long offset;
+    int ntris;
+    int pad;
+} ClusterRec;
+
+// Most recently used at head. Clusters are read outside the lock so a
+// thread only waits for the disk when it needs that cluster itself.
+static struct {
+    pthread_mutex_t lock;
+    Cluster *head, *tail;
+    MeshCacheStats stats;
+} _cache = {PTHREAD_MUTEX_INITIALIZER, 0, 0, {CACHE_SIZE}};
+
+static int endswith(const char *s, const char *end) {
+    int n = strlen(s), m = strlen(end);
+    return n >= m && strcmp(s + n - m, end) == 0;
+}
+
+// What packing keeps in files rather than memory: the OBJ's vertices
+// and faces as read, then the faces resolved to their corners.
+typedef struct {
+    FILE *verts, *faces;
+    int nverts, ntris;
+    int failed;
+} PackScan;
+
+typedef struct {
+    Vec3 v[3];
+} PackTri;
+
+typedef struct {
+    PackTri *tris;
+    BvhNode *nodes;
+    int nnodes, cap;
+    float pad;
+} Packer;
+
+// mkstemp next to path, as FILE
+static FILE *tempfile(const char *path, char *tmp, int size) {
+    snprintf(tmp, size, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd < 0) return 0;
+    FILE *f = fdopen(fd, "w+b");
+    if (!f) {
+        close(fd);
+        remove(tmp);
+    }
+    return f;
+}
+
+// unlinked right away, the space goes with the last close
+static FILE *scratch(const char *path) {
+    char tmp[1100];
+    FILE *f = tempfile(path, tmp, sizeof(tmp));
+    if (f) remove(tmp);
+    return f;
+}
+
+static void *mapfile(FILE *f, long long size, int prot) {
+    if (fflush(f) != 0 || !size) return 0;
+    void *p = mmap(0, size, prot, MAP_SHARED, fileno(f), 0);
+    return p == MAP_FAILED ? 0 : p;
+}
+
+static void packchunk(void *ctx, Obj *o) {
+    PackScan *ps = ctx;
+    if (fwrite(o->verts, 3 * sizeof(float), o->nverts, ps->verts) != o->nverts
+            || fwrite(o->tris, 3 * sizeof(int), o->ntris, ps->faces) != o->ntris)
+        ps->failed = 1;
+    ps->nverts += o->nverts;
+    ps->ntris += o->ntris;
+}
+
+// Faces to their corners, block by block, dropping those with no area
+// as loadobj would. Returns how many are left, -1 on failure.
+static int resolve(PackScan *ps, FILE *out) {
+    Vec3 *verts = mapfile(ps->verts, (long long)ps->nverts * sizeof(Vec3), PROT_READ);
+    if (ps->nverts && !verts) return -1;
+    int block[3 * 4096];
+    PackTri tris[4096];
+    int ntris = 0, left = ps->ntris;
+    rewind(ps->faces);
+    while (left > 0) {
+        int n = left < 4096 ? left : 4096;
+        if (fread(block, 3 * sizeof(int), n, ps->faces) != n) break;
+        int m = 0;
+        for (int i = 0; i < n; i++) {
+            PackTri *t = &tris[m];
+            for (int k = 0; k < 3; k++)
+                t->v[k] = verts[block[i * 3 + k]];
+            if (vmag(vcross(vsub(t->v[1], t->v[0]), vsub(t->v[2], t->v[0]))) != 0)
+                m++;
+        }
+        if (fwrite(tris, sizeof(PackTri), m, out) != m) break;
+        ntris += m;
+        left -= n;
+    }
+    if (verts) munmap(verts, (long long)ps->nverts * sizeof(Vec3));
+    return left ? -1 : ntris;
+}
+
+// three times the centroid, only compared
+static float centroid(PackTri *t, int axis) {
+    return axisof(t->v[0], axis) + axisof(t->v[1], axis) + axisof(t->v[2], axis);
+}
+
+// Quickselect, the k smallest centroids on axis end up before k.
+static void selectk(PackTri *tris, int n, int k, int axis) {
+    int lo = 0, hi = n - 1;
+    while (lo < hi) {
+        float pivot = centroid(&tris[lo + (hi - lo) / 2], axis);
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (centroid(&tris[i], axis) < pivot) i++;
+            while (centroid(&tris[j], axis) > pivot) j--;
+            if (i <= j) {
+                PackTri t = tris[i];
+                tris[i++] = tris[j];
+                tris[j--] = t;
+            }
+        }
+        if (k <= j) hi = j;
+        else if (k >= i) lo = i;
+        else break;
+    }
+}
+
+// The same median split as buildbvh down to clusters, done in place on
+// the mapped triangles so the kernel can page them. Leaves come out in
+// file order.
+static void packnode(Packer *pk, int start, int n) {
+    if (pk->nnodes == pk->cap) {
+        pk->cap = pk->cap ? pk->cap * 2 : 64;
+        pk->nodes = xrealloc(&_alloc, pk->nodes, pk->cap * sizeof(BvhNode));
+    }
+    int idx = pk->nnodes++;
+    Vec3 min = vec3(FLT_MAX, FLT_MAX, FLT_MAX), max = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    Vec3 cmin = min, cmax = max;
+    for (int i = start; i < start + n; i++) {
+        PackTri *t = &pk->tris[i];
+        Vec3 c = vadd(vadd(t->v[0], t->v[1]), t->v[2]);
+        for (int k = 0; k < 3; k++) {
+            min = vmin(min, t->v[k]);
+            max = vmax(max, t->v[k]);
+        }
+        cmin = vmin(cmin, c);
+        cmax = vmax(cmax, c);
+    }
+    Vec3 pad = vec3(pk->pad, pk->pad, pk->pad);
+    pk->nodes[idx].min = vsub(min, pad);
+    pk->nodes[idx].max = vadd(max, pad);
+    if (n <= CLUSTER_TRIS) {
+        pk->nodes[idx].index = start;
+        pk->nodes[idx].count = n;
+        return;
+    }
+    Vec3 ext = vsub(cmax, cmin);
+    int axis = ext.x > ext.y ? (ext.x > ext.z ? 0 : 2) : (ext.y > ext.z ? 1 : 2);
+    selectk(&pk->tris[start], n, n / 2, axis);
+    pk->nodes[idx].count = 0;
+    packnode(pk, start, n / 2);
+    pk->nodes[idx].index = pk->nnodes;
+    packnode(pk, start + n / 2, n - n / 2);
+}
+
+static int writepacked(Packer *pk, int ntris, const char *file) {
+    int nclusters = 0;
+    for (int i = 0; i < pk->nnodes; i++)
+        nclusters += pk->nodes[i].count != 0;
+    ClusterRec *recs = xcalloc(&_alloc, nclusters ? nclusters : 1, sizeof(ClusterRec));
+    long long offset = sizeof(StreamHdr) + pk->nnodes * sizeof(BvhNode)
+            + nclusters * sizeof(ClusterRec);
+    for (int i = 0, k = 0; i < pk->nnodes; i++) {
+        BvhNode *node = &pk->nodes[i];
+        if (!node->count) continue;
+        recs[k].offset = offset + (long long)node->index * sizeof(PackTri);
+        recs[k].ntris = node->count;
+        node->index = k++;
+    }
+    StreamHdr hdr = {{0}};
+    memcpy(hdr.magic, STREAM_MAGIC, 4);
+    hdr.version = STREAM_VERSION;
+    hdr.ntris = ntris;
+    hdr.nclusters = nclusters;
+    hdr.nnodes = pk->nnodes;
+    char tmp[1100];
+    FILE *f = tempfile(file, tmp, sizeof(tmp));
+    int ok = f
+            && fwrite(&hdr, sizeof(hdr), 1, f) == 1
+            && fwrite(pk->nodes, sizeof(BvhNode), pk->nnodes, f) == pk->nnodes
+            && fwrite(recs, sizeof(ClusterRec), nclusters, f) == nclusters
+            && fwrite(pk->tris, sizeof(PackTri), ntris, f) == ntris;
+    if (f) {
+        // mkstemp makes it 0600, the cache is as readable as the OBJ
+        fchmod(fileno(f), 0644);
+        ok = fclose(f) == 0 && ok;
+    }
+    xfree(recs);
+    if (!ok || rename(tmp, file) != 0) {
+        if (f) remove(tmp);
+        printf("stream: failed to write %s\n", file);
+        return 0;
+    }
+    printf("stream: packed %i tris into %i clusters in %s\n", ntris, nclusters, file);
+    return 1;
+}
+
+// Builds file from the OBJ without loading it: the OBJ is scanned a
+// chunk at a time into scratch files next to file, and the triangles
+// are split into clusters where they lie on disk. Memory use is the
+// scan's chunk and the nodes, whatever the size of the mesh.
+static int pack(const char *obj, const char *file) {
+    PackScan ps = {scratch(file), scratch(file)};
+    FILE *trif = scratch(file);
+    int ok = ps.verts && ps.faces && trif
+            && scanobj(obj, packchunk, &ps) && !ps.failed;
+    int ntris = ok ? resolve(&ps, trif) : -1;
+    if (ps.verts) fclose(ps.verts);
+    if (ps.faces) fclose(ps.faces);
+    Packer pk = {0};
+    long long size = (long long)(ntris > 0 ? ntris : 0) * sizeof(PackTri);
+    pk.tris = ntris > 0 ? mapfile(trif, size, PROT_READ | PROT_WRITE) : 0;
+    ok = ntris == 0 || (ntris > 0 && pk.tris);
+    if (ok && ntris) {
+        Vec3 min = vec3(FLT_MAX, FLT_MAX, FLT_MAX), max = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+        for (int i = 0; i < ntris; i++) {
+            for (int k = 0; k < 3; k++) {
+                min = vmin(min, pk.tris[i].v[k]);
+                max = vmax(max, pk.tris[i].v[k]);
+            }
+        }
+        pk.pad = vmag(vsub(max, min)) * 1e-5 + 1e-6;
+        packnode(&pk, 0, ntris);
+    }
+    if (ok)
+        ok = writepacked(&pk, ntris, file);
+    else
+        printf("stream: can't pack %s\n", obj);
+    if (pk.tris) munmap(pk.tris, size);
+    if (trif) fclose(trif);
+    xfree(pk.nodes);
+    return ok;
+}
+
+static int newer(const char *a, const char *b) {
+    struct stat sa, sb;
+    if (stat(a, &sa) != 0 || stat(b, &sb) != 0) return 0;
+    if (sa.st_mtim.tv_sec != sb.st_mtim.tv_sec) return sa.st_mtim.tv_sec > sb.st_mtim.tv_sec;
+    return sa.st_mtim.tv_nsec >= sb.st_mtim.tv_nsec;
+}
+
+static int readat(int fd, void *buf, long long size, long long offset) {
+    return pread(fd, buf, size, offset) == size;
+}
+
+// every cluster lies within the file and every node points at a
+// cluster or at children after it
+static int checkstream(MeshStream *ms, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || ms->ntris < 0) return 0;
+    for (int i = 0; i < ms->nclusters; i++)
+        if (ms->counts[i] < 0 || ms->counts[i] > CLUSTER_TRIS || ms->offsets[i] < 0
+                || ms->offsets[i] + ms->counts[i] * sizeof(PackTri) > (unsigned long long)st.st_size)
+            return 0;
+    for (int i = 0; i < ms->nnodes; i++) {
+        BvhNode *node = &ms->objnodes[i];
+        if (node->count ? node->index < 0 || node->index >= ms->nclusters
+                : node->index <= i + 1 || node->index >= ms->nnodes)
+            return 0;
+    }
+    return 1;
+}
+
+static MeshStream *openpacked(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("stream: can't open %s\n", path);
+        return 0;
+    }
+    StreamHdr hdr;
+    if (!readat(fd, &hdr, sizeof(hdr), 0) || memcmp(hdr.magic, STREAM_MAGIC, 4) != 0
+            || hdr.version != STREAM_VERSION || hdr.nnodes < 0 || hdr.nclusters < 0) {
+        printf("stream: %s isn't a mesh file\n", path);
+        close(fd);
+        return 0;
+    }
+    MeshStream *ms = xcalloc(&_alloc, 1, sizeof(MeshStream));
+    ms->file = xstrdup(&_alloc, path);
+    ms->fd = fd;
+    ms->ntris = hdr.ntris;
+    ms->nclusters = hdr.nclusters;
+    ms->nnodes = hdr.nnodes;
+    int nc = hdr.nclusters ? hdr.nclusters : 1;
+    ms->objnodes = xmalloc(&_alloc, (hdr.nnodes ? hdr.nnodes : 1) * sizeof(BvhNode));
+    ms->nodes = xmalloc(&_alloc, (hdr.nnodes ? hdr.nnodes : 1) * sizeof(BvhNode));
+    ms->offsets = xmalloc(&_alloc, nc * sizeof(long long));
+    ms->counts = xmalloc(&_alloc, nc * sizeof(int));
+    ms->resident = xcalloc(&_alloc, nc, sizeof(Cluster *));
+    ClusterRec *recs = xmalloc(&_alloc, nc * sizeof(ClusterRec));
+    if (!readat(fd, ms->objnodes, hdr.nnodes * sizeof(BvhNode), sizeof(hdr))
+            || !readat(fd, recs, hdr.nclusters * sizeof(ClusterRec),
+                sizeof(hdr) + hdr.nnodes * sizeof(BvhNode))) {
+        printf("stream: %s is truncated\n", path);
+        xfree(recs);
+        freemeshstream(ms);
+        return 0;
+    }
+    for (int i = 0; i < hdr.nclusters; i++) {
+        ms->offsets[i] = recs[i].offset;
+        ms->counts[i] = recs[i].ntris;
+    }
+    xfree(recs);
+    if (!checkstream(ms, fd)) {
+        printf("stream: %s is corrupt\n", path);
+        freemeshstream(ms);
+        return 0;
+    }
+    ms->key = hashbytes(ms->objnodes, hdr.nnodes * sizeof(BvhNode)) ^ hdr.ntris;
+    matrixinit(&ms->transform);
+    memcpy(ms->nodes, ms->objnodes, hdr.nnodes * sizeof(BvhNode));
+    return ms;
+}
+
+// A pack that's current but doesn't hold up is made again from the OBJ.
+MeshStream *openmeshstream(const char *file) {
+    if (endswith(file, STREAM_EXT))
+        return openpacked(file);
+    char path[1024];
+    snprintf(path, sizeof(path), "%s%s", file, STREAM_EXT);
+    if (newer(path, file)) {
+        MeshStream *ms = openpacked(path);
+        if (ms) return ms;
+        printf("stream: packing %s again\n", file);
+    }
+    if (!pack(file, path)) return 0;
+    return openpacked(path);
+}
+
+// cache, callers hold the lock
+
+static void unlinkcluster(Cluster *c) {
+    if (c->prev) c->prev->next = c->next;
+    else _cache.head = c->next;
+    if (c->next) c->next->prev = c->prev;
+    else _cache.tail = c->prev;
+    c->prev = c->next = 0;
+}
+
+static void pushfront(Cluster *c) {
+    c->prev = 0;
+    c->next = _cache.head;
+    if (_cache.head) _cache.head->prev = c;
+    _cache.head = c;
+    if (!_cache.tail) _cache.tail = c;
+}
+
+static void freecluster(Cluster *c) {
+    xfree(c->verts);
+    xfree(c->tris);
+    xfree(c->nodes);
+    xfree(c);
+}
+
+static void drop(Cluster *c) {
+    unlinkcluster(c);
+    c->ms->resident[c->index] = 0;
+    _cache.stats.used -= c->bytes;
+    freecluster(c);
+}
+
+// Evicts from the cold end until the budget holds, pinned clusters
+// are skipped and may push the cache over briefly.
+static void evict() {
+    Cluster *c = _cache.tail;
+    while (c && _cache.stats.used > _cache.stats.budget) {
+        Cluster *prev = c->prev;
+        if (!c->pins) {
+            drop(c);
+            _cache.stats.evictions++;
+        }
+        c = prev;
+    }
+}
+
+// 0 if the read fails, the file changed under a running render; said
+// once per stream, the cluster then counts as a miss for every ray
+static Cluster *loadcluster(MeshStream *ms, int i) {
+    int n = ms->counts[i];
+    float *buf = xmalloc(&_cachealloc, (n ? n : 1) * 9 * sizeof(float));
+    if (!readat(ms->fd, buf, n * 9 * sizeof(float), ms->offsets[i])) {
+        if (!__atomic_exchange_n(&ms->failed, 1, __ATOMIC_RELAXED))
+            printf("stream: failed to read cluster %i of %s\n", i, ms->file);
+        xfree(buf);
+        return 0;
+    }
+    Cluster *c = xcalloc(&_cachealloc, 1, sizeof(Cluster));
+    c->ms = ms;
+    c->index = i;
+    c->ntris = n;
+    c->verts = xmalloc(&_cachealloc, n * 3 * sizeof(Vec3));
+    matrixmulv(&ms->transform, buf, c->verts, n * 3);
+    xfree(buf);
+    c->tris = xmalloc(&_cachealloc, n * 3 * sizeof(int));
+    for (int k = 0; k < n * 3; k++)
+        c->tris[k] = k;
+    c->nodes = buildbvh(c->verts, c->tris, 0, n, CLUSTER_LEAF, &c->nnodes);
+    c->bytes = sizeof(Cluster) + n * 3 * (sizeof(Vec3) + sizeof(int))
+            + c->nnodes * sizeof(BvhNode);
+    return c;
+}
+
+Cluster *acquirecluster(MeshStream *ms, int i) {
+    pthread_mutex_lock(&_cache.lock);
+    Cluster *c = ms->resident[i];
+    if (c) {
+        _cache.stats.hits++;
+        unlinkcluster(c);
+        pushfront(c);
+        c->pins++;
+        pthread_mutex_unlock(&_cache.lock);
+        return c;
+    }
+    _cache.stats.misses++;
+    pthread_mutex_unlock(&_cache.lock);
+    Cluster *loaded = loadcluster(ms, i);
+    if (!loaded) return 0;
+    pthread_mutex_lock(&_cache.lock);
+    // another thread may have read it meanwhile
+    c = ms->resident[i];
+    if (c) {
+        unlinkcluster(c);
+        freecluster(loaded);
+    }
+    else {
+        c = loaded;
+        ms->resident[i] = c;
+        _cache.stats.used += c->bytes;
+    }
+    pushfront(c);
+    c->pins++;
+    evict();
+    pthread_mutex_unlock(&_cache.lock);
+    return c;
+}
+
+void releasecluster(Cluster *c) {
+    pthread_mutex_lock(&_cache.lock);
+    c->pins--;
+    evict();
+    pthread_mutex_unlock(&_cache.lock);
+}
+
+static void flush(MeshStream *ms) {
+    pthread_mutex_lock(&_cache.lock);
+    for (int i = 0; i < ms->nclusters; i++)
+        if (ms->resident[i]) drop(ms->resident[i]);
+    pthread_mutex_unlock(&_cache.lock);
+}
+
+// Nesting still holds for the world boxes, a box inside its parent
+// maps inside the parent's image.
+void transformmeshstream(MeshStream *ms, Matrix *m) {
+    flush(ms);
+    ms->transform = *m;
+    for (int i = 0; i < ms->nnodes; i++) {
+        BvhNode *in = &ms->objnodes[i];
+        Aabb box = transformbox(m, (Aabb){in->min, in->max});
+        ms->nodes[i] = *in;
+        ms->nodes[i].min = box.min;
+        ms->nodes[i].max = box.max;
+    }
+}
+
+void freemeshstream(MeshStream *ms) {
+    flush(ms);
+    close(ms->fd);
+    xfree(ms->file);
+    xfree(ms->objnodes);
+    xfree(ms->nodes);
+    xfree(ms->offsets);
+    xfree(ms->counts);
+    xfree(ms->resident);
+    xfree(ms);
+}
+
+void setmeshcache(unsigned long bytes) {
+    pthread_mutex_lock(&_cache.lock);
+    _cache.stats.budget = bytes;
+    evict();
+    pthread_mutex_unlock(&_cache.lock);
+}
+
+void meshcachestats(MeshCacheStats *st) {
+    pthread_mutex_lock(&_cache.lock);
+    *st = _cache.stats;
+    pthread_mutex_unlock(&_cache.lock);
+}
@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <raytracer/tracing.h>
+#include <raytracer/util.h>
+
+#define CHUNK_EVENTS 1024
+#define ARG_LEN 40
+
+typedef struct {
+    double ts;
+    const char *name;
+    // arg[0] == 0 with id < 0 means no argument
+    int id;
+    char arg[ARG_LEN];
+    char ph;
+} TraceEvent;
+
+typedef struct TraceChunk {
+    struct TraceChunk *next;
+    int n;
+    TraceEvent events[CHUNK_EVENTS];
+} TraceChunk;
+
+// Only its own thread appends, the dump at exit reads counts and links
+// published with release stores. Buffers outlive their threads.
+typedef struct TraceBuf {
+    struct TraceBuf *next;
+    int tid;
+    TraceChunk *first, *last;
+} TraceBuf;
+
+static const char *_file;
+static double _start;
+static __thread TraceBuf *_buf;
+static TraceBuf *_bufs;
+static int _ntids;
+
+// Plain calloc, not xcalloc: trace points on every worker would contend
+// on the tracked allocator's shared counters, and tracing would change
+// what it measures. Nothing here is ever freed.
+static void *tracealloc(unsigned size) {
+    void *p = calloc(1, size);
+    if (!p) err("out of memory: %u bytes for tracing", size);
+    return p;
+}
+
+static TraceChunk *newchunk() {
+    return tracealloc(sizeof(TraceChunk));
+}
+
+static TraceBuf *threadbuf() {
+    if (_buf) return _buf;
+    TraceBuf *b = tracealloc(sizeof(TraceBuf));
+    b->tid = __atomic_fetch_add(&_ntids, 1, __ATOMIC_RELAXED);
+    b->first = b->last = newchunk();
+    b->next = __atomic_load_n(&_bufs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&_bufs, &b->next, b, 1,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    _buf = b;
+    return b;
+}
+
+static void record(char ph, const char *name, const char *arg, int id) {
+    double ts = now();
+    TraceBuf *b = threadbuf();
+    TraceChunk *c = b->last;
+    if (c->n == CHUNK_EVENTS) {
+        TraceChunk *next = newchunk();
+        __atomic_store_n(&c->next, next, __ATOMIC_RELEASE);
+        b->last = c = next;
+    }
+    TraceEvent *e = &c->events[c->n];
+    e->ts = ts;
+    e->name = name;
+    e->id = id;
+    e->ph = ph;
+    e->arg[0] = 0;
+    if (arg) snprintf(e->arg, ARG_LEN, "%s", arg);
+    __atomic_store_n(&c->n, c->n + 1, __ATOMIC_RELEASE);
+}
+
+void tracebegin(const char *name, const char *arg) {
+    if (_file) record('B', name, arg, -1);
+}
+
+void tracebegini(const char *name, int arg) {
+    if (_file) record('B', name, 0, arg);
+}
+
+void traceend() {
+    if (_file) record('E', 0, 0, -1);
+}
+
+static void putstr(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', f);
+        if ((unsigned char)*s >= ' ') fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+// chrome wants microseconds, one process, thread ids in first use order
+static void dumptrace() {
+    FILE *f = fopen(_file, "w");
+    if (!f) {
+        printf("tracing: can't write %s\n", _file);
+        return;
+    }
+    fprintf(f, "{\"traceEvents\": [");
+    const char *sep = "\n";
+    TraceBuf *bufs = __atomic_load_n(&_bufs, __ATOMIC_ACQUIRE);
+    for (TraceBuf *b = bufs; b; b = b->next) {
+        fprintf(f, "%s{\"ph\": \"M\", \"pid\": 1, \"tid\": %i, \"name\": \"thread_name\", "
+                "\"args\": {\"name\": \"%s %i\"}}", sep, b->tid, b->tid ? "worker" : "main", b->tid);
+        sep = ",\n";
+        for (TraceChunk *c = b->first; c; c = __atomic_load_n(&c->next, __ATOMIC_ACQUIRE)) {
+            int n = __atomic_load_n(&c->n, __ATOMIC_ACQUIRE);
+            for (int i = 0; i < n; i++) {
+                TraceEvent *e = &c->events[i];
+                fprintf(f, "%s{\"ph\": \"%c\", \"pid\": 1, \"tid\": %i, \"ts\": %.3f",
+                        sep, e->ph, b->tid, (e->ts - _start) * 1e6);
+                if (e->name) {
+                    fprintf(f, ", \"name\": ");
+                    putstr(f, e->name);
+                }
+                if (e->arg[0]) {
+                    fprintf(f, ", \"args\": {\"arg\": ");
+                    putstr(f, e->arg);
+                    fprintf(f, "}");
+                }
+                else if (e->id >= 0)
+                    fprintf(f, ", \"args\": {\"arg\": %i}", e->id);
+                fprintf(f, "}");
+            }
+        }
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+}
+
+void starttracing(const char *file) {
+    if (_file) return;
+    _start = now();
+    _file = file;
+    // the caller gets the first thread id
+    threadbuf();
+    atexit(dumptrace);
+}
@@ -2,8 +2,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <raytracer/util.h>
 
+static Allocator _files = {"files"};
+// in order of first use
+static Allocator *_allocs, **_lastalloc = &_allocs;
+// over all allocators
+static unsigned long _total, _peak;
+static pthread_mutex_t _memlock = PTHREAD_MUTEX_INITIALIZER;
+
 void err(const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
@@ -14,19 +27,57 @@ void err(const char *fmt, ...) {
     exit(1);
 }
 
-char *readfile(const char *file) {
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+char *tryreadfile(const char *file) {
     FILE *f = fopen(file, "r");
-    if (!f) err("no such file: %s", file);
+    if (!f) return 0;
     fseek(f, 0, SEEK_END);
-    int size = ftell(f);
-    char *buf = malloc(size + 1);
+    long size = ftell(f);
+    if (size < 0) {
+        fclose(f);
+        return 0;
+    }
+    char *buf = xmalloc(&_files, size + 1);
     rewind(f);
-    int r = fread(buf, size, 1, f);
+    int r = size ? fread(buf, size, 1, f) : 1;
     fclose(f);
     buf[size] = 0;
     if (r == 1) return buf;
-    free(buf);
-    err("failed read: %s", file);
+    xfree(buf);
+    return 0;
+}
+
+char *readfile(const char *file) {
+    char *buf = tryreadfile(file);
+    if (!buf) err("can't read: %s", file);
+    return buf;
+}
+
+FILE *opentemp(const char *path, char *tmp, int size) {
+    snprintf(tmp, size, "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd < 0) return 0;
+    FILE *f = fdopen(fd, "w+b");
+    if (!f) {
+        close(fd);
+        remove(tmp);
+        return 0;
+    }
+    // mkstemp makes it 0600, what's written here is as readable as
+    // what it was made from
+    fchmod(fd, 0644);
+    return f;
+}
+
+int closetemp(FILE *f, const char *tmp, const char *path, int ok) {
+    ok = fclose(f) == 0 && ok;
+    if (ok && rename(tmp, path) == 0) return 1;
+    remove(tmp);
     return 0;
 }
 
@@ -44,22 +95,63 @@ typedef struct {
     #define printf(...)
 #endif
 
+// raises *peak to at least v
+static void atomicmax(unsigned long *peak, unsigned long v) {
+    unsigned long cur = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (cur < v && !__atomic_compare_exchange_n(peak, &cur, v, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// Counters are atomics so allocating threads don't queue on each other,
+// the lock is only taken to link an allocator into the report.
+static void track(Allocator *a, unsigned size) {
+    if (!__atomic_load_n(&a->listed, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&_memlock);
+        if (!a->listed) {
+            *_lastalloc = a;
+            _lastalloc = &a->next;
+            __atomic_store_n(&a->listed, 1, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&_memlock);
+    }
+    atomicmax(&a->peak, __atomic_add_fetch(&a->size, size, __ATOMIC_RELAXED));
+    atomicmax(&_peak, __atomic_add_fetch(&_total, size, __ATOMIC_RELAXED));
+    __atomic_add_fetch(&a->live, 1, __ATOMIC_RELAXED);
+}
+
+static void untrack(Allocator *a, unsigned size) {
+    __atomic_sub_fetch(&a->size, size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&_total, size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&a->live, 1, __ATOMIC_RELAXED);
+}
+
 void *xmalloc(Allocator *a, unsigned size) {
     if (!size) return 0;
     MemHdr *hdr = malloc(sizeof(MemHdr) + size);
-    printf("xmalloc %u [%s] %u -> %u\n", size, a->name, a->size, a->size + size);
+    if (!hdr) err("out of memory: %u bytes for %s", size, a->name);
+    printf("xmalloc %u [%s] %lu -> %lu\n", size, a->name, a->size, a->size + size);
     hdr->alloc = a;
     hdr->size = size;
-    a->size += size;
+    track(a, size);
+    __atomic_add_fetch(&a->count, 1, __ATOMIC_RELAXED);
     return hdr + 1;
 }
 
+void *xcalloc(Allocator *a, size_t n, size_t size) {
+    if (size && n > UINT_MAX / size)
+        err("out of memory: %zu * %zu bytes for %s", n, size, a->name);
+    void *ptr = xmalloc(a, n * size);
+    if (ptr) memset(ptr, 0, n * size);
+    return ptr;
+}
+
 void xfree(void *ptr) {
     if (!ptr) return;
     MemHdr *hdr = (MemHdr *)ptr - 1;
-    printf("xfree %u [%s] %u -> %u\n", hdr->size, hdr->alloc->name,
+    printf("xfree %u [%s] %lu -> %lu\n", hdr->size, hdr->alloc->name,
             hdr->alloc->size, hdr->alloc->size - hdr->size);
-    hdr->alloc->size -= hdr->size;
+    untrack(hdr->alloc, hdr->size);
     free(hdr);
 }
 
@@ -69,11 +161,52 @@ void *xrealloc(Allocator *a, void *ptr, unsigned size) {
     MemHdr *hdr = (MemHdr *)ptr - 1;
     printf("xrealloc %u [%s]\n", size, a->name);
     hdr = realloc(hdr, sizeof(MemHdr) + size);
+    if (!hdr) err("out of memory: %u bytes for %s", size, a->name);
     // decrement size of old allocator by old size
-    hdr->alloc->size -= hdr->size;
+    untrack(hdr->alloc, hdr->size);
     // increment size of new allocator by new size
     hdr->alloc = a;
     hdr->size = size;
-    a->size += size;
+    track(a, size);
     return hdr + 1;
 }
+
+char *xstrdup(Allocator *a, const char *str) {
+    int len = strlen(str);
+    char *cpy = xmalloc(a, len + 1);
+    memcpy(cpy, str, len + 1);
+    return cpy;
+}
+
+#undef printf
+
+unsigned long memcurrent() {
+    return __atomic_load_n(&_total, __ATOMIC_RELAXED);
+}
+
+void memreport(FILE *f) {
+    fprintf(f, "%-12s %12s %12s %10s %8s\n", "memory", "current", "peak", "allocs", "live");
+    for (Allocator *a = _allocs; a; a = a->next)
+        fprintf(f, "%-12s %12lu %12lu %10lu %8lu\n", a->name, a->size, a->peak, a->count, a->live);
+    fprintf(f, "%-12s %12lu %12lu\n", "total", _total, _peak);
+}
+
+void memjson(FILE *f, const char *indent) {
+    fprintf(f, "{\n");
+    for (Allocator *a = _allocs; a; a = a->next)
+        fprintf(f, "%s  \"%s\": {\"current\": %lu, \"peak\": %lu, \"allocs\": %lu, \"live\": %lu},\n",
+                indent, a->name, a->size, a->peak, a->count, a->live);
+    fprintf(f, "%s  \"total\": {\"current\": %lu, \"peak\": %lu}\n", indent, _total, _peak);
+    fprintf(f, "%s}", indent);
+}
+
+// FNV-1a
+unsigned hashbytes(const void *data, unsigned size) {
+    const unsigned char *p = data;
+    unsigned h = 2166136261u;
+    for (unsigned i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
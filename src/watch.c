@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+#include <raytracer/math.h>
+#include <raytracer/obj.h>
+#include <raytracer/raytracer.h>
+#include <raytracer/render.h>
+#include <raytracer/shade.h>
+#include <raytracer/gbuffer.h>
+#include <raytracer/watch.h>
+#include <raytracer/util.h>
+
+#define NDEPTHS (MAX_RECUR + 1)
+// how long a burst of events has to go quiet before we act on it
+#define SETTLE_MS 50
+
+static Allocator _alloc = {"watch"};
+
+typedef struct {
+    int wd;
+    char *name;
+    char *path;
+    int changed;
+} WatchFile;
+
+typedef struct {
+    int fd;
+    WatchFile *files;
+    int nfiles;
+} Watcher;
+
+static void clearfiles(Watcher *wt) {
+    for (int i = 0; i < wt->nfiles; i++) {
+        xfree(wt->files[i].name);
+        xfree(wt->files[i].path);
+    }
+    xfree(wt->files);
+    wt->files = 0;
+    wt->nfiles = 0;
+}
+
+// Watches the directory rather than the file, editors usually save by
+// replacing the file and a watch on the old inode would go quiet.
+static void addfile(Watcher *wt, const char *path) {
+    char *d = xstrdup(&_alloc, path);
+    char *b = xstrdup(&_alloc, path);
+    int wd = inotify_add_watch(wt->fd, dirname(d),
+            IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+    if (wd < 0)
+        printf("watch: can't watch %s\n", path);
+    wt->nfiles++;
+    wt->files = xrealloc(&_alloc, wt->files, wt->nfiles * sizeof(WatchFile));
+    wt->files[wt->nfiles - 1] = (WatchFile){wd, xstrdup(&_alloc, basename(b)), xstrdup(&_alloc, path), 0};
+    xfree(d);
+    xfree(b);
+}
+
+static void addscenefiles(Watcher *wt, const char *file, Scene *s) {
+    clearfiles(wt);
+    addfile(wt, file);
+    for (int i = 0; i < s->nshapes; i++) {
+        if (s->shapes[i]->type != SHAPE_MESH) continue;
+        ShapeMesh *m = (ShapeMesh *)s->shapes[i];
+        if (m->objfile)
+            addfile(wt, m->objfile);
+    }
+}
+
+static int readevents(Watcher *wt) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int n = read(wt->fd, buf, sizeof(buf));
+    int hits = 0;
+    for (char *p = buf; n > 0 && p < buf + n;) {
+        struct inotify_event *ev = (struct inotify_event *)p;
+        for (int i = 0; i < wt->nfiles; i++) {
+            WatchFile *wf = &wt->files[i];
+            if (ev->len && wf->wd == ev->wd && strcmp(wf->name, ev->name) == 0) {
+                wf->changed = 1;
+                hits++;
+            }
+        }
+        p += sizeof(struct inotify_event) + ev->len;
+    }
+    return hits;
+}
+
+// Blocks until at least one watched file changed and things settled.
+static void waitchanges(Watcher *wt) {
+    for (int i = 0; i < wt->nfiles; i++)
+        wt->files[i].changed = 0;
+    while (!readevents(wt));
+    struct pollfd pfd = {wt->fd, POLLIN};
+    while (poll(&pfd, 1, SETTLE_MS) > 0)
+        readevents(wt);
+}
+
+static int touches(Frame *f, int tile, unsigned char *changed, int nchanged) {
+    unsigned char *bits = &f->touch[tile * f->touchbytes];
+    for (int i = 0; i < nchanged && i < f->touchbytes * 8; i++)
+        if (changed[i] && (bits[i >> 3] & (1 << (i & 7))))
+            return 1;
+    return 0;
+}
+
+// Whether shape, in its new form, could change any pixel of the tile:
+// does it cut any cached primary, reflection or shadow ray short.
+static int affects(Scene *s, GBuffer *gb, Camera *cam, Shape *shape,
+        int x0, int y0, int x1, int y1) {
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            GHit *recs = &gb->hits[(y * gb->width + x) * NDEPTHS];
+            Ray r = primaryray(cam, x, y);
+            for (int d = 0; d < NDEPTHS; d++) {
+                GHit *rec = &recs[d];
+                if (rec->shape == GHIT_UNKNOWN) return 1;
+                Hit h;
+                if (testshape(shape, &r, &h)
+                        && (rec->shape == GHIT_MISS || h.dist < rec->dist))
+                    return 1;
+                if (rec->shape == GHIT_MISS) break;
+                Hit hit = {0, rec->dist, rec->point, rec->norm};
+                for (int k = 0; k < s->nlights; k++) {
+                    Ray sr;
+                    float dist = shadowray(&hit, s->lights[k], &sr);
+                    if (testshape(shape, &sr, &h) && h.dist < dist)
+                        return 1;
+                }
+                r = reflray(&r, &hit);
+            }
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    Scene *scene;
+    Bitmap bmp;
+    Frame frame;
+    int ntiles;
+} Session;
+
+static void resizetouch(Session *ss) {
+    Frame *f = &ss->frame;
+    int nbytes = (ss->scene->nshapes + 7) / 8;
+    if (nbytes <= f->touchbytes) return;
+    unsigned char *touch = xcalloc(&_alloc, ss->ntiles * nbytes, 1);
+    for (int i = 0; i < ss->ntiles && f->touch; i++)
+        memcpy(&touch[i * nbytes], &f->touch[i * f->touchbytes], f->touchbytes);
+    xfree(f->touch);
+    f->touch = touch;
+    f->touchbytes = nbytes;
+}
+
+static void render(Session *ss, RenderOpts *opts, unsigned char *todo) {
+    int n = 0;
+    for (int i = 0; i < ss->ntiles; i++)
+        n += todo[i];
+    RenderStats st;
+    rendertiles(&ss->bmp, ss->scene, opts, &ss->frame, todo, &st);
+    output(&ss->bmp, ss->scene->output);
+    printf("watch: rendered %i/%i tiles in %.3fs\n", n, ss->ntiles, st.time);
+}
+
+static void start(Session *ss, Scene *s, RenderOpts *opts) {
+    memset(ss, 0, sizeof(Session));
+    ss->scene = s;
+    initbitmap(&ss->bmp, s->width, s->height);
+    clear(&ss->bmp, (Color){0});
+    ss->ntiles = tilecount(&ss->bmp, opts->tilesize);
+    ss->frame.gb = opengbuffer(0, s, s->width, s->height);
+    resizetouch(ss);
+    unsigned char *todo = xmalloc(&_alloc, ss->ntiles);
+    memset(todo, 1, ss->ntiles);
+    render(ss, opts, todo);
+    xfree(todo);
+}
+
+static void stop(Session *ss) {
+    freegbuffer(ss->frame.gb);
+    xfree(ss->frame.touch);
+    freebitmap(&ss->bmp);
+    freescene(ss->scene);
+}
+
+static void update(Session *ss, const char *file, RenderOpts *opts, Watcher *wt) {
+    double t0 = now();
+    const char **objs = xmalloc(&_alloc, wt->nfiles * sizeof(char *));
+    int nobjs = 0;
+    for (int i = 1; i < wt->nfiles; i++)
+        if (wt->files[i].changed)
+            objs[nobjs++] = wt->files[i].path;
+    unsigned char *changed = 0;
+    int nchanged = 0;
+    int flags = reloadscene(ss->scene, file, objs, nobjs, &changed, &nchanged);
+    xfree(objs);
+    // a file saved halfway leaves the last good scene up, the next save
+    // is picked up as usual
+    if (flags & RELOAD_FAILED) {
+        printf("watch: keeping the previous scene\n");
+        return;
+    }
+    if (flags & RELOAD_VIEW) {
+        printf("watch: view changed, starting over\n");
+        Scene *s = newscene(file);
+        if (!s) {
+            printf("watch: keeping the previous scene\n");
+            return;
+        }
+        stop(ss);
+        start(ss, s, opts);
+        return;
+    }
+    Scene *s = ss->scene;
+    Frame *f = &ss->frame;
+    Camera cam;
+    initcamera(&cam, s, ss->bmp.width, ss->bmp.height);
+    // tiles that saw a shape before the change, or would see it after
+    unsigned char *todo = xcalloc(&_alloc, ss->ntiles, 1);
+    for (int i = 0; i < ss->ntiles; i++) {
+        if (touches(f, i, changed, nchanged)) {
+            todo[i] = 1;
+            continue;
+        }
+        int x0, y0, x1, y1;
+        tilerect(&ss->bmp, opts->tilesize, i, &x0, &y0, &x1, &y1);
+        for (int k = 0; k < nchanged && k < s->nshapes && !todo[i]; k++)
+            if (changed[k])
+                todo[i] = affects(s, f->gb, &cam, s->shapes[k], x0, y0, x1, y1);
+    }
+    for (int i = 0; i < ss->ntiles; i++) {
+        if (!todo[i]) continue;
+        int x0, y0, x1, y1;
+        tilerect(&ss->bmp, opts->tilesize, i, &x0, &y0, &x1, &y1);
+        cleargbuffer(f->gb, x0, y0, x1, y1);
+        memset(&f->touch[i * f->touchbytes], 0, f->touchbytes);
+    }
+    resizetouch(ss);
+    if (flags & RELOAD_LIGHTS) {
+        // hits stay valid, only shading and moved lights' shadows redo
+        syncgbufferlights(f->gb, s);
+        memset(todo, 1, ss->ntiles);
+    }
+    printf("watch: scene updated in %.3fs\n", now() - t0);
+    render(ss, opts, todo);
+    xfree(todo);
+    xfree(changed);
+}
+
+void watchscene(const char *file, RenderOpts *opts) {
+    // progress lines should show up as they happen, even in a log file
+    setvbuf(stdout, 0, _IOLBF, 0);
+    Watcher wt = {0};
+    wt.fd = inotify_init();
+    if (wt.fd < 0) err("watch: inotify unavailable");
+    Scene *s = newscene(file);
+    if (!s) err("watch: can't load %s", file);
+    Session ss;
+    start(&ss, s, opts);
+    for (;;) {
+        addscenefiles(&wt, file, ss.scene);
+        waitchanges(&wt);
+        update(&ss, file, opts, &wt);
+    }
+}
@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <raytracer/math.h>
+#include <raytracer/obj.h>
+#include <raytracer/raytracer.h>
+#include <raytracer/render.h>
+#include <raytracer/shade.h>
+#include <raytracer/wavefront.h>
+#include <raytracer/util.h>
+
+#define NDEPTHS (MAX_RECUR + 1)
+
+static Allocator _alloc = {"wavefront"};
+
+enum {
+    PATH_NONE,
+    PATH_MISS,
+    PATH_HIT,
+};
+
+// What one bounce of one path left behind for the final fold.
+typedef struct {
+    int state;
+    Vec3 lights;
+    float refl;
+} Bounce;
+
+typedef struct {
+    Ray ray;
+    float dist;
+    Light *light;
+    float weight;
+    int path;
+    int blocked;
+} ShadowRay;
+
+typedef struct {
+    unsigned key;
+    int idx;
+} SortKey;
+
+typedef struct {
+    int n;
+    Ray *rays;
+    Hit *hits;
+    int *hitok;
+    int *order;
+    Rng *rngs;
+    Bounce *bounces; // NDEPTHS per path
+    ShadowRay *shadows;
+    int nshadows;
+    int capshadows;
+    SortKey *keys;
+    int capkeys;
+} Wave;
+
+static SortKey *growkeys(Wave *wv, int n) {
+    if (n > wv->capkeys) {
+        wv->capkeys = n;
+        wv->keys = xrealloc(&_alloc, wv->keys, 2 * n * sizeof(SortKey));
+    }
+    return wv->keys;
+}
+
+// LSD radix sort, 8 bits per pass. Stable, so equal keys keep their
+// queue order.
+static void sortkeys(SortKey *keys, SortKey *tmp, int n) {
+    for (int shift = 0; shift < 32; shift += 8) {
+        int count[257] = {0};
+        for (int i = 0; i < n; i++)
+            count[((keys[i].key >> shift) & 0xff) + 1]++;
+        for (int i = 0; i < 256; i++)
+            count[i + 1] += count[i];
+        for (int i = 0; i < n; i++)
+            tmp[count[(keys[i].key >> shift) & 0xff]++] = keys[i];
+        SortKey *t = keys;
+        keys = tmp;
+        tmp = t;
+    }
+}
+
+// Orders rays by direction octant, then by the Morton code of their
+// origin within the batch bounds, so rays traced back to back start
+// close together and head the same way.
+static void sortrays(Wave *wv, Ray **rays, int *idx, int n, int *order) {
+    if (!n) return;
+    Vec3 min = rays[0]->orig, max = rays[0]->orig;
+    for (int i = 1; i < n; i++) {
+        Vec3 o = rays[i]->orig;
+        min = vec3(fminf(min.x, o.x), fminf(min.y, o.y), fminf(min.z, o.z));
+        max = vec3(fmaxf(max.x, o.x), fmaxf(max.y, o.y), fmaxf(max.z, o.z));
+    }
+    SortKey *keys = growkeys(wv, n);
+    for (int i = 0; i < n; i++) {
+        Ray *r = rays[i];
+        unsigned octant = (r->dir.x < 0) | (r->dir.y < 0) << 1 | (r->dir.z < 0) << 2;
+        unsigned cell = morton(r->orig, min, max);
+        keys[i] = (SortKey){octant << 29 | cell >> 1, idx[i]};
+    }
+    sortkeys(keys, keys + n, n);
+    for (int i = 0; i < n; i++)
+        order[i] = keys[i].idx;
+}
+
+static void pushshadow(Wave *wv, ShadowRay *sr) {
+    if (wv->nshadows == wv->capshadows) {
+        wv->capshadows = wv->capshadows ? wv->capshadows * 2 : 1024;
+        wv->shadows = xrealloc(&_alloc, wv->shadows, wv->capshadows * sizeof(ShadowRay));
+    }
+    wv->shadows[wv->nshadows++] = *sr;
+}
+
+static void traceshadows(Wave *wv, Scene *s, Worker *w) {
+    int n = wv->nshadows;
+    Ray **rays = xmalloc(&_alloc, n * sizeof(Ray *));
+    int *idx = xmalloc(&_alloc, n * sizeof(int));
+    int *order = xmalloc(&_alloc, n * sizeof(int));
+    for (int i = 0; i < n; i++) {
+        rays[i] = &wv->shadows[i].ray;
+        idx[i] = i;
+    }
+    sortrays(wv, rays, idx, n, order);
+    for (int i = 0; i < n; i++) {
+        ShadowRay *sr = &wv->shadows[order[i]];
+        sr->blocked = occluded(s, w, sr->light, &sr->ray, sr->dist);
+    }
+    xfree(rays);
+    xfree(idx);
+    xfree(order);
+}
+
+static void bounce(Wave *wv, Scene *s, Worker *w, int depth, int *live, int nlive) {
+    // intersect
+    Ray **rays = xmalloc(&_alloc, nlive * sizeof(Ray *));
+    for (int i = 0; i < nlive; i++)
+        rays[i] = &wv->rays[live[i]];
+    if (depth > 0)
+        sortrays(wv, rays, live, nlive, wv->order);
+    else
+        memcpy(wv->order, live, nlive * sizeof(int));
+    xfree(rays);
+    for (int i = 0; i < nlive; i++) {
+        int p = wv->order[i];
+        wv->hitok[p] = depth ? testscene(s, w, &wv->rays[p], &wv->hits[p])
+                : testprimary(s, w, &wv->rays[p], &wv->hits[p]);
+    }
+
+    // shade, queueing one shadow ray per picked light
+    wv->nshadows = 0;
+    for (int i = 0; i < nlive; i++) {
+        int p = live[i];
+        Bounce *b = &wv->bounces[p * NDEPTHS + depth];
+        if (!wv->hitok[p]) {
+            b->state = PATH_MISS;
+            continue;
+        }
+        b->state = PATH_HIT;
+        b->lights = vec3(0.0, 0.0, 0.0);
+        Hit *hit = &wv->hits[p];
+        w->rng = wv->rngs[p];
+        int npicks = picklights(s, w, hit->point, depth);
+        for (int k = 0; k < npicks; k++) {
+            ShadowRay sr = {0};
+            sr.dist = shadowray(hit, w->picks[k].light, &sr.ray);
+            sr.light = w->picks[k].light;
+            sr.weight = w->picks[k].weight;
+            sr.path = p;
+            pushshadow(wv, &sr);
+        }
+    }
+    traceshadows(wv, s, w);
+    // accumulate in queue order, which per path is the order xcast
+    // adds lights in, so the sums round the same way
+    for (int i = 0; i < wv->nshadows; i++) {
+        ShadowRay *sr = &wv->shadows[i];
+        if (sr->blocked) continue;
+        Hit *hit = &wv->hits[sr->path];
+        Bounce *b = &wv->bounces[sr->path * NDEPTHS + depth];
+        Vec3 v = vsub(wv->rays[sr->path].orig, hit->point);
+        Vec3 lc = lightcolor(hit, v, sr->light);
+        b->lights = vadd(b->lights, vmul(lc, sr->weight));
+    }
+}
+
+void renderwavefront(Bitmap *bmp, Scene *s, Worker *w,
+        int x0, int y0, int x1, int y1) {
+    Wave wv;
+    memset(&wv, 0, sizeof(Wave));
+    int tw = x1 - x0;
+    int n = tw * (y1 - y0);
+    wv.n = n;
+    wv.rays = xmalloc(&_alloc, n * sizeof(Ray));
+    wv.hits = xmalloc(&_alloc, n * sizeof(Hit));
+    wv.hitok = xmalloc(&_alloc, n * sizeof(int));
+    wv.order = xmalloc(&_alloc, n * sizeof(int));
+    wv.rngs = xmalloc(&_alloc, n * sizeof(Rng));
+    wv.bounces = xcalloc(&_alloc, n * NDEPTHS, sizeof(Bounce));
+    int *live = xmalloc(&_alloc, n * sizeof(int));
+
+    // generate
+    Camera cam;
+    initcamera(&cam, s, bmp->width, bmp->height);
+    for (int i = 0; i < n; i++) {
+        int x = x0 + i % tw;
+        int y = y0 + i / tw;
+        wv.rays[i] = primaryray(&cam, x, y);
+        rngseed(&wv.rngs[i], s->seed, y * bmp->width + x);
+        live[i] = i;
+    }
+    w->stats.primaryrays += n;
+
+    int nlive = n;
+    for (int depth = 0; depth < NDEPTHS && nlive; depth++) {
+        bounce(&wv, s, w, depth, live, nlive);
+        if (depth == MAX_RECUR) break;
+        // spawn reflections
+        int nnext = 0;
+        for (int i = 0; i < nlive; i++) {
+            int p = live[i];
+            if (!wv.hitok[p]) continue;
+            Hit *hit = &wv.hits[p];
+            wv.bounces[p * NDEPTHS + depth].refl = hit->shape->mat.reflectiveness;
+            wv.rays[p] = reflray(&wv.rays[p], hit);
+            live[nnext++] = p;
+        }
+        w->stats.reflectionrays += nnext;
+        nlive = nnext;
+    }
+
+    // fold bounces back to front, same as xcast unwinding
+    for (int i = 0; i < n; i++) {
+        Vec3 c = s->background;
+        for (int d = NDEPTHS - 1; d >= 0; d--) {
+            Bounce *b = &wv.bounces[i * NDEPTHS + d];
+            if (b->state == PATH_MISS)
+                c = s->background;
+            else if (b->state == PATH_HIT)
+                c = d < MAX_RECUR ? vadd(b->lights, vmul(c, b->refl)) : b->lights;
+        }
+        int x = x0 + i % tw;
+        int y = y0 + i / tw;
+        bmp->pixels[y * bmp->width + x] = tocolor(c);
+    }
+
+    xfree(wv.rays);
+    xfree(wv.hits);
+    xfree(wv.hitok);
+    xfree(wv.order);
+    xfree(wv.rngs);
+    xfree(wv.bounces);
+    xfree(wv.shadows);
+    xfree(wv.keys);
+    xfree(live);
+}